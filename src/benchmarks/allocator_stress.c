@@ -0,0 +1,251 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../memory/memory_manager.h"
+#include "../common/fast_timer.h"
+
+// Drives the real page allocator (linked in with MEMORY_MANAGER_NO_MAIN)
+// from many threads. Usage: allocator_stress [max_threads] [ops_per_thread]
+#define MAX_THREADS 64
+#define DEFAULT_OPS_PER_THREAD 5000
+#define HOLD_MAX 64  // Pages a churn thread keeps live at most
+#define RING_SIZE 256
+
+typedef enum {
+    MIX_CHURN,              // Random alloc/free on the thread's own pages
+    MIX_PRODUCER_CONSUMER   // Half the threads allocate, their partners free
+} MixKind;
+
+typedef struct {
+    const char* name;
+    MixKind kind;
+    int alloc_pct;  // Churn only: chance an op is an allocation while below HOLD_MAX
+} Mix;
+
+static const Mix mixes[] = {
+    { "churn 50/50", MIX_CHURN, 50 },
+    { "alloc-heavy 90/10", MIX_CHURN, 90 },
+    { "producer/consumer", MIX_PRODUCER_CONSUMER, 0 }
+};
+
+typedef struct {
+    int pages[RING_SIZE];
+    int head;  // Written by the producer
+    int tail;  // Written by the consumer
+} PageRing;
+
+typedef struct {
+    const Mix* mix;
+    int ops;
+    unsigned int seed;
+    PageRing* ring;
+    int producer;
+    uint32_t* latencies;  // One entry per op, in ns
+    int failures;
+    pthread_barrier_t* start;
+} Worker;
+
+static PageRing rings[MAX_THREADS / 2];
+
+static inline uint32_t timed_ns(uint64_t start_ticks) {
+    uint64_t ns = fast_timer_elapsed_ns(start_ticks, fast_timer_now());
+    return ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+}
+
+static void run_churn(Worker* w) {
+    int held[HOLD_MAX];
+    int count = 0;
+    
+    for (int i = 0; i < w->ops; i++) {
+        w->seed = w->seed * 1103515245u + 12345u;
+        unsigned int r = w->seed >> 8;
+        int do_alloc = count == 0 || (count < HOLD_MAX && (int)(r % 100) < w->mix->alloc_pct);
+        
+        uint64_t start = fast_timer_now();
+        if (do_alloc) {
+            int page = allocate_page();
+            w->latencies[i] = timed_ns(start);
+            if (page >= 0) {
+                held[count++] = page;
+            } else {
+                w->failures++;
+            }
+        } else {
+            // Free a random held page so the bitmap sees scattered holes
+            int slot = (int)((r >> 8) % (unsigned)count);
+            int page = held[slot];
+            held[slot] = held[--count];
+            free_page(page);
+            w->latencies[i] = timed_ns(start);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free_page(held[i]);
+    }
+}
+
+static void run_producer(Worker* w) {
+    PageRing* ring = w->ring;
+    for (int i = 0; i < w->ops; i++) {
+        uint64_t start = fast_timer_now();
+        int page = allocate_page();
+        w->latencies[i] = timed_ns(start);
+        if (page < 0) {
+            w->failures++;
+        }
+        // Failed allocations still go through the ring so the consumer's count matches
+        while (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+               __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->pages[ring->head % RING_SIZE] = page;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void run_consumer(Worker* w) {
+    PageRing* ring = w->ring;
+    for (int i = 0; i < w->ops; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+            sched_yield();
+        }
+        int page = ring->pages[ring->tail % RING_SIZE];
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        
+        uint64_t start = fast_timer_now();
+        if (page >= 0) {
+            free_page(page);
+        }
+        w->latencies[i] = timed_ns(start);
+    }
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    pthread_barrier_wait(w->start);
+    if (w->mix->kind == MIX_CHURN) {
+        run_churn(w);
+    } else if (w->producer) {
+        run_producer(w);
+    } else {
+        run_consumer(w);
+    }
+    return NULL;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    double mops;
+    uint32_t p50, p90, p99, p999;
+    int failures;
+} StressResult;
+
+static StressResult run_stress(const Mix* mix, int threads, int ops, uint32_t* latencies) {
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    struct timespec start_time, end_time;
+    StressResult result;
+    memset(&result, 0, sizeof(result));
+    
+    pthread_barrier_init(&start, NULL, (unsigned)threads + 1);
+    memset(rings, 0, sizeof(rings));
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){
+            .mix = mix,
+            .ops = ops,
+            .seed = 2024u + (unsigned int)i * 7919u,
+            .ring = &rings[i / 2],
+            .producer = (i % 2 == 0),
+            .latencies = latencies + (size_t)i * ops,
+            .start = &start
+        };
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    }
+    
+    // Every thread is created and waiting; none can start before we join the
+    // barrier, so reading the clock first never misses work
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        result.failures += workers[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    pthread_barrier_destroy(&start);
+    
+    double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    size_t total = (size_t)threads * ops;
+    result.mops = total / seconds / 1e6;
+    
+    qsort(latencies, total, sizeof(uint32_t), compare_u32);
+    result.p50 = latencies[total / 2];
+    result.p90 = latencies[total * 90 / 100];
+    result.p99 = latencies[total * 99 / 100];
+    result.p999 = latencies[total * 999 / 1000];
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+    int ops = argc > 2 ? atoi(argv[2]) : DEFAULT_OPS_PER_THREAD;
+    if (max_threads < 1 || max_threads > MAX_THREADS || ops < 1) {
+        fprintf(stderr, "usage: %s [max_threads 1-%d] [ops_per_thread]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+    
+    printf("Page Allocator Stress Test\n");
+    printf("==========================\n\n");
+    
+    set_memory_verbose(0);
+    if (initialize_memory() != MEM_SUCCESS) {
+        fprintf(stderr, "Failed to initialize memory manager\n");
+        return 1;
+    }
+    fast_timer_init();
+    printf("%d pages of %d bytes, %d ops per thread, latencies via %s\n",
+           NUM_PAGES, PAGE_SIZE, ops, fast_timer_source());
+    
+    uint32_t* latencies = malloc(sizeof(uint32_t) * (size_t)max_threads * ops);
+    if (!latencies) {
+        fprintf(stderr, "Out of memory for latency samples\n");
+        return 1;
+    }
+    
+    static const AllocationMode modes[] = { MEM_MODE_LOCKED, MEM_MODE_LOCKFREE };
+    static const char* mode_names[] = { "mutex", "lock-free" };
+    
+    for (size_t m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+        for (int mode = 0; mode < 2; mode++) {
+            set_allocation_mode(modes[mode]);
+            printf("\n--- %s, %s ---\n", mixes[m].name, mode_names[mode]);
+            printf("%-8s %-10s %-10s %-10s %-10s %-10s %s\n",
+                   "Threads", "Mops/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "Failures");
+            
+            // Producer/consumer needs at least one pair
+            int first = mixes[m].kind == MIX_PRODUCER_CONSUMER ? 2 : 1;
+            for (int threads = first; threads <= max_threads; threads *= 2) {
+                StressResult r = run_stress(&mixes[m], threads, ops, latencies);
+                printf("%-8d %-10.2f %-10u %-10u %-10u %-10u %d\n", threads, r.mops,
+                       r.p50, r.p90, r.p99, r.p999, r.failures);
+            }
+        }
+    }
+    
+    free(latencies);
+    set_memory_verbose(1);
+    print_memory_status();
+    cleanup_memory_manager();
+    return 0;
+}
\ No newline at end of file
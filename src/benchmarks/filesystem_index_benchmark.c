@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../filesystem/file_system_enhanced.h"
+
+// Links the real file system (built with -DFILE_SYSTEM_NO_MAIN) and compares
+// its two index layouts on the same names
+#define MAX_BENCH_FILES 1000000
+#define LOOKUPS 500000
+#define SHARD_DIRS 64
+
+static char names[MAX_BENCH_FILES][MAX_FILENAME];
+static char missing_names[MAX_BENCH_FILES][MAX_FILENAME];
+static int order[LOOKUPS];
+
+static double elapsed_ns(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static double time_lookups(char (*set)[MAX_FILENAME], int expect) {
+    struct timespec start_time, end_time;
+    int wrong = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < LOOKUPS; i++) {
+        wrong += (read_file(set[order[i]]) == FS_SUCCESS) != expect;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    
+    if (wrong) {
+        printf("  (%d lookups returned the wrong result)\n", wrong);
+    }
+    return elapsed_ns(&start_time, &end_time) / LOOKUPS;
+}
+
+typedef struct {
+    double create_ns;
+    double hit_ns;
+    double miss_ns;
+} IndexResult;
+
+static IndexResult run_index(IndexMode mode, int files) {
+    struct timespec start_time, end_time;
+    IndexResult result;
+    
+    init_filesystem();
+    set_index_mode(mode);
+    set_lookup_timing_interval(0);
+    fs_mkdir("dataset");
+    for (int i = 0; i < SHARD_DIRS; i++) {
+        char dir[MAX_FILENAME];
+        snprintf(dir, sizeof(dir), "dataset/shard_%02d", i);
+        fs_mkdir(dir);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < files; i++) {
+        create_file(names[i], "x");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    result.create_ns = elapsed_ns(&start_time, &end_time) / files;
+    
+    unsigned int seed = 7;
+    for (int i = 0; i < LOOKUPS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        order[i] = (int)((seed >> 8) % (unsigned int)files);
+    }
+    result.hit_ns = time_lookups(names, 1);
+    result.miss_ns = time_lookups(missing_names, 0);
+    
+    cleanup_filesystem();
+    return result;
+}
+
+int main() {
+    printf("File System Index: Chained Hash Table vs Swiss Table\n");
+    printf("====================================================\n\n");
+    
+    set_fs_verbose(0);
+    // A dataset tree: every lookup walks two directories before the file
+    for (int i = 0; i < MAX_BENCH_FILES; i++) {
+        snprintf(names[i], MAX_FILENAME, "dataset/shard_%02d/sample_%07d.bin", i % SHARD_DIRS, i);
+        snprintf(missing_names[i], MAX_FILENAME, "dataset/shard_%02d/absent_%07d.bin", i % SHARD_DIRS, i);
+    }
+    
+    printf("%-8s %-8s %-12s %-12s %-12s\n", "Files", "Index", "Create (ns)", "Hit (ns)", "Miss (ns)");
+    for (int files = 1000; files <= MAX_BENCH_FILES; files *= 10) {
+        IndexResult chained = run_index(FS_INDEX_CHAINED, files);
+        IndexResult swiss = run_index(FS_INDEX_SWISS, files);
+        printf("%-8d %-8s %-12.1f %-12.1f %-12.1f\n", files, "chained",
+               chained.create_ns, chained.hit_ns, chained.miss_ns);
+        printf("%-8s %-8s %-12.1f %-12.1f %-12.1f\n", "", "swiss",
+               swiss.create_ns, swiss.hit_ns, swiss.miss_ns);
+        printf("%-8s %-8s %-12s %-12.2f %-12.2f\n\n", "", "speedup", "",
+               chained.hit_ns / swiss.hit_ns, chained.miss_ns / swiss.miss_ns);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../filesystem/file_system_enhanced.h"
+
+// Drives the real file system (linked in with FILE_SYSTEM_NO_MAIN) from
+// many threads. Usage: filesystem_scaling_benchmark [max_threads] [ops_per_thread]
+#define MAX_THREADS 64
+#define DEFAULT_OPS_PER_THREAD 10000
+#define PRELOAD_FILES 100000
+#define PRELOAD_DIRS 100
+#define OWN_FILES 64  // Names each writer cycles through in its own directory
+
+typedef enum {
+    WORK_LOOKUP,        // read_file on random preloaded names
+    WORK_PREAD,         // fs_pread through handles opened up front
+    WORK_CREATE_DELETE, // Each thread creates and deletes its own files
+    WORK_MIXED          // 90% lookups, 10% create/delete of own files
+} WorkKind;
+
+typedef struct {
+    const char* name;
+    WorkKind kind;
+} Workload;
+
+static const Workload workloads[] = {
+    { "lookups", WORK_LOOKUP },
+    { "handle preads", WORK_PREAD },
+    { "create/delete", WORK_CREATE_DELETE },
+    { "mixed 90/10", WORK_MIXED }
+};
+
+typedef struct {
+    const Workload* work;
+    int id;
+    int ops;
+    unsigned int seed;
+    int failures;
+    pthread_barrier_t* start;
+} Worker;
+
+static char names[PRELOAD_FILES][MAX_FILENAME];
+static FsHandle handles[PRELOAD_FILES];
+
+static int create_delete_op(Worker* w, int i) {
+    char name[MAX_FILENAME];
+    snprintf(name, sizeof(name), "writer_%02d/%02d", w->id, i % OWN_FILES);
+    // Alternate passes over the own names: create them all, then delete them all
+    if ((i / OWN_FILES) % 2 == 0) {
+        return create_file(name, "payload") == FS_SUCCESS;
+    }
+    return delete_file(name) == FS_SUCCESS;
+}
+
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    char buf[64];
+    size_t got;
+    int writes = 0;
+    
+    pthread_barrier_wait(w->start);
+    for (int i = 0; i < w->ops; i++) {
+        w->seed = w->seed * 1103515245u + 12345u;
+        unsigned int r = w->seed >> 8;
+        int ok = 1;
+        
+        switch (w->work->kind) {
+        case WORK_LOOKUP:
+            ok = read_file(names[r % PRELOAD_FILES]) == FS_SUCCESS;
+            break;
+        case WORK_PREAD:
+            ok = fs_pread(handles[r % PRELOAD_FILES], buf, sizeof(buf), 0, &got) == FS_SUCCESS;
+            break;
+        case WORK_CREATE_DELETE:
+            ok = create_delete_op(w, i);
+            break;
+        case WORK_MIXED:
+            if (r % 10 == 0) {
+                ok = create_delete_op(w, writes++);
+            } else {
+                ok = read_file(names[r % PRELOAD_FILES]) == FS_SUCCESS;
+            }
+            break;
+        }
+        w->failures += !ok;
+    }
+    
+    // Leave no writer files behind for the next run: part way through a
+    // create pass the first 'pos' names exist, part way through a delete pass the rest
+    if (w->work->kind == WORK_CREATE_DELETE || w->work->kind == WORK_MIXED) {
+        int done = w->work->kind == WORK_MIXED ? writes : w->ops;
+        int pos = done % OWN_FILES;
+        int creating = (done / OWN_FILES) % 2 == 0;
+        for (int i = creating ? 0 : pos; i < (creating ? pos : OWN_FILES); i++) {
+            char name[MAX_FILENAME];
+            snprintf(name, sizeof(name), "writer_%02d/%02d", w->id, i);
+            delete_file(name);
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    double mops;
+    int failures;
+} ScalingResult;
+
+static ScalingResult run_scaling(const Workload* work, int threads, int ops) {
+    pthread_t tids[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    struct timespec start_time, end_time;
+    ScalingResult result = { 0, 0 };
+    
+    pthread_barrier_init(&start, NULL, (unsigned)threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (Worker){
+            .work = work,
+            .id = i,
+            .ops = ops,
+            .seed = 4099u + (unsigned int)i * 7919u,
+            .start = &start
+        };
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        result.failures += workers[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    pthread_barrier_destroy(&start);
+    
+    double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    result.mops = (double)threads * ops / seconds / 1e6;
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : MAX_THREADS;
+    int ops = argc > 2 ? atoi(argv[2]) : DEFAULT_OPS_PER_THREAD;
+    if (max_threads < 1 || max_threads > MAX_THREADS || ops < 1) {
+        fprintf(stderr, "usage: %s [max_threads 1-%d] [ops_per_thread]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+    
+    printf("File System Thread Scaling\n");
+    printf("==========================\n\n");
+    printf("%d preloaded files, %d ops per thread\n", PRELOAD_FILES, ops);
+    
+    set_fs_verbose(0);
+    static const IndexMode modes[] = { FS_INDEX_CHAINED, FS_INDEX_SWISS };
+    static const char* mode_names[] = { "chained", "swiss" };
+    
+    for (int mode = 0; mode < 2; mode++) {
+        if (init_filesystem() != FS_SUCCESS) {
+            fprintf(stderr, "Failed to initialize file system\n");
+            return 1;
+        }
+        set_index_mode(modes[mode]);
+        set_lookup_timing_interval(0);
+        char dir[MAX_FILENAME];
+        fs_mkdir("preload");
+        for (int i = 0; i < PRELOAD_DIRS; i++) {
+            snprintf(dir, sizeof(dir), "preload/dir_%02d", i);
+            fs_mkdir(dir);
+        }
+        for (int i = 0; i < MAX_THREADS; i++) {
+            snprintf(dir, sizeof(dir), "writer_%02d", i);
+            fs_mkdir(dir);
+        }
+        for (int i = 0; i < PRELOAD_FILES; i++) {
+            snprintf(names[i], MAX_FILENAME, "preload/dir_%02d/file_%06d", i % PRELOAD_DIRS, i);
+            create_file(names[i], "preloaded file contents");
+            fs_open(names[i], &handles[i]);
+        }
+        
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            printf("\n--- %s, %s index ---\n", workloads[w].name, mode_names[mode]);
+            printf("%-8s %-10s %-10s %s\n", "Threads", "Mops/s", "Scaling", "Failures");
+            
+            double base = 0;
+            for (int threads = 1; threads <= max_threads; threads *= 2) {
+                ScalingResult r = run_scaling(&workloads[w], threads, ops);
+                if (threads == 1) {
+                    base = r.mops;
+                }
+                printf("%-8d %-10.2f %-10.2f %d\n", threads, r.mops, r.mops / base, r.failures);
+            }
+        }
+        
+        set_fs_verbose(1);
+        print_filesystem_status();
+        cleanup_filesystem();
+        set_fs_verbose(0);
+    }
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../malloc/page_malloc.h"
+
+// Built with -DPAGE_MALLOC_NO_OVERRIDE so malloc/free below are the C library's
+#define MAX_THREADS 8
+#define CHURN_ROUNDS 2000
+#define CHURN_BATCH 64
+#define HANDOFF_OBJECTS 200000
+#define RING_SIZE 1024
+
+typedef struct {
+    const char* name;
+    void* (*alloc)(size_t size);
+    void (*release)(void* ptr);
+} Allocator;
+
+static const Allocator allocators[] = {
+    { "glibc malloc", malloc, free },
+    { "page malloc", pm_malloc, pm_free }
+};
+
+static double elapsed_ns(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Mostly small objects with an occasional multi-page one
+static size_t random_size(unsigned int* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    unsigned int r = *seed >> 8;
+    if (r % 64 == 0) return 4096 + r % 16384;
+    return 16 + r % 1024;
+}
+
+// Multi-page buffers only, every one a run from the page allocator
+static size_t random_large_size(unsigned int* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return 8192 + (*seed >> 8) % 57344;
+}
+
+typedef struct {
+    const Allocator* allocator;
+    size_t (*size)(unsigned int* seed);
+    unsigned int seed;
+} ChurnArgs;
+
+// Each thread allocates a batch, touches it and frees it in a different order
+static void* churn_worker(void* arg) {
+    ChurnArgs* args = arg;
+    void* batch[CHURN_BATCH];
+    
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            batch[i] = args->allocator->alloc(args->size(&args->seed));
+            *(volatile char*)batch[i] = (char)i;
+        }
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            args->allocator->release(batch[(i * 7) % CHURN_BATCH]);
+        }
+    }
+    return NULL;
+}
+
+// Single-producer single-consumer ring: every object is freed by a thread
+// other than the one that allocated it
+typedef struct {
+    void* slots[RING_SIZE];
+    int head;  // Next slot to fill, written by the producer
+    int tail;  // Next slot to drain, written by the consumer
+    const Allocator* allocator;
+    unsigned int seed;
+} HandoffRing;
+
+static void* producer_worker(void* arg) {
+    HandoffRing* ring = arg;
+    for (int i = 0; i < HANDOFF_OBJECTS; i++) {
+        void* ptr = ring->allocator->alloc(random_size(&ring->seed));
+        *(volatile char*)ptr = (char)i;
+        while (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+               __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        ring->slots[ring->head % RING_SIZE] = ptr;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void* consumer_worker(void* arg) {
+    HandoffRing* ring = arg;
+    for (int i = 0; i < HANDOFF_OBJECTS; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+            sched_yield();
+        }
+        void* ptr = ring->slots[ring->tail % RING_SIZE];
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+        ring->allocator->release(ptr);
+    }
+    return NULL;
+}
+
+static double run_churn(const Allocator* allocator, int threads, size_t (*size)(unsigned int*)) {
+    pthread_t workers[MAX_THREADS];
+    ChurnArgs args[MAX_THREADS];
+    struct timespec start_time, end_time;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < threads; i++) {
+        args[i].allocator = allocator;
+        args[i].size = size;
+        args[i].seed = 1234u + (unsigned int)i;
+        pthread_create(&workers[i], NULL, churn_worker, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    
+    // One malloc plus one free per object
+    return elapsed_ns(&start_time, &end_time) / ((double)threads * CHURN_ROUNDS * CHURN_BATCH * 2);
+}
+
+static double run_handoff(const Allocator* allocator, int pairs) {
+    pthread_t producers[MAX_THREADS / 2], consumers[MAX_THREADS / 2];
+    static HandoffRing rings[MAX_THREADS / 2];
+    struct timespec start_time, end_time;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < pairs; i++) {
+        memset(&rings[i], 0, sizeof(HandoffRing));
+        rings[i].allocator = allocator;
+        rings[i].seed = 4321u + (unsigned int)i;
+        pthread_create(&consumers[i], NULL, consumer_worker, &rings[i]);
+        pthread_create(&producers[i], NULL, producer_worker, &rings[i]);
+    }
+    for (int i = 0; i < pairs; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    
+    return elapsed_ns(&start_time, &end_time) / ((double)pairs * HANDOFF_OBJECTS * 2);
+}
+
+int main() {
+    printf("Page Malloc vs glibc malloc\n");
+    printf("===========================\n\n");
+    
+    printf("--- Same-thread churn (batches of %d, 16 B - 20 KB) ---\n", CHURN_BATCH);
+    printf("%-8s %-16s %-16s %-10s\n", "Threads", "glibc (ns/op)", "page (ns/op)", "Speedup");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double glibc_ns = run_churn(&allocators[0], threads, random_size);
+        double page_ns = run_churn(&allocators[1], threads, random_size);
+        printf("%-8d %-16.1f %-16.1f %.2fx\n", threads, glibc_ns, page_ns, glibc_ns / page_ns);
+    }
+    
+    printf("\n--- Large-object churn (batches of %d, 8 KB - 64 KB) ---\n", CHURN_BATCH);
+    printf("%-8s %-16s %-16s %-10s\n", "Threads", "glibc (ns/op)", "page (ns/op)", "Speedup");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double glibc_ns = run_churn(&allocators[0], threads, random_large_size);
+        double page_ns = run_churn(&allocators[1], threads, random_large_size);
+        printf("%-8d %-16.1f %-16.1f %.2fx\n", threads, glibc_ns, page_ns, glibc_ns / page_ns);
+    }
+    
+    printf("\n--- Cross-thread frees (producer allocates, consumer frees) ---\n");
+    printf("%-8s %-16s %-16s %-10s\n", "Pairs", "glibc (ns/op)", "page (ns/op)", "Speedup");
+    for (int pairs = 1; pairs <= MAX_THREADS / 2; pairs *= 2) {
+        double glibc_ns = run_handoff(&allocators[0], pairs);
+        double page_ns = run_handoff(&allocators[1], pairs);
+        printf("%-8d %-16.1f %-16.1f %.2fx\n", pairs, glibc_ns, page_ns, glibc_ns / page_ns);
+    }
+    
+    pm_print_stats();
+    return 0;
+}
\ No newline at end of file
@@ -4,8 +4,13 @@
 #include <time.h>
 #include <string.h>
 
+#include "../common/fast_timer.h"
+
 #define NUM_FRAMES 4
 #define HASH_TABLE_SIZE 16
+#ifndef ACCESS_TIMING_INTERVAL
+#define ACCESS_TIMING_INTERVAL 64
+#endif
 
 typedef enum {
     LRU_SUCCESS = 0,
@@ -17,7 +22,7 @@ typedef enum {
 typedef struct PageNode {
     int page_number;
     int frame_number;
-    struct timespec access_time;
+    uint64_t access_time;  // fast_timer_now() ticks
     struct PageNode* prev;
     struct PageNode* next;
     struct PageNode* hash_next;
@@ -33,7 +38,9 @@ typedef struct {
     int page_faults;
     int page_hits;
     int total_accesses;
-    double total_access_time_ms;
+    uint64_t total_access_time_ns;  // Over sampled accesses only
+    int timed_accesses;
+    uint32_t timing_interval;
 } LRUCache;
 
 static LRUCache lru_cache;
@@ -42,10 +49,6 @@ static unsigned int hash_function(int page_number) {
     return page_number % HASH_TABLE_SIZE;
 }
 
-static double timespec_to_ms(struct timespec *ts) {
-    return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
-}
-
 LRUError init_lru_cache() {
     memset(&lru_cache, 0, sizeof(LRUCache));
     
@@ -71,6 +74,9 @@ LRUError init_lru_cache() {
         return LRU_ERROR_INIT_FAILED;
     }
     
+    fast_timer_init();
+    lru_cache.timing_interval = ACCESS_TIMING_INTERVAL;
+    
     printf("Enhanced LRU Page Replacement with O(1) Operations\n");
     printf("================================================\n\n");
     printf("  - Hash table + doubly-linked list for O(1) access\n");
@@ -161,8 +167,8 @@ static PageNode* get_lru_frame() {
 LRUError access_page(int page_number) {
     if (page_number < 0) return LRU_ERROR_INVALID_PAGE;
     
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    int timed = fast_timer_sample(lru_cache.timing_interval);
+    uint64_t start_ticks = timed ? fast_timer_now() : 0;
     
     pthread_mutex_lock(&lru_cache.lock);
     
@@ -174,7 +180,7 @@ LRUError access_page(int page_number) {
     if (node) {
         // Page hit - move to head
         lru_cache.page_hits++;
-        clock_gettime(CLOCK_MONOTONIC, &node->access_time);
+        node->access_time = fast_timer_now();
         move_to_head(node);
         printf("Page %d found in frame %d (HIT)\n", page_number, node->frame_number);
     } else {
@@ -196,7 +202,7 @@ LRUError access_page(int page_number) {
         if (!frame_to_use) {
             // Use LRU replacement
             frame_to_use = get_lru_frame();
-            printf("Replacing page %d in frame %d using LRU policy\n", 
+            printf("Replacing page %d in frame %d using LRU policy\n",
                    frame_to_use->page_number, frame_to_use->frame_number);
             
             // Remove old page from hash table
@@ -206,34 +212,36 @@ LRUError access_page(int page_number) {
         
         // Update frame with new page
         frame_to_use->page_number = page_number;
-        clock_gettime(CLOCK_MONOTONIC, &frame_to_use->access_time);
+        frame_to_use->access_time = fast_timer_now();
         
         // Add to hash table and move to head
         add_to_hash(frame_to_use);
         add_to_head(frame_to_use);
     }
     
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    
-    struct timespec diff;
-    if (end_time.tv_nsec < start_time.tv_nsec) {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec - 1;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec + 1000000000;
-    } else {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec;
+    uint64_t access_ns = 0;
+    if (timed) {
+        access_ns = fast_timer_elapsed_ns(start_ticks, fast_timer_now());
+        lru_cache.total_access_time_ns += access_ns;
+        lru_cache.timed_accesses++;
     }
-    
-    double access_time = timespec_to_ms(&diff);
-    lru_cache.total_access_time_ms += access_time;
     lru_cache.total_accesses++;
     
     pthread_mutex_unlock(&lru_cache.lock);
     
-    printf("Access time: %.3f ms\n", access_time);
+    if (timed) {
+        printf("Access time: %llu ns\n", (unsigned long long)access_ns);
+    }
     return LRU_SUCCESS;
 }
 
+// Times 1 in 'interval' accesses; 1 times all of them, 0 none
+void set_access_timing_interval(uint32_t interval) {
+    pthread_mutex_lock(&lru_cache.lock);
+    lru_cache.timing_interval = interval;
+    pthread_mutex_unlock(&lru_cache.lock);
+}
+
 void print_page_table() {
     pthread_mutex_lock(&lru_cache.lock);
     
@@ -245,9 +253,9 @@ void print_page_table() {
     int position = 1;
     
     while (current) {
-        printf("| %-6d | %-10d | %-15s |\n", 
+        printf("| %-6d | %-10d | %-15s |\n",
                current->frame_number, current->page_number,
-               position == 1 ? "Most Recent" : 
+               position == 1 ? "Most Recent" :
                (current == lru_cache.tail ? "Least Recent" : "Middle"));
         current = current->next;
         position++;
@@ -263,16 +271,17 @@ void print_lru_statistics() {
     
     printf("\n=== LRU Cache Statistics ===\n");
     printf("Total accesses: %d\n", lru_cache.total_accesses);
-    printf("Page hits: %d (%.2f%%)\n", lru_cache.page_hits, 
-           lru_cache.total_accesses > 0 ? 
+    printf("Page hits: %d (%.2f%%)\n", lru_cache.page_hits,
+           lru_cache.total_accesses > 0 ?
            (lru_cache.page_hits * 100.0) / lru_cache.total_accesses : 0.0);
     printf("Page faults: %d (%.2f%%)\n", lru_cache.page_faults,
-           lru_cache.total_accesses > 0 ? 
+           lru_cache.total_accesses > 0 ?
            (lru_cache.page_faults * 100.0) / lru_cache.total_accesses : 0.0);
     
-    if (lru_cache.total_accesses > 0) {
-        printf("Average access time: %.3f ms\n", 
-               lru_cache.total_access_time_ms / lru_cache.total_accesses);
+    if (lru_cache.timed_accesses > 0) {
+        printf("Average access time: %.1f ns (%d sampled, %s)\n",
+               (double)lru_cache.total_access_time_ns / lru_cache.timed_accesses,
+               lru_cache.timed_accesses, fast_timer_source());
     }
     printf("===========================\n\n");
     
@@ -292,6 +301,9 @@ int main() {
     
     print_page_table();
     
+    // The pattern is short, so time every access
+    set_access_timing_interval(1);
+    
     // Simulate page access pattern
     int access_pattern[] = {1, 2, 3, 4, 1, 2, 5, 1, 2, 3, 4, 5, 6, 1, 7, 8};
     int pattern_length = sizeof(access_pattern) / sizeof(access_pattern[0]);
@@ -0,0 +1,35 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fast_timer.h"
+
+// The one copy of the calibration, whichever components a program links
+int fast_timer_use_tsc;
+double fast_timer_ns_per_tick = 1.0;
+static pthread_once_t fast_timer_once = PTHREAD_ONCE_INIT;
+
+static void fast_timer_calibrate(void) {
+#ifdef FAST_TIMER_HAS_TSC
+    // Only an invariant TSC ticks at a constant rate across P-states and cores
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+        return;
+    }
+    
+    uint64_t start_ns = fast_timer_clock_ns();
+    uint64_t start_ticks = __rdtsc();
+    uint64_t end_ns;
+    do {
+        end_ns = fast_timer_clock_ns();
+    } while (end_ns - start_ns < FAST_TIMER_CALIBRATION_NS);
+    uint64_t end_ticks = __rdtsc();
+    
+    if (end_ticks > start_ticks) {
+        fast_timer_ns_per_tick = (double)(end_ns - start_ns) / (double)(end_ticks - start_ticks);
+        fast_timer_use_tsc = 1;
+    }
+#endif
+}
+
+void fast_timer_init(void) {
+    pthread_once(&fast_timer_once, fast_timer_calibrate);
+}
\ No newline at end of file
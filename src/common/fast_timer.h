@@ -0,0 +1,74 @@
+#ifndef FAST_TIMER_H
+#define FAST_TIMER_H
+
+// Low-overhead interval timing shared by the components. On x86 with an
+// invariant TSC, timestamps are raw cycle counts calibrated against
+// CLOCK_MONOTONIC once per process; elsewhere they fall back to
+// clock_gettime nanoseconds. Converting to time is deferred to
+// fast_timer_elapsed_ns() so the hot path is a single counter read.
+//
+// The calibration lives in fast_timer.c, so a program linking several
+// timed components calibrates once and converts all their ticks alike.
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define FAST_TIMER_HAS_TSC 1
+#endif
+
+#define FAST_TIMER_CALIBRATION_NS 2000000  // Long enough for <0.1% error
+
+extern int fast_timer_use_tsc;
+extern double fast_timer_ns_per_tick;
+
+// Per-thread xorshift state for sampling decisions, so deciding whether to
+// time an operation never touches shared memory
+static __thread uint32_t fast_timer_rng;
+
+static inline uint64_t fast_timer_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Calibrates on first use; cheap to call again
+void fast_timer_init(void);
+
+static inline uint64_t fast_timer_now(void) {
+#ifdef FAST_TIMER_HAS_TSC
+    if (fast_timer_use_tsc) {
+        return __rdtsc();
+    }
+#endif
+    return fast_timer_clock_ns();
+}
+
+static inline uint64_t fast_timer_elapsed_ns(uint64_t start, uint64_t end) {
+    return end > start ? (uint64_t)((end - start) * fast_timer_ns_per_tick) : 0;
+}
+
+static inline const char* fast_timer_source(void) {
+    return fast_timer_use_tsc ? "TSC" : "clock_gettime";
+}
+
+// True for roughly 1 in 'interval' calls per thread: 1 times everything,
+// 0 turns timing off
+static inline int fast_timer_sample(uint32_t interval) {
+    if (interval <= 1) return interval == 1;
+    
+    uint32_t x = fast_timer_rng;
+    if (x == 0) {
+        x = (uint32_t)(uintptr_t)&fast_timer_rng | 1u;  // Distinct seed per thread
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    fast_timer_rng = x;
+    return x % interval == 0;
+}
+
+#endif
\ No newline at end of file
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L  // pthread_rwlock_t under -std=c99
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,260 +7,2788 @@
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "file_system_enhanced.h"
+#include "../common/fast_timer.h"
+
+#define FS_INDEX_SHARDS 64       // Index shards, each with its own lock; a power of two
+#define FS_SHARD_BITS 6          // log2(FS_INDEX_SHARDS): the hash bits that pick the shard
+#define HASH_TABLE_SIZE 128      // Initial bucket count over all shards; each shard doubles on its own
+#define SHARD_BUCKETS (HASH_TABLE_SIZE / FS_INDEX_SHARDS)
+#define MAX_LOAD_FACTOR 1        // Files per bucket that triggers a resize
+#define REHASH_STEP 4            // Buckets (or Swiss groups) migrated per create/delete while resizing
+#define FILE_POOL_CHUNK 1024     // Files added to the pool each time it fills up
+#define FS_MAX_READERS 128       // Threads that can take the lock-free lookup path
+#define FS_RECLAIM_BATCH 64      // Deleted files between attempts to reclaim their slots
+#define LOCKLESS_ATTEMPTS 3      // Lock-free tries before a lookup falls back to the shard lock
+#define FS_DCACHE_SIZE 4096      // Dentry cache entries; a power of two
+#define FS_ROOT_INO 1
+#ifndef LOOKUP_TIMING_INTERVAL
+#define LOOKUP_TIMING_INTERVAL 16
+#endif
+
+// Swiss index: control bytes hold a 7-bit hash tag for a full slot, or one of
+// the two markers below (high bit set). A lookup compares 16 control bytes at
+// once and only touches slots whose tag matches.
+#define SWISS_GROUP 16
+#define SWISS_EMPTY ((uint8_t)0x80)
+#define SWISS_DELETED ((uint8_t)0xFE)
+#define SWISS_INITIAL_SLOTS SWISS_GROUP  // Per shard
+#define SWISS_MAX_LOAD(slots) ((slots) / 8 * 7)  // Full plus deleted slots
+
+// File contents live in FS_BLOCK_SIZE blocks from a shared block store,
+// mapped ext2-style: direct blocks, then one indirect and one double-indirect
+// block of block numbers. Block 0 is never handed out and marks a hole.
+#define FS_DIRECT_BLOCKS 12
+#define FS_PTRS_PER_BLOCK ((uint32_t)FS_BLOCK_PTRS)
+#define FS_BLOCK_CHUNK 256  // Blocks added to the store each time it fills up
+
+typedef struct {
+    uint32_t direct[FS_DIRECT_BLOCKS];
+    uint32_t indirect;
+    uint32_t double_indirect;
+} BlockMap;
 
-#define MAX_FILES 100
-#define MAX_FILENAME 50
-#define MAX_FILESIZE 256
-#define HASH_TABLE_SIZE 127
-
-typedef enum {
-    FS_SUCCESS = 0,
-    FS_ERROR_NULL_POINTER = -1,
-    FS_ERROR_FILE_EXISTS = -2,
-    FS_ERROR_FILE_NOT_FOUND = -3,
-    FS_ERROR_NO_SPACE = -4,
-    FS_ERROR_INVALID_NAME = -5,
-    FS_ERROR_INIT_FAILED = -6
-} FileSystemError;
+// Files no larger than the block map keep their bytes in its place
+#define FS_INLINE_SIZE ((int)sizeof(BlockMap))
 
+// Everything a lookup touches is in the first 128 bytes, one pair of cache
+// lines, and files are aligned to keep it that way
 typedef struct File {
-    char filename[MAX_FILENAME];
-    char data[MAX_FILESIZE];
-    int size;
-    int is_deleted;
-    struct timespec created_time;
-    struct timespec modified_time;
-    int access_count;
+    uint64_t hash;  // dentry_hash(parent, filename), so chains and resizes never rehash the name
     struct File* hash_next;
-} File;
+    uint64_t parent;  // Inode of the directory holding the file; with filename, the index key
+    char filename[MAX_FILENAME];  // The last component of the path
+    int is_dir;
+    int cached_misses;  // Directories: a missing name here is in the dentry cache
+    int is_inline;   // Contents are in contents.inline_data rather than blocks
+    int access_count;
+    uint32_t generation;  // Odd while live; bumped on claim and release, retiring old handles
+    uint64_t size;
+    uint64_t ino;    // Never reused, unlike pool slots, so no key outlives its directory
+    int pool_index;  // Fixed position in the pool
+    int order_pos;   // Position in slot_order; the file is live while below file_count
+    uint64_t retire_epoch;  // Epoch the file was deleted in; its slot is reused two epochs later
+    struct timespec created_time;  // Wall clock, so they survive a remount
+    struct timespec modified_time;
+    // Directory membership, under alloc_lock
+    struct File* parent_dir;
+    struct File* next_sibling;
+    struct File* prev_sibling;
+    union {
+        char inline_data[FS_INLINE_SIZE];
+        BlockMap map;
+        struct {
+            struct File* first_child;
+            int child_count;  // -1 once the directory is removed, refusing new entries
+        } dir;
+    } contents;
+} __attribute__((aligned(128))) File;
+
+// An index key: one name within one directory. The name is a component of
+// a longer path, so it isn't terminated.
+typedef struct {
+    uint64_t parent;
+    const char* name;
+    size_t len;
+    uint64_t hash;
+} DentryKey;
+
+// Where a path walk ends: the directory holding the last component, as it
+// was when the walk passed it, and the key of that component
+typedef struct {
+    File* dir;
+    uint32_t dir_generation;
+    DentryKey key;
+} PathTarget;
+
+// Full hash kept next to the pointer so mismatches are rejected without
+// touching the File
+typedef struct {
+    uint64_t hash;
+    File* file;
+} SwissSlot;
+
+// Lock-free readers may be walking a table while it is replaced, so tables
+// are only ever swapped by pointer and retired, never changed in shape
+typedef struct HashTable {
+    IndexMode mode;
+    File** buckets;      // Chained index
+    uint8_t* ctrl;       // Swiss index: one control byte per slot
+    SwissSlot* slots;
+    unsigned int size;   // Buckets, or slots for the Swiss index
+    int used;
+    int tombstones;      // Swiss index: deleted slots that still continue probes
+    uint64_t retire_epoch;
+    struct HashTable* retired_next;
+} HashTable;
 
+// One slice of the index, picked by the low FS_SHARD_BITS of the name hash,
+// so a name always lives in the same shard. The lock serializes writers and
+// guards the contents of the files indexed here; lookups can skip it (see
+// find_file_lockless). Resizing is incremental and per shard: while
+// rehash_index >= 0 both tables are live, units (buckets or Swiss groups) of
+// tables[0] below rehash_index have moved to tables[1], and every
+// create/delete in the shard migrates a few more. New files always go to the
+// newest table.
 typedef struct {
-    File* hash_table[HASH_TABLE_SIZE];
-    File file_pool[MAX_FILES];
     pthread_rwlock_t lock;
+    unsigned long seq;   // Odd while a writer is changing the index
+    HashTable* tables[2];
+    long rehash_index;
+} __attribute__((aligned(64))) IndexShard;  // Own cache line, so shards don't contend
+
+// A thread taking lock-free lookups announces the global epoch it started
+// in here. Each record is written only by its thread.
+typedef struct {
+    uint64_t epoch;  // 0 outside a lookup
+    int in_use;
+    // Lookup statistics, per reader so lookups share no counters
+    uint64_t lookups;
+    uint64_t timed_lookups;
+    uint64_t lookup_time_ns;
+    uint64_t dcache_hits;
+    uint64_t dcache_misses;
+} __attribute__((aligned(64))) ReaderRecord;
+
+#define FS_DCACHE_NAME_WORDS ((MAX_FILENAME + 7) / 8)
+
+// Dentry cache: a direct-mapped cache of (parent inode, name) lookups in
+// front of the index, holding directories and names known to be missing.
+// Path walks hit it for every directory on the way down, and repeated
+// probes for absent names skip the index. Files aren't cached, since a
+// random walk over millions of them would only churn it. Lock-free readers
+// fill entries under a per-entry seq and check every hit: a directory
+// against its generation, a missing name against its shard's seq, which
+// every create in the shard moves.
+typedef struct {
+    unsigned long seq;    // Odd while the entry is being filled
+    uint64_t parent;
+    uint64_t hash;
+    File* dir;            // NULL for a missing name
+    uint32_t generation;  // dir's generation when cached
+    unsigned long shard_seq;  // Missing names: the shard's seq when the index missed
+    uint64_t name[FS_DCACHE_NAME_WORDS];  // Missing names: the name, zero padded
+} __attribute__((aligned(64))) DentryCacheEntry;  // A hit on a directory reads one cache line
+
+// Image layout, in FS_BLOCK_SIZE blocks and host byte order: the
+// superblock in block 0, the inode table, a bitmap of blocks in use, then
+// data. Block maps hold image block numbers, so a mounted image is the
+// block store itself, with block 0 and the metadata marked in use; and
+// inode slot i holds whatever lives in pool slot i.
+#define FS_IMAGE_MAGIC 0x31474d4953464e45ULL  // "ENFSIMG1"
+#define FS_IMAGE_VERSION 1
+#define FS_BYTES_PER_INODE (16 * 1024)  // fs_mkfs's default inode density
+#define FS_MAX_INODES (1 << 30)
+#define FS_ROOT_SLOT UINT32_MAX  // parent_slot of entries in the root
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count;  // The whole image, a multiple of FS_BLOCK_CHUNK
+    uint64_t inode_count;  // Inode slots, a multiple of FILE_POOL_CHUNK
+    uint64_t inode_table;  // First block of each region
+    uint64_t bitmap;
+    uint64_t data;
+    // As of the last sync
+    uint64_t inode_high;   // Slots from here on have never been used
+    uint64_t next_ino;
+    uint64_t file_count;
+} FsSuperblock;
+
+typedef struct {
+    uint64_t ino;          // 0 while the slot is free
+    uint64_t parent;       // Inode number of the directory holding the entry
+    uint64_t size;
+    int64_t created_sec;
+    int64_t created_nsec;
+    int64_t modified_sec;
+    int64_t modified_nsec;
+    uint32_t parent_slot;  // The directory's slot, or FS_ROOT_SLOT
+    uint8_t is_dir;
+    uint8_t is_inline;
+    char name[MAX_FILENAME];
+    uint8_t contents[FS_INLINE_SIZE];  // Inline bytes or the block map, as in File
+    uint8_t reserved[88];  // Up to 256 bytes, 16 to a block
+} DiskInode;
+
+#define FS_INODES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(DiskInode))
+
+typedef struct {
+    IndexMode index_mode;
+    // Holding every shard lock freezes the whole index
+    IndexShard shards[FS_INDEX_SHARDS];
+    // Files live in fixed-size chunks so their addresses never change as the pool grows
+    File** pool_chunks;
+    int pool_chunk_count;
+    int pool_chunk_capacity;
+    // A permutation of pool indices: the first file_count are live files,
+    // the next limbo_count deleted files lock-free readers may still see, and
+    // the rest are free, so claiming and releasing a slot are O(1) swaps
+    int* slot_order;
+    int limbo_count;
+    int reclaim_at;  // limbo_count that triggers the next reclaim
+    HashTable* retired_tables;
+    // Epoch-based reclamation: something retired in epoch e is unreachable
+    // once the epoch reaches e + 2, as the epoch only advances when every
+    // reader inside a lookup has seen the current one
+    uint64_t epoch;
+    ReaderRecord readers[FS_MAX_READERS];
+    int reader_count;  // Records ever claimed; the rest are never scanned
+    pthread_key_t reader_key;
+    DentryCacheEntry dcache[FS_DCACHE_SIZE];
+    // The mounted image, if any. It is mapped shared and whole, so file
+    // contents go straight to it; only inodes and the bitmap wait for a sync.
+    struct {
+        int fd;
+        uint8_t* map;         // NULL for a file system that lives in memory only
+        size_t size;
+        FsSuperblock* super;  // At the start of map
+        uint64_t* dirty;      // One bit per inode slot changed since the last sync
+    } image;
+    // The root directory has no name, so it is never indexed or freed
+    File root;
+    uint64_t next_ino;
+    // Block store, also chunked; free block numbers are kept on a stack
+    uint8_t** block_chunks;
+    int block_chunk_count;
+    int block_chunk_capacity;
+    uint32_t* free_blocks;
+    uint32_t free_block_count;
+    uint32_t blocks_used;
+    // File pool, block store and directory membership. Readers index their
+    // chunk directories without it, so outgrown directories are retired, not freed.
+    pthread_mutex_t alloc_lock;
+    void** retired;
+    int retired_count;
+    int retired_capacity;
     int file_count;
     int total_files_created;
     int total_files_deleted;
-    double total_lookup_time_ms;
+    uint64_t total_lookup_time_ns;  // Over sampled lookups only, by threads without a reader record
+    int timed_lookups;
     int total_lookups;
+    uint32_t timing_interval;
 } FileSystem;
 
-static FileSystem fs;
+static FileSystem fs;
+static int fs_verbose = 1;
+
+#define FS_LOG(...) do { if (fs_verbose) printf(__VA_ARGS__); } while (0)
+
+// Name hash in the style of wyhash: 16 bytes per step, each pair of words
+// folded by a 64x64->128-bit multiply. Short names take a single mix.
+#define HASH_SEED 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t a_hi = a >> 32, a_lo = (uint32_t)a, b_hi = b >> 32, b_lo = (uint32_t)b;
+    uint64_t cross1 = a_hi * b_lo, cross2 = a_lo * b_hi, low = a_lo * b_lo;
+    uint64_t mid = low + (cross1 << 32);
+    uint64_t carry = mid < low;
+    uint64_t lo = mid + (cross2 << 32);
+    carry += lo < mid;
+    return lo ^ (a_hi * b_hi + (cross1 >> 32) + (cross2 >> 32) + carry);
+#endif
+}
+
+static inline uint64_t read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Hashes a name within the directory 'parent', so the same name in two
+// directories lands in unrelated buckets
+static uint64_t dentry_hash(uint64_t parent, const char* name, size_t len) {
+    const char* p = name;
+    uint64_t seed = HASH_SEED ^ parent;
+    uint64_t a, b;
+    
+    if (len <= 16) {
+        // Two possibly overlapping reads cover the whole name
+        if (len >= 8) {
+            a = read64(p);
+            b = read64(p + len - 8);
+        } else if (len >= 4) {
+            a = read32(p);
+            b = read32(p + len - 4);
+        } else if (len > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[len / 2] << 8) | (uint8_t)p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = len;
+        while (left > 16) {
+            seed = hash_mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        // The last 16 bytes, reaching back into the previous block if needed
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+    return hash_mix(HASH_P1 ^ len, hash_mix(a ^ HASH_P1, b ^ seed));
+}
+
+static inline IndexShard* shard_for(uint64_t hash) {
+    return &fs.shards[hash & (FS_INDEX_SHARDS - 1)];
+}
+
+static inline int is_rehashing(IndexShard* shard) {
+    return shard->rehash_index >= 0;
+}
+
+// Within a shard the bits above the shard number pick the bucket or group,
+// and the top seven are the Swiss tag
+static inline File** bucket_for(HashTable* table, uint64_t hash) {
+    return &table->buckets[(hash >> FS_SHARD_BITS) & (table->size - 1)];
+}
+
+static inline uint8_t swiss_tag(uint64_t hash) {
+    return (uint8_t)(hash >> 57);
+}
+
+// Bit i set when control byte i of the group equals 'byte'
+static inline uint32_t swiss_match(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_load_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++) {
+        mask |= (uint32_t)(group[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i set when slot i is empty or deleted, i.e. can take an insert
+static inline uint32_t swiss_match_free(const uint8_t* group) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < SWISS_GROUP; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Only worth calling once the hash matched
+static inline int key_matches(const File* file, const DentryKey* key) {
+    return file->parent == key->parent && memcmp(file->filename, key->name, key->len) == 0 &&
+           file->filename[key->len] == '\0';
+}
+
+// Groups are probed in triangular steps from the one picked by the hash,
+// which visits every group of a power-of-two table exactly once. Lock-free
+// readers probe too: a slot's hash is written before its file pointer, and
+// the pointer (a release store) before the control byte, so a reader that
+// acquires the pointer sees the hash and the file's name.
+static int swiss_find(HashTable* table, const DentryKey* key) {
+    uint64_t hash = key->hash;
+    unsigned int mask = table->size / SWISS_GROUP - 1;
+    unsigned int group = (unsigned int)(hash >> FS_SHARD_BITS) & mask;
+    for (unsigned int probe = 1; probe <= mask + 1; probe++) {
+        const uint8_t* ctrl = table->ctrl + group * SWISS_GROUP;
+        for (uint32_t hits = swiss_match(ctrl, swiss_tag(hash)); hits; hits &= hits - 1) {
+            SwissSlot* slot = &table->slots[group * SWISS_GROUP + __builtin_ctz(hits)];
+            File* file = __atomic_load_n(&slot->file, __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash && key_matches(file, key)) {
+                return (int)(slot - table->slots);
+            }
+        }
+        // An empty slot ends every probe sequence that could have reached the file
+        if (swiss_match(ctrl, SWISS_EMPTY)) {
+            return -1;
+        }
+        group = (group + probe) & mask;
+    }
+    return -1;
+}
+
+static int swiss_insert(HashTable* table, File* file, uint64_t hash) {
+    unsigned int mask = table->size / SWISS_GROUP - 1;
+    unsigned int group = (unsigned int)(hash >> FS_SHARD_BITS) & mask;
+    for (unsigned int probe = 1; probe <= mask + 1; probe++) {
+        uint32_t free_slots = swiss_match_free(table->ctrl + group * SWISS_GROUP);
+        if (free_slots) {
+            int slot = (int)(group * SWISS_GROUP) + __builtin_ctz(free_slots);
+            if (table->ctrl[slot] == SWISS_DELETED) {
+                table->tombstones--;
+            }
+            __atomic_store_n(&table->slots[slot].hash, hash, __ATOMIC_RELAXED);
+            __atomic_store_n(&table->slots[slot].file, file, __ATOMIC_RELEASE);
+            __atomic_store_n(&table->ctrl[slot], swiss_tag(hash), __ATOMIC_RELEASE);
+            table->used++;
+            return 0;
+        }
+        group = (group + probe) & mask;
+    }
+    return -1;  // Full; only possible if a resize couldn't be allocated
+}
+
+static void swiss_remove(HashTable* table, int slot) {
+    // If the group still has an empty slot, no probe ever continued past it,
+    // so the slot can become empty instead of a tombstone
+    const uint8_t* ctrl = table->ctrl + (slot / SWISS_GROUP) * SWISS_GROUP;
+    if (swiss_match(ctrl, SWISS_EMPTY)) {
+        __atomic_store_n(&table->ctrl[slot], SWISS_EMPTY, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&table->ctrl[slot], SWISS_DELETED, __ATOMIC_RELEASE);
+        table->tombstones++;
+    }
+    table->used--;
+}
+
+// Returns an empty table, or NULL when memory runs out
+static HashTable* table_new(IndexMode mode, unsigned int size) {
+    HashTable* table = calloc(1, sizeof(HashTable));
+    if (!table) return NULL;
+    table->mode = mode;
+    table->size = size;
+    
+    if (mode == FS_INDEX_CHAINED) {
+        table->buckets = calloc(size, sizeof(File*));
+        if (!table->buckets) {
+            free(table);
+            return NULL;
+        }
+        return table;
+    }
+    
+    // _mm_load_si128 needs 16-byte aligned groups
+    void* ctrl = NULL;
+    if (posix_memalign(&ctrl, SWISS_GROUP, size) != 0) {
+        free(table);
+        return NULL;
+    }
+    table->ctrl = ctrl;
+    table->slots = malloc(size * sizeof(SwissSlot));
+    if (!table->slots) {
+        free(table->ctrl);
+        free(table);
+        return NULL;
+    }
+    memset(table->ctrl, SWISS_EMPTY, size);
+    return table;
+}
+
+static void table_free(HashTable* table) {
+    if (!table) return;
+    free(table->buckets);
+    free(table->ctrl);
+    free(table->slots);
+    free(table);
+}
+
+static File* table_find(HashTable* table, const DentryKey* key) {
+    if (table->mode == FS_INDEX_SWISS) {
+        int slot = swiss_find(table, key);
+        return slot >= 0 ? __atomic_load_n(&table->slots[slot].file, __ATOMIC_RELAXED) : NULL;
+    }
+    
+    File* current = __atomic_load_n(bucket_for(table, key->hash), __ATOMIC_ACQUIRE);
+    while (current != NULL) {
+        // Only a matching hash is worth touching the filename for
+        if (__atomic_load_n(&current->hash, __ATOMIC_RELAXED) == key->hash && key_matches(current, key)) {
+            return current;
+        }
+        current = __atomic_load_n(&current->hash_next, __ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+// Links are published with release stores so a lock-free reader that finds
+// a file also sees its name and hash
+static int table_insert(HashTable* table, File* file, uint64_t hash) {
+    if (table->mode == FS_INDEX_SWISS) {
+        return swiss_insert(table, file, hash);
+    }
+    
+    File** bucket = bucket_for(table, hash);
+    __atomic_store_n(&file->hash_next, *bucket, __ATOMIC_RELAXED);
+    __atomic_store_n(bucket, file, __ATOMIC_RELEASE);
+    table->used++;
+    return 0;
+}
+
+// Unlinks and returns the named file, or NULL if this table doesn't have it.
+// The file keeps its hash_next, so a reader standing on it can walk on.
+static File* table_remove(HashTable* table, const DentryKey* key) {
+    if (table->mode == FS_INDEX_SWISS) {
+        int slot = swiss_find(table, key);
+        if (slot < 0) return NULL;
+        File* file = table->slots[slot].file;
+        swiss_remove(table, slot);
+        return file;
+    }
+    
+    File** link = bucket_for(table, key->hash);
+    while (*link != NULL) {
+        File* current = *link;
+        if (current->hash == key->hash && key_matches(current, key)) {
+            __atomic_store_n(link, current->hash_next, __ATOMIC_RELEASE);
+            table->used--;
+            return current;
+        }
+        link = &current->hash_next;
+    }
+    return NULL;
+}
+
+static inline long table_units(HashTable* table) {
+    return table->mode == FS_INDEX_SWISS ? table->size / SWISS_GROUP : table->size;
+}
+
+// Moves one bucket or Swiss group to 'to'; returns how many files it held
+static int table_migrate_unit(HashTable* from, long unit, HashTable* to) {
+    int moved = 0;
+    
+    if (from->mode == FS_INDEX_SWISS) {
+        for (long slot = unit * SWISS_GROUP; slot < (unit + 1) * SWISS_GROUP; slot++) {
+            if (from->ctrl[slot] & 0x80) continue;
+            swiss_insert(to, from->slots[slot].file, from->slots[slot].hash);
+            // A tombstone, not empty: later groups are still probed through this one
+            __atomic_store_n(&from->ctrl[slot], SWISS_DELETED, __ATOMIC_RELEASE);
+            from->used--;
+            moved++;
+        }
+        return moved;
+    }
+    
+    File* file = from->buckets[unit];
+    while (file) {
+        File* next = file->hash_next;
+        table_insert(to, file, file->hash);
+        from->used--;
+        moved++;
+        file = next;
+    }
+    __atomic_store_n(&from->buckets[unit], NULL, __ATOMIC_RELEASE);
+    return moved;
+}
+
+static void retire_table(HashTable* table);
+
+// Moves up to 'steps' non-empty units from tables[0] to tables[1], visiting
+// at most ten empty units per step so a sparse stretch stays cheap.
+// Caller holds the shard's write lock.
+static void rehash_step(IndexShard* shard, int steps) {
+    int empty_visits = steps * 10;
+    HashTable* from = shard->tables[0];
+    HashTable* to = shard->tables[1];
+    long units = table_units(from);
+    
+    while (steps > 0 && shard->rehash_index < units) {
+        if (table_migrate_unit(from, shard->rehash_index++, to) == 0) {
+            if (--empty_visits == 0) break;
+            continue;
+        }
+        steps--;
+    }
+    
+    if (shard->rehash_index >= units) {
+        // Readers load tables[1] before tables[0], so they never see neither table
+        __atomic_store_n(&shard->tables[0], to, __ATOMIC_RELEASE);
+        __atomic_store_n(&shard->tables[1], NULL, __ATOMIC_RELEASE);
+        shard->rehash_index = -1;
+        retire_table(from);
+    }
+}
+
+// Starts a resize once the load factor is crossed: chains double at one file
+// per bucket; the Swiss index doubles at 7/8 full, or is rebuilt at the same
+// size when deleted slots make up most of that. If the new table can't be
+// allocated the old one keeps working. Caller holds the shard's write lock.
+static void maybe_start_resize(IndexShard* shard) {
+    HashTable* table = shard->tables[0];
+    if (is_rehashing(shard)) {
+        return;
+    }
+    
+    unsigned int new_size;
+    if (table->mode == FS_INDEX_SWISS) {
+        if (table->used + table->tombstones < (int)SWISS_MAX_LOAD(table->size)) return;
+        new_size = table->used < (int)table->size / 2 ? table->size : table->size * 2;
+    } else {
+        if (table->used < (int)table->size * MAX_LOAD_FACTOR) return;
+        new_size = table->size * 2;
+    }
+    
+    HashTable* next = table_new(table->mode, new_size);
+    if (next) {
+        shard->rehash_index = 0;
+        __atomic_store_n(&shard->tables[1], next, __ATOMIC_RELEASE);
+    }
+}
+
+static inline File* pool_file(int index) {
+    File** chunks = __atomic_load_n(&fs.pool_chunks, __ATOMIC_ACQUIRE);
+    return &chunks[index / FILE_POOL_CHUNK][index % FILE_POOL_CHUNK];
+}
+
+static inline int pool_capacity(void) {
+    return __atomic_load_n(&fs.pool_chunk_count, __ATOMIC_ACQUIRE) * FILE_POOL_CHUNK;
+}
+
+// Copies a chunk directory into a larger array. The old one stays readable
+// until cleanup, since a handle or block lookup may still be indexing it.
+// Caller holds alloc_lock.
+static void* grow_directory(void* old, size_t used_bytes, size_t new_bytes) {
+    if (fs.retired_count == fs.retired_capacity) {
+        int capacity = fs.retired_capacity ? fs.retired_capacity * 2 : 16;
+        void** retired = realloc(fs.retired, capacity * sizeof(void*));
+        if (!retired) return NULL;
+        fs.retired = retired;
+        fs.retired_capacity = capacity;
+    }
+    
+    void* dir = malloc(new_bytes);
+    if (!dir) return NULL;
+    if (old) {
+        memcpy(dir, old, used_bytes);
+        fs.retired[fs.retired_count++] = old;
+    }
+    return dir;
+}
+
+// Adds one chunk of free files, up to the inode slots of a mounted image.
+// Caller holds alloc_lock.
+static int grow_file_pool(void) {
+    if (fs.image.super && (uint64_t)pool_capacity() + FILE_POOL_CHUNK > fs.image.super->inode_count) {
+        return -1;
+    }
+    if (fs.pool_chunk_count == fs.pool_chunk_capacity) {
+        int capacity = fs.pool_chunk_capacity ? fs.pool_chunk_capacity * 2 : 16;
+        File** chunks = grow_directory(fs.pool_chunks, fs.pool_chunk_count * sizeof(File*),
+                                       capacity * sizeof(File*));
+        if (!chunks) return -1;
+        __atomic_store_n(&fs.pool_chunks, chunks, __ATOMIC_RELEASE);
+        fs.pool_chunk_capacity = capacity;
+    }
+    
+    int base = pool_capacity();
+    int* order = realloc(fs.slot_order, (base + FILE_POOL_CHUNK) * sizeof(int));
+    if (!order) return -1;
+    fs.slot_order = order;
+    
+    void* memory = NULL;
+    if (posix_memalign(&memory, __alignof__(File), FILE_POOL_CHUNK * sizeof(File)) != 0) return -1;
+    File* chunk = memset(memory, 0, FILE_POOL_CHUNK * sizeof(File));
+    // Everything past the live and retired files is free, so the new slots just go on the end
+    for (int i = 0; i < FILE_POOL_CHUNK; i++) {
+        chunk[i].pool_index = base + i;
+        chunk[i].order_pos = base + i;
+        fs.slot_order[base + i] = base + i;
+    }
+    fs.pool_chunks[fs.pool_chunk_count] = chunk;
+    __atomic_store_n(&fs.pool_chunk_count, fs.pool_chunk_count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Slot order position i: live below file_count, retired up to
+// file_count + limbo_count, free after
+static inline File* live_file(int i) {
+    return pool_file(fs.slot_order[i]);
+}
+
+// Exchanges two positions of slot_order. Caller holds alloc_lock.
+static void swap_order(int a, int b) {
+    File* first = live_file(a);
+    File* second = live_file(b);
+    fs.slot_order[a] = second->pool_index;
+    second->order_pos = a;
+    fs.slot_order[b] = first->pool_index;
+    first->order_pos = b;
+}
+
+static void reclaim_retired(void);
+
+// Queues the slot's inode for the next sync of a mounted image. Callers
+// hold alloc_lock or the write lock of the file's shard.
+static inline void mark_inode_dirty(const File* file) {
+    if (fs.image.dirty) {
+        __atomic_fetch_or(&fs.image.dirty[file->pool_index / 64], 1ULL << (file->pool_index % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+// Caller holds alloc_lock
+static void link_child(File* dir, File* file) {
+    file->parent_dir = dir;
+    file->prev_sibling = NULL;
+    file->next_sibling = dir->contents.dir.first_child;
+    if (file->next_sibling) {
+        file->next_sibling->prev_sibling = file;
+    }
+    dir->contents.dir.first_child = file;
+    dir->contents.dir.child_count++;
+}
+
+// Caller holds alloc_lock
+static void unlink_child(File* file) {
+    File* dir = file->parent_dir;
+    if (file->prev_sibling) {
+        file->prev_sibling->next_sibling = file->next_sibling;
+    } else {
+        dir->contents.dir.first_child = file->next_sibling;
+    }
+    if (file->next_sibling) {
+        file->next_sibling->prev_sibling = file->prev_sibling;
+    }
+    dir->contents.dir.child_count--;
+    file->parent_dir = file->next_sibling = file->prev_sibling = NULL;
+}
+
+// Takes the first free slot for the entry 'target' names, reclaiming retired
+// slots or growing the pool when none is left, and adds it to its directory.
+// Fails with FS_ERROR_FILE_NOT_FOUND if the directory was removed after the
+// walk passed it.
+static FileSystemError claim_file_slot(const PathTarget* target, int is_dir, File** claimed) {
+    File* dir = target->dir;
+    pthread_mutex_lock(&fs.alloc_lock);
+    if (__atomic_load_n(&dir->generation, __ATOMIC_RELAXED) != target->dir_generation ||
+        dir->contents.dir.child_count < 0) {
+        pthread_mutex_unlock(&fs.alloc_lock);
+        return FS_ERROR_FILE_NOT_FOUND;
+    }
+    if (fs.file_count + fs.limbo_count == pool_capacity()) {
+        reclaim_retired();
+    }
+    if (fs.file_count + fs.limbo_count == pool_capacity() && grow_file_pool() != 0) {
+        pthread_mutex_unlock(&fs.alloc_lock);
+        return FS_ERROR_NO_SPACE;
+    }
+    
+    // The free slot trades places with the first retired file, if any
+    swap_order(fs.file_count + fs.limbo_count, fs.file_count);
+    File* file = live_file(fs.file_count++);
+    __atomic_fetch_add(&file->generation, 1, __ATOMIC_RELEASE);
+    memcpy(file->filename, target->key.name, target->key.len);
+    file->filename[target->key.len] = '\0';
+    file->parent = target->key.parent;
+    __atomic_store_n(&file->hash, target->key.hash, __ATOMIC_RELAXED);
+    file->ino = fs.next_ino++;
+    file->is_dir = is_dir;
+    file->cached_misses = 0;
+    link_child(dir, file);
+    mark_inode_dirty(file);
+    pthread_mutex_unlock(&fs.alloc_lock);
+    *claimed = file;
+    return FS_SUCCESS;
+}
+
+// Frees the slot of a file no reader has seen. It swaps with the last live
+// file, then past the retired ones, keeping every region contiguous.
+static void release_file_slot(File* file) {
+    pthread_mutex_lock(&fs.alloc_lock);
+    unlink_child(file);
+    mark_inode_dirty(file);
+    int last = --fs.file_count;
+    swap_order(file->order_pos, last);
+    swap_order(last, last + fs.limbo_count);
+    __atomic_fetch_add(&file->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs.alloc_lock);
+}
+
+static inline uint8_t* block_data(uint32_t block) {
+    uint8_t** chunks = __atomic_load_n(&fs.block_chunks, __ATOMIC_ACQUIRE);
+    return chunks[block / FS_BLOCK_CHUNK] + (size_t)(block % FS_BLOCK_CHUNK) * FS_BLOCK_SIZE;
+}
+
+// Adds one chunk of blocks to the store. Caller holds alloc_lock.
+static int grow_block_store(void) {
+    if (fs.image.map) return -1;  // A mounted image is all mapped at once
+    if ((uint64_t)(fs.block_chunk_count + 1) * FS_BLOCK_CHUNK > UINT32_MAX) return -1;
+    if (fs.block_chunk_count == fs.block_chunk_capacity) {
+        int capacity = fs.block_chunk_capacity ? fs.block_chunk_capacity * 2 : 16;
+        // Every block can be free at once, so the stack grows with the store
+        uint32_t* stack = realloc(fs.free_blocks, (size_t)capacity * FS_BLOCK_CHUNK * sizeof(uint32_t));
+        if (!stack) return -1;
+        fs.free_blocks = stack;
+        uint8_t** chunks = grow_directory(fs.block_chunks, fs.block_chunk_count * sizeof(uint8_t*),
+                                          capacity * sizeof(uint8_t*));
+        if (!chunks) return -1;
+        __atomic_store_n(&fs.block_chunks, chunks, __ATOMIC_RELEASE);
+        fs.block_chunk_capacity = capacity;
+    }
+    
+    uint8_t* chunk = malloc((size_t)FS_BLOCK_CHUNK * FS_BLOCK_SIZE);
+    if (!chunk) return -1;
+    uint32_t base = (uint32_t)fs.block_chunk_count * FS_BLOCK_CHUNK;
+    fs.block_chunks[fs.block_chunk_count++] = chunk;
+    // Pushed high to low so they are handed out in address order
+    for (uint32_t block = base + FS_BLOCK_CHUNK; block-- > base;) {
+        if (block != 0) {
+            fs.free_blocks[fs.free_block_count++] = block;
+        }
+    }
+    return 0;
+}
+
+// What a view of a hole points at
+static const uint8_t zero_block[FS_BLOCK_SIZE];
+
+// Returns a block with stale contents, or 0 when memory runs out
+static uint32_t alloc_block(void) {
+    uint32_t block = 0;
+    pthread_mutex_lock(&fs.alloc_lock);
+    if (fs.free_block_count > 0 || grow_block_store() == 0) {
+        fs.blocks_used++;
+        block = fs.free_blocks[--fs.free_block_count];
+    }
+    pthread_mutex_unlock(&fs.alloc_lock);
+    return block;
+}
+
+static uint32_t alloc_zeroed_block(void) {
+    uint32_t block = alloc_block();
+    if (block) {
+        memset(block_data(block), 0, FS_BLOCK_SIZE);
+    }
+    return block;
+}
+
+// Caller holds alloc_lock
+static void free_block(uint32_t block) {
+    fs.free_blocks[fs.free_block_count++] = block;
+    fs.blocks_used--;
+}
+
+// Frees a block and, for map blocks, everything below it
+static void free_block_tree(uint32_t block, int depth) {
+    if (!block) return;
+    if (depth > 0) {
+        uint32_t* entries = (uint32_t*)block_data(block);
+        for (uint32_t i = 0; i < FS_PTRS_PER_BLOCK; i++) {
+            free_block_tree(entries[i], depth - 1);
+        }
+    }
+    free_block(block);
+}
+
+// Returns every block the file holds and leaves it an empty inline file.
+// Caller holds alloc_lock.
+static void free_file_blocks(File* file) {
+    if (!file->is_inline) {
+        BlockMap* map = &file->contents.map;
+        for (int i = 0; i < FS_DIRECT_BLOCKS; i++) {
+            free_block_tree(map->direct[i], 0);
+        }
+        free_block_tree(map->indirect, 1);
+        free_block_tree(map->double_indirect, 2);
+    }
+    memset(&file->contents, 0, sizeof(file->contents));
+    file->is_inline = 1;
+    file->size = 0;
+}
+
+static void file_release_blocks(File* file) {
+    pthread_mutex_lock(&fs.alloc_lock);
+    free_file_blocks(file);
+    pthread_mutex_unlock(&fs.alloc_lock);
+}
+
+// Each thread's reader record, valid while reader_instance matches
+// fs_instance so records from an earlier init are never reused
+static __thread ReaderRecord* thread_reader;
+static __thread unsigned int reader_instance;
+static unsigned int fs_instance;
+
+static void reader_record_destroy(void* arg) {
+    ReaderRecord* reader = arg;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Returns the calling thread's record, claiming one on first use; NULL when
+// all FS_MAX_READERS are taken, in which case lookups use the shard locks
+static ReaderRecord* reader_record(void) {
+    if (thread_reader && reader_instance == fs_instance) {
+        return thread_reader;
+    }
+    
+    thread_reader = NULL;
+    for (int i = 0; i < FS_MAX_READERS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&fs.readers[i].in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            int count = __atomic_load_n(&fs.reader_count, __ATOMIC_RELAXED);
+            while (count <= i && !__atomic_compare_exchange_n(&fs.reader_count, &count, i + 1, 1,
+                                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            }
+            thread_reader = &fs.readers[i];
+            reader_instance = fs_instance;
+            pthread_setspecific(fs.reader_key, thread_reader);
+            break;
+        }
+    }
+    return thread_reader;
+}
+
+// The fence makes the announcement visible before any index pointer is
+// read, so a writer that retires something afterwards sees this reader
+static inline void reader_enter(ReaderRecord* reader) {
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&fs.epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void reader_exit(ReaderRecord* reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Moves to the next epoch if every reader inside a lookup has seen the
+// current one. Caller holds alloc_lock.
+static void try_advance_epoch(void) {
+    uint64_t epoch = __atomic_load_n(&fs.epoch, __ATOMIC_SEQ_CST);
+    int count = __atomic_load_n(&fs.reader_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        uint64_t seen = __atomic_load_n(&fs.readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != epoch) return;
+    }
+    __atomic_store_n(&fs.epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+// Stamps something just unlinked from the index with the current epoch. The
+// fence orders the unlink before the epoch is read.
+static inline uint64_t retire_stamp(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&fs.epoch, __ATOMIC_SEQ_CST);
+}
+
+// Defers freeing a table lock-free readers may still be walking
+static void retire_table(HashTable* table) {
+    pthread_mutex_lock(&fs.alloc_lock);
+    table->retire_epoch = retire_stamp();
+    table->retired_next = fs.retired_tables;
+    fs.retired_tables = table;
+    reclaim_retired();
+    pthread_mutex_unlock(&fs.alloc_lock);
+}
+
+// Closes an empty directory to new entries ahead of its removal; a
+// directory that still has entries stays as it is. Caller holds the write
+// lock of the directory's shard.
+static FileSystemError close_dir(File* dir) {
+    FileSystemError result = FS_SUCCESS;
+    pthread_mutex_lock(&fs.alloc_lock);
+    if (dir->contents.dir.child_count > 0) {
+        result = FS_ERROR_NOT_EMPTY;
+    } else {
+        dir->contents.dir.child_count = -1;
+    }
+    pthread_mutex_unlock(&fs.alloc_lock);
+    return result;
+}
+
+// Takes a deleted file out of its directory and the live files. Lock-free
+// readers may still be looking at it, so its slot and blocks come back only
+// once no reader can reach it; handles go stale right away.
+static void retire_file(File* file) {
+    pthread_mutex_lock(&fs.alloc_lock);
+    unlink_child(file);
+    mark_inode_dirty(file);
+    int last = --fs.file_count;
+    swap_order(file->order_pos, last);  // Now the first retired file
+    fs.limbo_count++;
+    file->retire_epoch = retire_stamp();
+    __atomic_fetch_add(&file->generation, 1, __ATOMIC_RELEASE);
+    if (fs.limbo_count >= fs.reclaim_at) {
+        reclaim_retired();
+    }
+    pthread_mutex_unlock(&fs.alloc_lock);
+}
+
+// Frees retired files and tables from two or more epochs back. Tries to
+// advance twice, so with no lookup in flight everything goes at once.
+// Caller holds alloc_lock.
+static void reclaim_retired(void) {
+    try_advance_epoch();
+    try_advance_epoch();
+    uint64_t epoch = __atomic_load_n(&fs.epoch, __ATOMIC_RELAXED);
+    
+    for (int pos = fs.file_count; pos < fs.file_count + fs.limbo_count;) {
+        File* file = live_file(pos);
+        if (file->retire_epoch + 2 > epoch) {
+            pos++;
+            continue;
+        }
+        free_file_blocks(file);
+        swap_order(pos, fs.file_count + --fs.limbo_count);
+    }
+    fs.reclaim_at = fs.limbo_count + FS_RECLAIM_BATCH;
+    
+    HashTable** link = &fs.retired_tables;
+    while (*link) {
+        HashTable* table = *link;
+        if (table->retire_epoch + 2 > epoch) {
+            link = &table->retired_next;
+            continue;
+        }
+        *link = table->retired_next;
+        table_free(table);
+    }
+}
+
+// True once *entry names a block, allocating a zeroed one when 'create' is set
+static int ensure_block(uint32_t* entry, int create) {
+    if (!*entry && create) {
+        *entry = alloc_zeroed_block();
+    }
+    return *entry != 0;
+}
+
+// Finds the map entry for the file's 'index'th block. With 'create', missing
+// map blocks are allocated on the way down; NULL means a hole (or, when
+// creating, no memory). Caller keeps index within FS_MAX_FILE_SIZE.
+static uint32_t* block_entry(File* file, uint64_t index, int create) {
+    BlockMap* map = &file->contents.map;
+    if (index < FS_DIRECT_BLOCKS) {
+        return &map->direct[index];
+    }
+    
+    index -= FS_DIRECT_BLOCKS;
+    uint32_t* parent = &map->indirect;
+    if (index >= FS_PTRS_PER_BLOCK) {
+        index -= FS_PTRS_PER_BLOCK;
+        if (!ensure_block(&map->double_indirect, create)) return NULL;
+        parent = (uint32_t*)block_data(map->double_indirect) + index / FS_PTRS_PER_BLOCK;
+        index %= FS_PTRS_PER_BLOCK;
+    }
+    if (!ensure_block(parent, create)) return NULL;
+    return (uint32_t*)block_data(*parent) + index;
+}
+
+// Writes 'len' bytes at 'offset', growing the file. Anything skipped over
+// reads back as zeros: unused inline bytes stay zeroed and unmapped blocks
+// are holes. Caller holds the file's shard for writing.
+static FileSystemError file_write(File* file, uint64_t offset, const void* data, size_t len) {
+    if (offset > FS_MAX_FILE_SIZE || len > FS_MAX_FILE_SIZE - offset) {
+        return FS_ERROR_TOO_LARGE;
+    }
+    mark_inode_dirty(file);
+    
+    if (file->is_inline) {
+        if (offset + len <= FS_INLINE_SIZE) {
+            memcpy(file->contents.inline_data + offset, data, len);
+            if (offset + len > file->size) {
+                file->size = offset + len;
+            }
+            return FS_SUCCESS;
+        }
+        
+        // Too big to stay inline: the bytes so far become the first block
+        uint32_t first = 0;
+        if (file->size > 0) {
+            first = alloc_zeroed_block();
+            if (!first) return FS_ERROR_NO_SPACE;
+            memcpy(block_data(first), file->contents.inline_data, file->size);
+        }
+        memset(&file->contents, 0, sizeof(file->contents));
+        file->contents.map.direct[0] = first;
+        file->is_inline = 0;
+    }
+    
+    const uint8_t* src = data;
+    while (len > 0) {
+        size_t within = offset % FS_BLOCK_SIZE;
+        size_t chunk = FS_BLOCK_SIZE - within < len ? FS_BLOCK_SIZE - within : len;
+        
+        uint32_t* entry = block_entry(file, offset / FS_BLOCK_SIZE, 1);
+        if (entry && !*entry) {
+            // Only a block the write leaves partly uncovered needs zeroing
+            *entry = chunk == FS_BLOCK_SIZE ? alloc_block() : alloc_zeroed_block();
+        }
+        if (!entry || !*entry) {
+            return FS_ERROR_NO_SPACE;  // What was written so far stays
+        }
+        
+        memcpy(block_data(*entry) + within, src, chunk);
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+        if (offset > file->size) {
+            file->size = offset;
+        }
+    }
+    return FS_SUCCESS;
+}
+
+// Copies up to 'len' bytes from 'offset' and returns how many there were
+static size_t file_read(File* file, uint64_t offset, void* buf, size_t len) {
+    if (offset >= file->size) return 0;
+    if (len > file->size - offset) {
+        len = file->size - offset;
+    }
+    
+    if (file->is_inline) {
+        memcpy(buf, file->contents.inline_data + offset, len);
+        return len;
+    }
+    
+    uint8_t* dst = buf;
+    size_t left = len;
+    while (left > 0) {
+        size_t within = offset % FS_BLOCK_SIZE;
+        size_t chunk = FS_BLOCK_SIZE - within < left ? FS_BLOCK_SIZE - within : left;
+        
+        uint32_t* entry = block_entry(file, offset / FS_BLOCK_SIZE, 0);
+        if (entry && *entry) {
+            memcpy(dst, block_data(*entry) + within, chunk);
+        } else {
+            memset(dst, 0, chunk);
+        }
+        dst += chunk;
+        offset += chunk;
+        left -= chunk;
+    }
+    return len;
+}
+
+FileSystemError init_filesystem() {
+    memset(&fs, 0, sizeof(FileSystem));
+    fs.epoch = 1;  // 0 marks a reader outside a lookup
+    fs.reclaim_at = FS_RECLAIM_BATCH;
+    fs.root.ino = FS_ROOT_INO;
+    fs.root.is_dir = 1;
+    fs.root.is_inline = 1;
+    fs.root.generation = 1;
+    fs.next_ino = FS_ROOT_INO + 1;
+    fs_instance++;
+    
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        IndexShard* shard = &fs.shards[i];
+        shard->rehash_index = -1;
+        shard->tables[0] = table_new(FS_INDEX_CHAINED, SHARD_BUCKETS);
+        if (!shard->tables[0] || pthread_rwlock_init(&shard->lock, NULL) != 0) {
+            return FS_ERROR_INIT_FAILED;
+        }
+    }
+    if (grow_file_pool() != 0) {
+        return FS_ERROR_INIT_FAILED;
+    }
+    if (pthread_mutex_init(&fs.alloc_lock, NULL) != 0 ||
+        pthread_key_create(&fs.reader_key, reader_record_destroy) != 0) {
+        return FS_ERROR_INIT_FAILED;
+    }
+    
+    fast_timer_init();
+    fs.timing_interval = LOOKUP_TIMING_INTERVAL;
+    
+    FS_LOG("Enhanced File System with Hash Table Lookups\n");
+    FS_LOG("===========================================\n\n");
+    FS_LOG("  - Hash table with %d buckets for O(1) lookups, doubling incrementally\n", HASH_TABLE_SIZE);
+    FS_LOG("  - %d index shards, each with its own lock, so unrelated files don't contend\n", FS_INDEX_SHARDS);
+    FS_LOG("  - Lock-free lookups; deleted slots are reused once readers move on\n");
+    FS_LOG("  - Directories, with a %d-entry dentry cache for path walks\n", FS_DCACHE_SIZE);
+    FS_LOG("  - File pool grows %d files at a time\n\n", FILE_POOL_CHUNK);
+    
+    return FS_SUCCESS;
+}
+
+// In shard order, so two threads taking every shard can't deadlock
+static void lock_all_shards(int write) {
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        if (write) {
+            pthread_rwlock_wrlock(&fs.shards[i].lock);
+        } else {
+            pthread_rwlock_rdlock(&fs.shards[i].lock);
+        }
+    }
+}
+
+static void unlock_all_shards(void) {
+    for (int i = FS_INDEX_SHARDS - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&fs.shards[i].lock);
+    }
+}
+
+// Writers hold the shard's write lock and bump seq around index changes
+static void shard_write_lock(IndexShard* shard) {
+    pthread_rwlock_wrlock(&shard->lock);
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shard_write_unlock(IndexShard* shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+// Caller holds the shard lock
+static File* find_file_in_hash(IndexShard* shard, const DentryKey* key) {
+    for (int t = 0; t <= is_rehashing(shard); t++) {
+        File* file = table_find(shard->tables[t], key);
+        if (file) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+// Looks the name up with no lock and no shared writes; the caller is inside
+// reader_enter, so nothing found here is freed or reused meanwhile. A hit is
+// a file indexed under the name at some point during the call, even with a
+// writer in the shard. A resize or delete can move files past a reader,
+// though, so a miss only counts if the shard's seq shows no writer
+// overlapped it; *seen_seq gets that seq. Returns 0 after LOCKLESS_ATTEMPTS
+// overlapping misses; the caller then takes the lock.
+static int find_file_lockless(IndexShard* shard, const DentryKey* key, File** found, unsigned long* seen_seq) {
+    for (int attempt = 0; attempt < LOCKLESS_ATTEMPTS; attempt++) {
+        unsigned long seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        
+        HashTable* newer = __atomic_load_n(&shard->tables[1], __ATOMIC_ACQUIRE);
+        HashTable* table = __atomic_load_n(&shard->tables[0], __ATOMIC_ACQUIRE);
+        File* file = newer ? table_find(newer, key) : NULL;
+        if (!file) {
+            file = table_find(table, key);
+        }
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (file || (!(seq & 1) && __atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq)) {
+            *found = file;
+            *seen_seq = seq;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline DentryCacheEntry* dcache_entry(uint64_t hash) {
+    // The low bits already picked the shard and bucket
+    return &fs.dcache[(hash >> 32) & (FS_DCACHE_SIZE - 1)];
+}
+
+static inline void name_words(const DentryKey* key, uint64_t words[FS_DCACHE_NAME_WORDS]) {
+    memset(words, 0, FS_DCACHE_NAME_WORDS * sizeof(uint64_t));
+    memcpy(words, key->name, key->len);
+}
+
+// Returns 1 with *found set, to NULL for a name known to be missing, when
+// the cache holds a valid answer for 'key'. Caller is inside reader_enter,
+// so a cached directory's slot isn't reused while it is checked.
+static int dcache_lookup(IndexShard* shard, const DentryKey* key, File** found) {
+    DentryCacheEntry* entry = dcache_entry(key->hash);
+    unsigned long seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return 0;
+    
+    uint64_t hash = __atomic_load_n(&entry->hash, __ATOMIC_RELAXED);
+    uint64_t parent = __atomic_load_n(&entry->parent, __ATOMIC_RELAXED);
+    File* dir = __atomic_load_n(&entry->dir, __ATOMIC_RELAXED);
+    uint32_t generation = __atomic_load_n(&entry->generation, __ATOMIC_RELAXED);
+    unsigned long shard_seq = __atomic_load_n(&entry->shard_seq, __ATOMIC_RELAXED);
+    uint64_t name[FS_DCACHE_NAME_WORDS];
+    if (!dir) {
+        for (int i = 0; i < FS_DCACHE_NAME_WORDS; i++) {
+            name[i] = __atomic_load_n(&entry->name[i], __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq || hash != key->hash || parent != key->parent) {
+        return 0;
+    }
+    
+    if (dir) {
+        if (__atomic_load_n(&dir->generation, __ATOMIC_ACQUIRE) != generation || !key_matches(dir, key)) {
+            return 0;
+        }
+    } else {
+        uint64_t words[FS_DCACHE_NAME_WORDS];
+        name_words(key, words);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE) != shard_seq || memcmp(name, words, sizeof(words)) != 0) {
+            return 0;
+        }
+    }
+    *found = dir;
+    return 1;
+}
+
+// Caches what the index said about 'key' if it was a directory or nothing;
+// 'shard_seq' is the seq the miss was seen at. An entry another thread is
+// filling is left to it.
+static void dcache_fill(const DentryKey* key, File* file, unsigned long shard_seq) {
+    uint32_t generation = 0;
+    if (file) {
+        generation = __atomic_load_n(&file->generation, __ATOMIC_ACQUIRE);
+        if (!file->is_dir || !(generation & 1)) return;
+    }
+    
+    DentryCacheEntry* entry = dcache_entry(key->hash);
+    unsigned long seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&entry->hash, key->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->parent, key->parent, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->dir, file, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->shard_seq, shard_seq, __ATOMIC_RELAXED);
+    if (!file) {
+        uint64_t words[FS_DCACHE_NAME_WORDS];
+        name_words(key, words);
+        for (int i = 0; i < FS_DCACHE_NAME_WORDS; i++) {
+            __atomic_store_n(&entry->name[i], words[i], __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// The lock-free lookup: the dentry cache, then the index, whose answer is
+// cached on the way out. Caller is inside reader_enter; returns 0 when the
+// shard lock is needed after all.
+static int lookup_lockless(ReaderRecord* reader, IndexShard* shard, const DentryKey* key, File** found) {
+    if (dcache_lookup(shard, key, found)) {
+        __atomic_store_n(&reader->dcache_hits, reader->dcache_hits + 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    __atomic_store_n(&reader->dcache_misses, reader->dcache_misses + 1, __ATOMIC_RELAXED);
+    
+    unsigned long seq;
+    if (!find_file_lockless(shard, key, found, &seq)) return 0;
+    dcache_fill(key, *found, seq);
+    return 1;
+}
+
+// Looks up a path's last component without locks. Most names looked up
+// exist, so leaves go straight to the index, until a miss in their
+// directory is cached; from then on lookups there try the cache first, and
+// repeated probes for a missing name stop there. Caller is inside
+// reader_enter; returns 0 when the shard lock is needed after all.
+static int lookup_target_lockless(ReaderRecord* reader, const PathTarget* target, File** found) {
+    IndexShard* shard = shard_for(target->key.hash);
+    if (__atomic_load_n(&target->dir->cached_misses, __ATOMIC_RELAXED)) {
+        return lookup_lockless(reader, shard, &target->key, found);
+    }
+    
+    unsigned long seq;
+    if (!find_file_lockless(shard, &target->key, found, &seq)) return 0;
+    if (!*found) {
+        dcache_fill(&target->key, NULL, seq);
+        __atomic_store_n(&target->dir->cached_misses, 1, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+// Splits the next component off the path that ends at 'end': returns where
+// it starts and sets *len, or returns NULL once only slashes are left
+static const char* next_component(const char* path, const char* end, size_t* len) {
+    while (path < end && *path == '/') {
+        path++;
+    }
+    if (path == end) return NULL;
+    const char* slash = memchr(path, '/', (size_t)(end - path));
+    *len = (size_t)((slash ? slash : end) - path);
+    return path;
+}
+
+// Moves a path walk into the directory 'key' names
+static FileSystemError walk_into(ReaderRecord* reader, PathTarget* target) {
+    IndexShard* shard = shard_for(target->key.hash);
+    File* file = NULL;
+    int locked = 0;
+    if (!reader || !lookup_lockless(reader, shard, &target->key, &file)) {
+        pthread_rwlock_rdlock(&shard->lock);
+        locked = 1;
+        file = find_file_in_hash(shard, &target->key);
+    }
+    
+    FileSystemError result = !file ? FS_ERROR_FILE_NOT_FOUND : !file->is_dir ? FS_ERROR_NOT_DIR : FS_SUCCESS;
+    if (result == FS_SUCCESS) {
+        target->dir = file;
+        target->dir_generation = __atomic_load_n(&file->generation, __ATOMIC_ACQUIRE);
+        target->key.parent = file->ino;
+    }
+    if (locked) {
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    return result;
+}
+
+// Walks every directory of 'path' and keys its last component; 'path' must
+// outlive the target. With a reader record the walk takes no locks and the
+// caller must be inside reader_enter; without one each step takes its
+// shard's lock.
+static FileSystemError resolve_path(const char* path, ReaderRecord* reader, PathTarget* target) {
+    if (!path) return FS_ERROR_NULL_POINTER;
+    size_t path_len = strnlen(path, FS_MAX_PATH);
+    if (path_len == FS_MAX_PATH) return FS_ERROR_INVALID_NAME;
+    const char* end = path + path_len;
+    
+    target->dir = &fs.root;
+    target->dir_generation = fs.root.generation;
+    target->key.parent = FS_ROOT_INO;
+    size_t len;
+    const char* name = next_component(path, end, &len);
+    if (!name) return FS_ERROR_INVALID_NAME;
+    
+    for (;;) {
+        if (len >= MAX_FILENAME || (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))) {
+            return FS_ERROR_INVALID_NAME;
+        }
+        target->key.name = name;
+        target->key.len = len;
+        target->key.hash = dentry_hash(target->key.parent, name, len);
+        
+        name = next_component(name + len, end, &len);
+        if (!name) return FS_SUCCESS;
+        FileSystemError result = walk_into(reader, target);
+        if (result != FS_SUCCESS) return result;
+    }
+}
+
+// resolve_path for callers that go on to lock the target's shard
+static FileSystemError resolve_target(const char* path, PathTarget* target) {
+    ReaderRecord* reader = reader_record();
+    if (reader) {
+        reader_enter(reader);
+    }
+    FileSystemError result = resolve_path(path, reader, target);
+    if (reader) {
+        reader_exit(reader);
+    }
+    return result;
+}
+
+FileSystemError create_file(const char* name, const char* data) {
+    if (!data) return FS_ERROR_NULL_POINTER;
+    return create_file_with_data(name, data, strlen(data));
+}
+
+// Adds a file or an empty directory under an existing directory
+static FileSystemError create_entry(const char* path, int is_dir, const void* data, uint64_t size) {
+    PathTarget target;
+    FileSystemError result = resolve_target(path, &target);
+    if (result != FS_SUCCESS) {
+        FS_LOG("Error: Cannot create %s (%d)\n", path, result);
+        return result;
+    }
+    
+    IndexShard* shard = shard_for(target.key.hash);
+    shard_write_lock(shard);
+    
+    if (is_rehashing(shard)) {
+        rehash_step(shard, REHASH_STEP);
+    }
+    
+    if (find_file_in_hash(shard, &target.key) != NULL) {
+        shard_write_unlock(shard);
+        FS_LOG("Error: File already exists: %s\n", path);
+        return FS_ERROR_FILE_EXISTS;
+    }
+    
+    File* file;
+    result = claim_file_slot(&target, is_dir, &file);
+    if (result != FS_SUCCESS) {
+        shard_write_unlock(shard);
+        if (result == FS_ERROR_NO_SPACE) {
+            FS_LOG("Error: File system is full\n");
+        } else {
+            FS_LOG("Error: Directory removed while creating %s\n", path);
+        }
+        return result;
+    }
+    
+    // Freed slots are already empty inline files; fresh ones are all zeros.
+    // Everything a lock-free reader looks at is set before the insert publishes it.
+    file->is_inline = 1;
+    if (!is_dir) {
+        result = file_write(file, 0, data, (size_t)size);
+    }
+    file->access_count = 0;
+    clock_gettime(CLOCK_REALTIME, &file->created_time);
+    file->modified_time = file->created_time;
+    
+    HashTable* table = shard->tables[is_rehashing(shard) ? 1 : 0];
+    if (result != FS_SUCCESS || table_insert(table, file, target.key.hash) != 0) {
+        file_release_blocks(file);
+        release_file_slot(file);
+        shard_write_unlock(shard);
+        FS_LOG("Error: No space for file: %s\n", path);
+        return result != FS_SUCCESS ? result : FS_ERROR_NO_SPACE;
+    }
+    
+    maybe_start_resize(shard);
+    __atomic_fetch_add(&fs.total_files_created, 1, __ATOMIC_RELAXED);
+    shard_write_unlock(shard);
+    
+    if (is_dir) {
+        FS_LOG("Created Directory: %s\n", path);
+    } else {
+        FS_LOG("Created File: %s (Size: %llu bytes)\n", path, (unsigned long long)size);
+    }
+    return FS_SUCCESS;
+}
+
+FileSystemError create_file_with_data(const char* name, const void* data, uint64_t size) {
+    if (!name || (!data && size > 0)) return FS_ERROR_NULL_POINTER;
+    if (size > FS_MAX_FILE_SIZE) return FS_ERROR_TOO_LARGE;
+    return create_entry(name, 0, data, size);
+}
+
+FileSystemError fs_mkdir(const char* path) {
+    return create_entry(path, 1, NULL, 0);
+}
+
+// Adds one lookup to the statistics: to the thread's own record when it
+// has one, so concurrent readers don't bounce a shared counter
+static void count_lookup(ReaderRecord* reader, int timed, uint64_t start_ticks) {
+    uint64_t lookup_ns = timed ? fast_timer_elapsed_ns(start_ticks, fast_timer_now()) : 0;
+    if (!reader) {
+        if (timed) {
+            __atomic_fetch_add(&fs.total_lookup_time_ns, lookup_ns, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&fs.timed_lookups, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&fs.total_lookups, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    // Only this thread writes its record; status reads it concurrently
+    if (timed) {
+        __atomic_store_n(&reader->lookup_time_ns, reader->lookup_time_ns + lookup_ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&reader->timed_lookups, reader->timed_lookups + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&reader->lookups, reader->lookups + 1, __ATOMIC_RELAXED);
+}
+
+FileSystemError read_file(const char* name) {
+    if (!name) return FS_ERROR_NULL_POINTER;
+    
+    int timed = fast_timer_sample(fs.timing_interval);
+    uint64_t start_ticks = timed ? fast_timer_now() : 0;
+    
+    ReaderRecord* reader = reader_record();
+    PathTarget target;
+    IndexShard* shard = NULL;
+    File* file = NULL;
+    int locked = 0;
+    
+    // The walk waits behind reader_enter's fence; the path can be on its way meanwhile
+    __builtin_prefetch(name);
+    if (reader) {
+        reader_enter(reader);
+    }
+    FileSystemError result = resolve_path(name, reader, &target);
+    if (result == FS_SUCCESS) {
+        shard = shard_for(target.key.hash);
+        if (!reader || !lookup_target_lockless(reader, &target, &file)) {
+            pthread_rwlock_rdlock(&shard->lock);
+            locked = 1;
+            file = find_file_in_hash(shard, &target.key);
+        }
+        result = !file ? FS_ERROR_FILE_NOT_FOUND : file->is_dir ? FS_ERROR_IS_DIR : FS_SUCCESS;
+    }
+    
+    if (result != FS_SUCCESS) {
+        if (locked) {
+            pthread_rwlock_unlock(&shard->lock);
+        }
+        if (reader) {
+            reader_exit(reader);
+        }
+        FS_LOG("%s: %s\n", result == FS_ERROR_IS_DIR ? "Is a directory" : "File not found", name);
+        return result;
+    }
+    
+    int accesses = __atomic_add_fetch(&file->access_count, 1, __ATOMIC_RELAXED);
+    if (fs_verbose) {
+        // The contents can change under a lock-free reader; the shard lock keeps them still
+        if (!locked) {
+            pthread_rwlock_rdlock(&shard->lock);
+            locked = 1;
+        }
+        char preview[65];
+        size_t shown = file_read(file, 0, preview, sizeof(preview) - 1);
+        preview[shown] = '\0';
+        printf("Reading File: %s (Size: %llu bytes, Access: %d)\n",
+               name, (unsigned long long)file->size, accesses);
+        printf("Content: %s%s\n", preview, file->size > shown ? "..." : "");
+    }
+    
+    count_lookup(reader, timed, start_ticks);
+    if (locked) {
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    if (reader) {
+        reader_exit(reader);
+    }
+    return FS_SUCCESS;
+}
+
+// Copies up to 'len' bytes from 'offset'; *bytes_read is 0 at or past the end
+FileSystemError read_file_at(const char* name, uint64_t offset, void* buf, size_t len, size_t* bytes_read) {
+    if (!name || !bytes_read || (!buf && len > 0)) return FS_ERROR_NULL_POINTER;
+    
+    PathTarget target;
+    FileSystemError result = resolve_target(name, &target);
+    if (result != FS_SUCCESS) return result;
+    
+    IndexShard* shard = shard_for(target.key.hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    File* file = find_file_in_hash(shard, &target.key);
+    if (!file || file->is_dir) {
+        pthread_rwlock_unlock(&shard->lock);
+        return file ? FS_ERROR_IS_DIR : FS_ERROR_FILE_NOT_FOUND;
+    }
+    
+    *bytes_read = file_read(file, offset, buf, len);
+    __atomic_fetch_add(&file->access_count, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+    return FS_SUCCESS;
+}
+
+// Overwrites or extends the file; writing past the end leaves a hole
+FileSystemError write_file_at(const char* name, uint64_t offset, const void* data, size_t len) {
+    if (!name || (!data && len > 0)) return FS_ERROR_NULL_POINTER;
+    
+    PathTarget target;
+    FileSystemError result = resolve_target(name, &target);
+    IndexShard* shard = NULL;
+    File* file = NULL;
+    if (result == FS_SUCCESS) {
+        shard = shard_for(target.key.hash);
+        pthread_rwlock_wrlock(&shard->lock);
+        file = find_file_in_hash(shard, &target.key);
+        result = !file ? FS_ERROR_FILE_NOT_FOUND : file->is_dir ? FS_ERROR_IS_DIR : FS_SUCCESS;
+        if (result != FS_SUCCESS) {
+            pthread_rwlock_unlock(&shard->lock);
+        }
+    }
+    if (result != FS_SUCCESS) {
+        FS_LOG("Error: Cannot write to %s (%d)\n", name, result);
+        return result;
+    }
+    
+    result = file_write(file, offset, data, len);
+    clock_gettime(CLOCK_REALTIME, &file->modified_time);
+    pthread_rwlock_unlock(&shard->lock);
+    
+    if (result == FS_SUCCESS) {
+        FS_LOG("Wrote %zu bytes to %s at offset %llu\n", len, name, (unsigned long long)offset);
+    } else {
+        FS_LOG("Error: Write to %s at offset %llu failed (%d)\n", name, (unsigned long long)offset, result);
+    }
+    return result;
+}
+
+static inline FsHandle file_handle(File* file) {
+    uint32_t generation = __atomic_load_n(&file->generation, __ATOMIC_ACQUIRE);
+    return ((uint64_t)generation << 32) | (uint32_t)file->pool_index;
+}
+
+// Locks the shard of the file a handle names and returns the file and the
+// shard, or returns NULL with nothing locked once the file was deleted. The
+// hash is read before locking and may belong to a newer file in the slot;
+// the generation check under the lock rejects that case.
+static File* lock_handle(FsHandle handle, int write, IndexShard** shard) {
+    uint32_t index = (uint32_t)handle;
+    uint32_t generation = (uint32_t)(handle >> 32);
+    if (!(generation & 1) || index >= (uint32_t)pool_capacity()) return NULL;
+    
+    File* file = pool_file((int)index);
+    *shard = shard_for(__atomic_load_n(&file->hash, __ATOMIC_RELAXED));
+    if (write) {
+        pthread_rwlock_wrlock(&(*shard)->lock);
+    } else {
+        pthread_rwlock_rdlock(&(*shard)->lock);
+    }
+    if (__atomic_load_n(&file->generation, __ATOMIC_ACQUIRE) != generation) {
+        pthread_rwlock_unlock(&(*shard)->lock);
+        return NULL;
+    }
+    return file;
+}
 
-static unsigned int hash_function(const char* str) {
-    unsigned int hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c;
+FileSystemError fs_open(const char* name, FsHandle* handle) {
+    if (!name || !handle) return FS_ERROR_NULL_POINTER;
+    
+    // A file deleted since the lookup yields a handle that is already stale
+    ReaderRecord* reader = reader_record();
+    PathTarget target;
+    File* file = NULL;
+    __builtin_prefetch(name);
+    if (reader) {
+        reader_enter(reader);
+    }
+    FileSystemError result = resolve_path(name, reader, &target);
+    if (result == FS_SUCCESS) {
+        IndexShard* shard = shard_for(target.key.hash);
+        int locked = 0;
+        if (!reader || !lookup_target_lockless(reader, &target, &file)) {
+            pthread_rwlock_rdlock(&shard->lock);
+            locked = 1;
+            file = find_file_in_hash(shard, &target.key);
+        }
+        result = !file ? FS_ERROR_FILE_NOT_FOUND : file->is_dir ? FS_ERROR_IS_DIR : FS_SUCCESS;
+        if (result == FS_SUCCESS) {
+            *handle = file_handle(file);
+        }
+        if (locked) {
+            pthread_rwlock_unlock(&shard->lock);
+        }
+    }
+    if (reader) {
+        reader_exit(reader);
     }
-    return hash % HASH_TABLE_SIZE;
+    return result;
 }
 
-static double timespec_to_ms(struct timespec *ts) {
-    return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+FileSystemError fs_pread(FsHandle handle, void* buf, size_t len, uint64_t offset, size_t* bytes_read) {
+    if (!bytes_read || (!buf && len > 0)) return FS_ERROR_NULL_POINTER;
+    
+    IndexShard* shard;
+    File* file = lock_handle(handle, 0, &shard);
+    if (!file) return FS_ERROR_STALE_HANDLE;
+    
+    *bytes_read = file_read(file, offset, buf, len);
+    __atomic_fetch_add(&file->access_count, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+    return FS_SUCCESS;
 }
 
-FileSystemError init_filesystem() {
-    memset(&fs, 0, sizeof(FileSystem));
+FileSystemError fs_pwrite(FsHandle handle, const void* buf, size_t len, uint64_t offset) {
+    if (!buf && len > 0) return FS_ERROR_NULL_POINTER;
     
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        fs.hash_table[i] = NULL;
-    }
+    IndexShard* shard;
+    File* file = lock_handle(handle, 1, &shard);
+    if (!file) return FS_ERROR_STALE_HANDLE;
     
-    for (int i = 0; i < MAX_FILES; i++) {
-        fs.file_pool[i].is_deleted = 1;
-        fs.file_pool[i].hash_next = NULL;
+    FileSystemError result = file_write(file, offset, buf, len);
+    clock_gettime(CLOCK_REALTIME, &file->modified_time);
+    pthread_rwlock_unlock(&shard->lock);
+    return result;
+}
+
+// Writes at the current end; 'offset', if given, receives where that was
+FileSystemError fs_append(FsHandle handle, const void* buf, size_t len, uint64_t* offset) {
+    if (!buf && len > 0) return FS_ERROR_NULL_POINTER;
+    
+    IndexShard* shard;
+    File* file = lock_handle(handle, 1, &shard);
+    if (!file) return FS_ERROR_STALE_HANDLE;
+    
+    uint64_t end = file->size;
+    FileSystemError result = file_write(file, end, buf, len);
+    clock_gettime(CLOCK_REALTIME, &file->modified_time);
+    pthread_rwlock_unlock(&shard->lock);
+    
+    if (offset) {
+        *offset = end;
     }
+    return result;
+}
+
+// Points 'view' at the stored bytes from 'offset' without copying. The view
+// ends at the end of the file, of the request or of the block, whichever
+// comes first, so callers walk a file in a loop. On success the file's
+// shard stays read-locked until fs_release_view.
+FileSystemError fs_read_view(FsHandle handle, uint64_t offset, size_t len, FsReadView* view) {
+    if (!view) return FS_ERROR_NULL_POINTER;
     
-    if (pthread_rwlock_init(&fs.lock, NULL) != 0) {
-        return FS_ERROR_INIT_FAILED;
+    IndexShard* shard;
+    File* file = lock_handle(handle, 0, &shard);
+    if (!file) {
+        view->data = NULL;
+        view->len = 0;
+        view->guard = NULL;
+        return FS_ERROR_STALE_HANDLE;
     }
     
-    printf("Enhanced File System with Hash Table Lookups\n");
-    printf("===========================================\n\n");
-    printf("  - Hash table with %d buckets for O(1) lookups\n", HASH_TABLE_SIZE);
-    printf("  - Thread-safe read-write operations\n");
-    printf("  - Support for %d files\n\n", MAX_FILES);
+    if (offset >= file->size) {
+        len = 0;
+    } else if (len > file->size - offset) {
+        len = file->size - offset;
+    }
     
+    // A non-NULL data pointer is what marks the view as holding the lock
+    view->data = zero_block;
+    if (len > 0 && file->is_inline) {
+        view->data = file->contents.inline_data + offset;
+    } else if (len > 0) {
+        size_t within = offset % FS_BLOCK_SIZE;
+        if (len > FS_BLOCK_SIZE - within) {
+            len = FS_BLOCK_SIZE - within;
+        }
+        uint32_t* entry = block_entry(file, offset / FS_BLOCK_SIZE, 0);
+        view->data = (entry && *entry ? block_data(*entry) : zero_block) + within;
+    }
+    view->len = len;
+    view->guard = &shard->lock;
+    __atomic_fetch_add(&file->access_count, 1, __ATOMIC_RELAXED);
     return FS_SUCCESS;
 }
 
-static File* find_file_in_hash(const char* name) {
-    unsigned int hash = hash_function(name);
-    File* current = fs.hash_table[hash];
+void fs_release_view(FsReadView* view) {
+    if (!view || !view->data) return;
+    pthread_rwlock_unlock(view->guard);
+    view->data = NULL;
+    view->len = 0;
+    view->guard = NULL;
+}
+
+FileSystemError fs_file_size(FsHandle handle, uint64_t* size) {
+    if (!size) return FS_ERROR_NULL_POINTER;
     
-    while (current != NULL) {
-        if (!current->is_deleted && strcmp(current->filename, name) == 0) {
-            return current;
-        }
-        current = current->hash_next;
+    IndexShard* shard;
+    File* file = lock_handle(handle, 0, &shard);
+    if (!file) return FS_ERROR_STALE_HANDLE;
+    *size = file->size;
+    pthread_rwlock_unlock(&shard->lock);
+    return FS_SUCCESS;
+}
+
+// The initial shard table size doubled until 'files' fit under the load factor
+static unsigned int table_size_for(IndexMode mode, int files) {
+    unsigned int size = mode == FS_INDEX_SWISS ? SWISS_INITIAL_SLOTS : SHARD_BUCKETS;
+    while (mode == FS_INDEX_SWISS ? (int)SWISS_MAX_LOAD(size) <= files : (int)size <= files) {
+        size *= 2;
     }
-    return NULL;
+    return size;
 }
 
-static File* get_free_file_slot() {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (fs.file_pool[i].is_deleted) {
-            return &fs.file_pool[i];
+// Rebuilds the index in the other layout from the live files. Unlike a
+// resize this is done in one go, so switch before loading a large tree.
+FileSystemError set_index_mode(IndexMode mode) {
+    lock_all_shards(1);
+    if (mode == fs.index_mode) {
+        unlock_all_shards();
+        return FS_SUCCESS;
+    }
+    
+    HashTable* fresh[FS_INDEX_SHARDS];
+    unsigned int total_size = 0;
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        IndexShard* shard = &fs.shards[i];
+        int files = shard->tables[0]->used + (shard->tables[1] ? shard->tables[1]->used : 0);
+        unsigned int size = table_size_for(mode, files);
+        fresh[i] = table_new(mode, size);
+        if (!fresh[i]) {
+            while (i-- > 0) {
+                table_free(fresh[i]);
+            }
+            unlock_all_shards();
+            return FS_ERROR_NO_SPACE;
         }
+        total_size += size;
     }
-    return NULL;
+    
+    // Building chains relinks files lock-free readers of the old tables may
+    // be walking, so every shard's seq stays odd until the swap is done
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        __atomic_store_n(&fs.shards[i].seq, fs.shards[i].seq + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < fs.file_count; i++) {
+        File* file = live_file(i);
+        table_insert(fresh[file->hash & (FS_INDEX_SHARDS - 1)], file, file->hash);
+    }
+    
+    fs.index_mode = mode;
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        IndexShard* shard = &fs.shards[i];
+        HashTable* old[2] = { shard->tables[0], shard->tables[1] };
+        __atomic_store_n(&shard->tables[0], fresh[i], __ATOMIC_RELEASE);
+        __atomic_store_n(&shard->tables[1], NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+        shard->rehash_index = -1;
+        retire_table(old[0]);
+        if (old[1]) {
+            retire_table(old[1]);
+        }
+    }
+    
+    unlock_all_shards();
+    FS_LOG("Index mode: %s (%u %s)\n", mode == FS_INDEX_SWISS ? "Swiss table" : "chained",
+           total_size, mode == FS_INDEX_SWISS ? "slots" : "buckets");
+    return FS_SUCCESS;
 }
 
-FileSystemError create_file(const char* name, const char* data) {
-    if (!name || !data) return FS_ERROR_NULL_POINTER;
-    if (strlen(name) == 0 || strlen(name) >= MAX_FILENAME) return FS_ERROR_INVALID_NAME;
+// Times 1 in 'interval' lookups; 1 times all of them, 0 none
+void set_lookup_timing_interval(uint32_t interval) {
+    __atomic_store_n(&fs.timing_interval, interval, __ATOMIC_RELAXED);
+}
+
+// Removes a file, or with 'is_dir' an empty directory
+static FileSystemError remove_entry(const char* path, int is_dir) {
+    PathTarget target;
+    FileSystemError result = resolve_target(path, &target);
+    if (result != FS_SUCCESS) {
+        FS_LOG("Error: Cannot remove %s (%d)\n", path, result);
+        return result;
+    }
     
-    pthread_rwlock_wrlock(&fs.lock);
+    IndexShard* shard = shard_for(target.key.hash);
+    shard_write_lock(shard);
     
-    if (find_file_in_hash(name) != NULL) {
-        pthread_rwlock_unlock(&fs.lock);
-        printf("Error: File already exists: %s\n", name);
-        return FS_ERROR_FILE_EXISTS;
+    if (is_rehashing(shard)) {
+        rehash_step(shard, REHASH_STEP);
     }
     
-    File* file = get_free_file_slot();
+    File* file = find_file_in_hash(shard, &target.key);
     if (!file) {
-        pthread_rwlock_unlock(&fs.lock);
-        printf("Error: File system is full\n");
-        return FS_ERROR_NO_SPACE;
+        result = FS_ERROR_FILE_NOT_FOUND;
+    } else if (file->is_dir != is_dir) {
+        result = is_dir ? FS_ERROR_NOT_DIR : FS_ERROR_IS_DIR;
+    } else if (is_dir) {
+        result = close_dir(file);
+    }
+    if (result != FS_SUCCESS) {
+        shard_write_unlock(shard);
+        FS_LOG("Error: Cannot remove %s (%d)\n", path, result);
+        return result;
     }
     
-    strncpy(file->filename, name, MAX_FILENAME - 1);
-    file->filename[MAX_FILENAME - 1] = '\0';
-    strncpy(file->data, data, MAX_FILESIZE - 1);
-    file->data[MAX_FILESIZE - 1] = '\0';
-    file->size = strlen(file->data);
-    file->is_deleted = 0;
-    file->access_count = 0;
-    
-    clock_gettime(CLOCK_MONOTONIC, &file->created_time);
-    file->modified_time = file->created_time;
-    
-    unsigned int hash = hash_function(name);
-    file->hash_next = fs.hash_table[hash];
-    fs.hash_table[hash] = file;
+    for (int t = 0; t <= is_rehashing(shard); t++) {
+        if (table_remove(shard->tables[t], &target.key)) break;
+    }
+    retire_file(file);
+    __atomic_fetch_add(&fs.total_files_deleted, 1, __ATOMIC_RELAXED);
+    if (fs.index_mode == FS_INDEX_SWISS) {
+        maybe_start_resize(shard);  // Tombstones count toward the Swiss load
+    }
+    shard_write_unlock(shard);
     
-    fs.file_count++;
-    fs.total_files_created++;
+    FS_LOG("Deleted %s: %s\n", is_dir ? "Directory" : "File", path);
+    return FS_SUCCESS;
+}
+
+FileSystemError delete_file(const char* name) {
+    return remove_entry(name, 0);
+}
+
+// Fails with FS_ERROR_NOT_EMPTY while the directory has entries
+FileSystemError fs_rmdir(const char* path) {
+    return remove_entry(path, 1);
+}
+
+// Copies up to 'max' entries of the directory into 'entries', in no
+// particular order; *count receives how many it has, so a caller whose
+// array was too small can retry with a bigger one
+FileSystemError fs_readdir(const char* path, FsDirEntry* entries, size_t max, size_t* count) {
+    if (!path || !count || (!entries && max > 0)) return FS_ERROR_NULL_POINTER;
     
-    pthread_rwlock_unlock(&fs.lock);
+    PathTarget target = { &fs.root, 1, { FS_ROOT_INO, NULL, 0, 0 } };
+    size_t len;
+    if (next_component(path, path + strnlen(path, FS_MAX_PATH), &len)) {
+        ReaderRecord* reader = reader_record();
+        if (reader) {
+            reader_enter(reader);
+        }
+        FileSystemError result = resolve_path(path, reader, &target);
+        if (result == FS_SUCCESS) {
+            result = walk_into(reader, &target);
+        }
+        if (reader) {
+            reader_exit(reader);
+        }
+        if (result != FS_SUCCESS) return result;
+    }
     
-    printf("Created File: %s (Size: %d bytes)\n", file->filename, file->size);
+    // Membership changes under alloc_lock, and a removed directory is
+    // recognized by its generation
+    File* dir = target.dir;
+    size_t n = 0;
+    pthread_mutex_lock(&fs.alloc_lock);
+    if (__atomic_load_n(&dir->generation, __ATOMIC_RELAXED) != target.dir_generation) {
+        pthread_mutex_unlock(&fs.alloc_lock);
+        return FS_ERROR_FILE_NOT_FOUND;
+    }
+    for (File* child = dir->contents.dir.first_child; child; child = child->next_sibling, n++) {
+        if (n < max) {
+            entries[n].ino = child->ino;
+            entries[n].is_dir = child->is_dir;
+            memcpy(entries[n].name, child->filename, MAX_FILENAME);
+        }
+    }
+    pthread_mutex_unlock(&fs.alloc_lock);
+    *count = n;
     return FS_SUCCESS;
 }
 
-FileSystemError read_file(const char* name) {
-    if (!name) return FS_ERROR_NULL_POINTER;
+// Where each region of an image of this size starts
+static void image_layout(FsSuperblock* super, uint64_t blocks, uint64_t inodes) {
+    memset(super, 0, sizeof(FsSuperblock));
+    super->magic = FS_IMAGE_MAGIC;
+    super->version = FS_IMAGE_VERSION;
+    super->block_size = FS_BLOCK_SIZE;
+    super->block_count = blocks;
+    super->inode_count = inodes;
+    super->inode_table = 1;
+    super->bitmap = super->inode_table + (inodes + FS_INODES_PER_BLOCK - 1) / FS_INODES_PER_BLOCK;
+    super->data = super->bitmap + (blocks + FS_BLOCK_SIZE * 8 - 1) / (FS_BLOCK_SIZE * 8);
+    super->next_ino = FS_ROOT_INO + 1;
+}
+
+static inline DiskInode* image_inodes(void) {
+    return (DiskInode*)(fs.image.map + fs.image.super->inode_table * FS_BLOCK_SIZE);
+}
+
+static inline uint8_t* image_bitmap(void) {
+    return fs.image.map + fs.image.super->bitmap * FS_BLOCK_SIZE;
+}
+
+static inline int block_in_use(const uint8_t* bits, uint64_t block) {
+    return bits[block / 8] >> (block % 8) & 1;
+}
+
+static inline void set_block_bit(uint8_t* bits, uint64_t block, int in_use) {
+    if (in_use) {
+        bits[block / 8] |= (uint8_t)(1 << (block % 8));
+    } else {
+        bits[block / 8] &= (uint8_t)~(1 << (block % 8));
+    }
+}
+
+// Rounds the image down to whole block chunks and the inode slots up to
+// whole pool chunks, so both map onto the store and the pool directly
+FileSystemError fs_mkfs(const char* path, uint64_t size, uint64_t inodes) {
+    if (!path) return FS_ERROR_NULL_POINTER;
     
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    uint64_t blocks = size / FS_BLOCK_SIZE / FS_BLOCK_CHUNK * FS_BLOCK_CHUNK;
+    if (inodes == 0) {
+        inodes = size / FS_BYTES_PER_INODE;
+    }
+    inodes = inodes < FILE_POOL_CHUNK ? FILE_POOL_CHUNK : (inodes + FILE_POOL_CHUNK - 1) / FILE_POOL_CHUNK * FILE_POOL_CHUNK;
+    if (blocks > UINT32_MAX / FS_BLOCK_CHUNK * FS_BLOCK_CHUNK || inodes > FS_MAX_INODES) {
+        return FS_ERROR_TOO_LARGE;
+    }
+    FsSuperblock super;
+    image_layout(&super, blocks, inodes);
+    if (super.data >= blocks) {
+        return FS_ERROR_NO_SPACE;  // Not one data block left over
+    }
     
-    pthread_rwlock_rdlock(&fs.lock);
+    // Block 0 and the metadata are in use. The inode table stays the zeros
+    // a new file reads as, every slot free.
+    size_t bitmap_bytes = (size_t)(super.data - super.bitmap) * FS_BLOCK_SIZE;
+    uint8_t* bits = calloc(bitmap_bytes, 1);
+    if (!bits) return FS_ERROR_NO_SPACE;
+    for (uint64_t block = 0; block < super.data; block++) {
+        set_block_bit(bits, block, 1);
+    }
     
-    File* file = find_file_in_hash(name);
-    if (!file) {
-        pthread_rwlock_unlock(&fs.lock);
-        printf("File not found: %s\n", name);
-        return FS_ERROR_FILE_NOT_FOUND;
+    FileSystemError result = FS_SUCCESS;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 ||
+        ftruncate(fd, (off_t)(blocks * FS_BLOCK_SIZE)) != 0 ||
+        pwrite(fd, bits, bitmap_bytes, (off_t)(super.bitmap * FS_BLOCK_SIZE)) != (ssize_t)bitmap_bytes ||
+        pwrite(fd, &super, sizeof(super), 0) != (ssize_t)sizeof(super) ||
+        fsync(fd) != 0) {
+        result = FS_ERROR_IO;
     }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(bits);
     
-    file->access_count++;
-    printf("Reading File: %s (Size: %d bytes, Access: %d)\n", 
-           name, file->size, file->access_count);
-    printf("Content: %s\n", file->data);
+    if (result == FS_SUCCESS) {
+        FS_LOG("Created image %s: %llu blocks of %d bytes, %llu inode slots, %llu data blocks\n", path,
+               (unsigned long long)blocks, FS_BLOCK_SIZE, (unsigned long long)inodes,
+               (unsigned long long)(blocks - super.data));
+    }
+    return result;
+}
+
+// True if the superblock describes an image fs_mkfs could have made, and
+// one that fits in the file's 'size' bytes
+static int superblock_valid(const FsSuperblock* super, uint64_t size) {
+    if (super->magic != FS_IMAGE_MAGIC || super->version != FS_IMAGE_VERSION ||
+        super->block_size != FS_BLOCK_SIZE) {
+        return 0;
+    }
+    if (super->block_count == 0 || super->block_count % FS_BLOCK_CHUNK != 0 ||
+        super->block_count > UINT32_MAX / FS_BLOCK_CHUNK * FS_BLOCK_CHUNK ||
+        super->block_count > size / FS_BLOCK_SIZE ||
+        super->inode_count == 0 || super->inode_count % FILE_POOL_CHUNK != 0 ||
+        super->inode_count > FS_MAX_INODES) {
+        return 0;
+    }
     
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    FsSuperblock layout;
+    image_layout(&layout, super->block_count, super->inode_count);
+    return super->inode_table == layout.inode_table && super->bitmap == layout.bitmap &&
+           super->data == layout.data && super->data < super->block_count &&
+           super->inode_high <= super->inode_count && super->inode_high % FILE_POOL_CHUNK == 0 &&
+           super->next_ino > FS_ROOT_INO;
+}
+
+// Makes every block of the image part of the store and stacks the free
+// ones, high to low like grow_block_store
+static int load_block_store(void) {
+    FsSuperblock* super = fs.image.super;
+    int chunks = (int)(super->block_count / FS_BLOCK_CHUNK);
+    fs.block_chunks = malloc(chunks * sizeof(uint8_t*));
+    fs.free_blocks = malloc(super->block_count * sizeof(uint32_t));
+    if (!fs.block_chunks || !fs.free_blocks) return -1;
+    for (int i = 0; i < chunks; i++) {
+        fs.block_chunks[i] = fs.image.map + (size_t)i * FS_BLOCK_CHUNK * FS_BLOCK_SIZE;
+    }
+    fs.block_chunk_count = fs.block_chunk_capacity = chunks;
     
-    struct timespec diff;
-    if (end_time.tv_nsec < start_time.tv_nsec) {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec - 1;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec + 1000000000;
-    } else {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec;
+    const uint8_t* bits = image_bitmap();
+    for (uint64_t block = super->block_count; block-- > super->data;) {
+        if (!block_in_use(bits, block)) {
+            fs.free_blocks[fs.free_block_count++] = (uint32_t)block;
+        }
+    }
+    fs.blocks_used = (uint32_t)(super->block_count - super->data) - fs.free_block_count;
+    return 0;
+}
+
+// A map entry, and every entry below it, must name an in-use block of the
+// data region: anything else would read outside the mapping or write over
+// the inode table and bitmap
+static int block_tree_valid(const uint8_t* bits, uint32_t block, int depth) {
+    if (!block) return 1;
+    if (block < fs.image.super->data || block >= fs.image.super->block_count ||
+        !block_in_use(bits, block)) {
+        return 0;
+    }
+    if (depth > 0) {
+        const uint32_t* entries = (const uint32_t*)block_data(block);
+        for (uint32_t i = 0; i < FS_PTRS_PER_BLOCK; i++) {
+            if (!block_tree_valid(bits, entries[i], depth - 1)) return 0;
+        }
+    }
+    return 1;
+}
+
+static int block_map_valid(const BlockMap* map) {
+    const uint8_t* bits = image_bitmap();
+    for (int i = 0; i < FS_DIRECT_BLOCKS; i++) {
+        if (!block_tree_valid(bits, map->direct[i], 0)) return 0;
+    }
+    return block_tree_valid(bits, map->indirect, 1) &&
+           block_tree_valid(bits, map->double_indirect, 2);
+}
+
+// Brings each used inode slot back into the same pool slot, then links the
+// entries into their directories. A parent always has the lower inode
+// number, which rules out cycles. Block maps are only checked for pointers
+// that would take accesses out of the data region; this is no fsck, so
+// blocks claimed twice or leaked go unnoticed.
+static FileSystemError load_inodes(void) {
+    FsSuperblock* super = fs.image.super;
+    DiskInode* inodes = image_inodes();
+    while ((uint64_t)pool_capacity() < super->inode_high) {
+        if (grow_file_pool() != 0) return FS_ERROR_NO_SPACE;
     }
+    fs.next_ino = super->next_ino;
     
-    double lookup_time = timespec_to_ms(&diff);
-    fs.total_lookup_time_ms += lookup_time;
-    fs.total_lookups++;
+    for (uint64_t slot = 0; slot < super->inode_high; slot++) {
+        const DiskInode* disk = &inodes[slot];
+        if (!disk->ino) continue;
+        size_t len = strnlen(disk->name, MAX_FILENAME);
+        if (len == 0 || len == MAX_FILENAME || disk->parent >= disk->ino || disk->ino >= fs.next_ino ||
+            disk->size > FS_MAX_FILE_SIZE || (disk->is_inline && disk->size > FS_INLINE_SIZE)) {
+            return FS_ERROR_BAD_IMAGE;
+        }
+        
+        File* file = pool_file((int)slot);
+        swap_order(file->order_pos, fs.file_count++);
+        file->generation = 1;
+        file->ino = disk->ino;
+        file->parent = disk->parent;
+        memcpy(file->filename, disk->name, len);
+        file->hash = dentry_hash(disk->parent, file->filename, len);
+        file->is_dir = disk->is_dir;
+        file->is_inline = disk->is_dir || disk->is_inline;
+        file->size = disk->is_dir ? 0 : disk->size;
+        file->created_time.tv_sec = (time_t)disk->created_sec;
+        file->created_time.tv_nsec = (long)disk->created_nsec;
+        file->modified_time.tv_sec = (time_t)disk->modified_sec;
+        file->modified_time.tv_nsec = (long)disk->modified_nsec;
+        if (!disk->is_dir) {
+            memcpy(&file->contents, disk->contents, FS_INLINE_SIZE);
+            if (!file->is_inline && !block_map_valid(&file->contents.map)) return FS_ERROR_BAD_IMAGE;
+        }
+    }
     
-    pthread_rwlock_unlock(&fs.lock);
+    // A directory can sit in a later slot than its entries, hence a second pass
+    for (int i = 0; i < fs.file_count; i++) {
+        File* file = live_file(i);
+        uint32_t slot = inodes[file->pool_index].parent_slot;
+        File* dir = &fs.root;
+        if (slot != FS_ROOT_SLOT) {
+            if (slot >= super->inode_high) return FS_ERROR_BAD_IMAGE;
+            dir = pool_file((int)slot);
+            if (dir->order_pos >= fs.file_count) return FS_ERROR_BAD_IMAGE;
+        }
+        if (!dir->is_dir || dir->ino != file->parent) return FS_ERROR_BAD_IMAGE;
+        link_child(dir, file);
+    }
     return FS_SUCCESS;
 }
 
-FileSystemError delete_file(const char* name) {
-    if (!name) return FS_ERROR_NULL_POINTER;
+// Gives each shard a table sized for its share of the loaded entries
+static FileSystemError index_loaded_files(void) {
+    int counts[FS_INDEX_SHARDS] = { 0 };
+    for (int i = 0; i < fs.file_count; i++) {
+        counts[live_file(i)->hash & (FS_INDEX_SHARDS - 1)]++;
+    }
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        HashTable* table = table_new(fs.index_mode, table_size_for(fs.index_mode, counts[i]));
+        if (!table) return FS_ERROR_NO_SPACE;
+        table_free(fs.shards[i].tables[0]);
+        fs.shards[i].tables[0] = table;
+    }
+    for (int i = 0; i < fs.file_count; i++) {
+        File* file = live_file(i);
+        if (table_insert(shard_for(file->hash)->tables[0], file, file->hash) != 0) {
+            return FS_ERROR_NO_SPACE;
+        }
+    }
+    return FS_SUCCESS;
+}
+
+static void teardown_filesystem(int sync_image);
+
+// Takes the place of init_filesystem. Only the superblock is read up
+// front; the inode table is read through the mapping and file contents
+// aren't touched until they are read.
+FileSystemError fs_mount(const char* path) {
+    if (!path) return FS_ERROR_NULL_POINTER;
     
-    pthread_rwlock_wrlock(&fs.lock);
+    FsSuperblock super;
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return FS_ERROR_IO;
+    if (fstat(fd, &st) != 0 || pread(fd, &super, sizeof(super), 0) != (ssize_t)sizeof(super)) {
+        close(fd);
+        return FS_ERROR_IO;
+    }
+    if (!superblock_valid(&super, (uint64_t)st.st_size)) {
+        close(fd);
+        return FS_ERROR_BAD_IMAGE;
+    }
+    size_t size = (size_t)(super.block_count * FS_BLOCK_SIZE);
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return FS_ERROR_IO;
+    }
     
-    unsigned int hash = hash_function(name);
-    File* current = fs.hash_table[hash];
-    File* prev = NULL;
+    FileSystemError result = init_filesystem();
+    if (result != FS_SUCCESS) {
+        munmap(map, size);
+        close(fd);
+        return result;
+    }
+    fs.image.fd = fd;
+    fs.image.map = map;
+    fs.image.size = size;
+    fs.image.super = map;
+    fs.image.dirty = calloc((super.inode_count + 63) / 64, sizeof(uint64_t));
+    if (!fs.image.dirty || load_block_store() != 0) {
+        result = FS_ERROR_NO_SPACE;
+    }
+    if (result == FS_SUCCESS) {
+        result = load_inodes();
+    }
+    if (result == FS_SUCCESS) {
+        result = index_loaded_files();
+    }
+    if (result != FS_SUCCESS) {
+        teardown_filesystem(0);  // Half loaded: syncing would write that back
+        FS_LOG("Error: Cannot mount %s (%d)\n", path, result);
+        return result;
+    }
     
-    while (current != NULL) {
-        if (!current->is_deleted && strcmp(current->filename, name) == 0) {
-            if (prev) {
-                prev->hash_next = current->hash_next;
-            } else {
-                fs.hash_table[hash] = current->hash_next;
+    FS_LOG("Mounted %s: %d entries, %u of %llu data blocks in use\n", path, fs.file_count,
+           fs.blocks_used, (unsigned long long)(super.block_count - super.data));
+    return FS_SUCCESS;
+}
+
+static void store_inode(DiskInode* disk, const File* file) {
+    memset(disk, 0, sizeof(DiskInode));
+    disk->ino = file->ino;
+    disk->parent = file->parent;
+    disk->parent_slot = file->parent_dir == &fs.root ? FS_ROOT_SLOT : (uint32_t)file->parent_dir->pool_index;
+    disk->size = file->size;
+    disk->created_sec = file->created_time.tv_sec;
+    disk->created_nsec = file->created_time.tv_nsec;
+    disk->modified_sec = file->modified_time.tv_sec;
+    disk->modified_nsec = file->modified_time.tv_nsec;
+    disk->is_dir = (uint8_t)file->is_dir;
+    disk->is_inline = (uint8_t)file->is_inline;
+    memcpy(disk->name, file->filename, MAX_FILENAME);
+    if (!file->is_dir) {
+        memcpy(disk->contents, &file->contents, FS_INLINE_SIZE);
+    }
+}
+
+// The bitmap side of free_block_tree
+static void clear_block_tree(uint8_t* bits, uint32_t block, int depth) {
+    if (!block) return;
+    if (depth > 0) {
+        uint32_t* entries = (uint32_t*)block_data(block);
+        for (uint32_t i = 0; i < FS_PTRS_PER_BLOCK; i++) {
+            clear_block_tree(bits, entries[i], depth - 1);
+        }
+    }
+    set_block_bit(bits, block, 0);
+}
+
+// Rebuilds the bitmap from the allocator: every block is in use but the
+// free ones and those of deleted files still waiting out lock-free readers,
+// as this sync frees their inodes. Only bitmap blocks that changed are
+// copied, so the rest of the region stays clean. Caller holds alloc_lock.
+static int write_block_bitmap(void) {
+    FsSuperblock* super = fs.image.super;
+    size_t bytes = (size_t)(super->data - super->bitmap) * FS_BLOCK_SIZE;
+    uint8_t* bits = calloc(bytes, 1);
+    if (!bits) return -1;
+    memset(bits, 0xff, super->block_count / 8);  // A whole number of bytes, as chunks are
+    for (uint32_t i = 0; i < fs.free_block_count; i++) {
+        set_block_bit(bits, fs.free_blocks[i], 0);
+    }
+    for (int pos = fs.file_count; pos < fs.file_count + fs.limbo_count; pos++) {
+        File* file = live_file(pos);
+        if (file->is_inline) continue;
+        BlockMap* map = &file->contents.map;
+        for (int i = 0; i < FS_DIRECT_BLOCKS; i++) {
+            clear_block_tree(bits, map->direct[i], 0);
+        }
+        clear_block_tree(bits, map->indirect, 1);
+        clear_block_tree(bits, map->double_indirect, 2);
+    }
+    
+    uint8_t* disk = image_bitmap();
+    for (size_t offset = 0; offset < bytes; offset += FS_BLOCK_SIZE) {
+        if (memcmp(disk + offset, bits + offset, FS_BLOCK_SIZE) != 0) {
+            memcpy(disk + offset, bits + offset, FS_BLOCK_SIZE);
+        }
+    }
+    free(bits);
+    return 0;
+}
+
+// Writes the inodes of slots changed since the last sync, the bitmap and
+// the superblock into the mapping, then flushes the mapping. File contents
+// are already there, so msync's dirty page tracking covers them too.
+// There is no journal: the image on disk is consistent as of a sync.
+FileSystemError fs_sync(void) {
+    if (!fs.image.map) return FS_SUCCESS;
+    
+    lock_all_shards(1);
+    pthread_mutex_lock(&fs.alloc_lock);
+    FsSuperblock* super = fs.image.super;
+    int result = write_block_bitmap();
+    if (result == 0) {
+        DiskInode* inodes = image_inodes();
+        for (uint64_t word = 0; word < (super->inode_count + 63) / 64; word++) {
+            for (uint64_t bits = fs.image.dirty[word]; bits; bits &= bits - 1) {
+                uint64_t slot = word * 64 + (uint64_t)__builtin_ctzll(bits);
+                File* file = pool_file((int)slot);
+                if (file->order_pos < fs.file_count) {
+                    store_inode(&inodes[slot], file);
+                } else {
+                    memset(&inodes[slot], 0, sizeof(DiskInode));
+                }
             }
-            
-            current->is_deleted = 1;
-            current->hash_next = NULL;
-            memset(current->data, 0, MAX_FILESIZE);
-            fs.file_count--;
-            fs.total_files_deleted++;
-            
-            pthread_rwlock_unlock(&fs.lock);
-            printf("Deleted File: %s\n", name);
-            return FS_SUCCESS;
+            fs.image.dirty[word] = 0;
+        }
+        super->inode_high = (uint64_t)pool_capacity();
+        super->next_ino = fs.next_ino;
+        super->file_count = (uint64_t)fs.file_count;
+    }
+    pthread_mutex_unlock(&fs.alloc_lock);
+    unlock_all_shards();
+    if (result != 0) return FS_ERROR_NO_SPACE;
+    
+    // Writers can carry on while the pages go out
+    return msync(fs.image.map, fs.image.size, MS_SYNC) == 0 ? FS_SUCCESS : FS_ERROR_IO;
+}
+
+static void print_statistics_locked(void) {
+    unsigned long size = 0;
+    int tombstones = 0;
+    int resizing = 0;
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        IndexShard* shard = &fs.shards[i];
+        size += shard->tables[is_rehashing(shard) ? 1 : 0]->size;
+        for (int t = 0; t <= is_rehashing(shard); t++) {
+            tombstones += shard->tables[t]->tombstones;
         }
-        prev = current;
-        current = current->hash_next;
+        resizing += is_rehashing(shard);
+    }
+    
+    if (fs.index_mode == FS_INDEX_SWISS) {
+        printf("Index: Swiss table, %lu slots in %d shards, load %.2f, %d tombstones",
+               size, FS_INDEX_SHARDS, (double)fs.file_count / size, tombstones);
+    } else {
+        printf("Index: chained hash table, %lu buckets in %d shards, load %.2f",
+               size, FS_INDEX_SHARDS, (double)fs.file_count / size);
+    }
+    if (resizing) {
+        printf(" (%d shards resizing)", resizing);
+    }
+    printf("\n");
+    printf("File pool: %d slots in %d chunks, %d deleted awaiting reuse (epoch %llu)\n",
+           pool_capacity(), fs.pool_chunk_count, fs.limbo_count, (unsigned long long)fs.epoch);
+    printf("Block store: %u of %u %d-byte blocks in use\n", fs.blocks_used,
+           (unsigned int)fs.block_chunk_count * FS_BLOCK_CHUNK, FS_BLOCK_SIZE);
+    if (fs.image.super) {
+        printf("Image: %llu blocks, %d of %llu inode slots in use\n",
+               (unsigned long long)fs.image.super->block_count, fs.file_count,
+               (unsigned long long)fs.image.super->inode_count);
     }
     
-    pthread_rwlock_unlock(&fs.lock);
-    printf("Error: File not found for deletion: %s\n", name);
-    return FS_ERROR_FILE_NOT_FOUND;
+    uint64_t lookup_ns = fs.total_lookup_time_ns;
+    uint64_t timed = (uint64_t)fs.timed_lookups;
+    uint64_t lookups = (uint64_t)fs.total_lookups;
+    uint64_t dcache_hits = 0, dcache_misses = 0;
+    int readers = __atomic_load_n(&fs.reader_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < readers; i++) {
+        lookup_ns += __atomic_load_n(&fs.readers[i].lookup_time_ns, __ATOMIC_RELAXED);
+        timed += __atomic_load_n(&fs.readers[i].timed_lookups, __ATOMIC_RELAXED);
+        lookups += __atomic_load_n(&fs.readers[i].lookups, __ATOMIC_RELAXED);
+        dcache_hits += __atomic_load_n(&fs.readers[i].dcache_hits, __ATOMIC_RELAXED);
+        dcache_misses += __atomic_load_n(&fs.readers[i].dcache_misses, __ATOMIC_RELAXED);
+    }
+    if (dcache_hits + dcache_misses > 0) {
+        printf("Dentry cache: %llu hits, %llu misses over %d entries\n", (unsigned long long)dcache_hits,
+               (unsigned long long)dcache_misses, FS_DCACHE_SIZE);
+    }
+    if (timed > 0) {
+        printf("Average lookup time: %.1f ns (%llu of %llu lookups sampled, %s)\n",
+               (double)lookup_ns / timed, (unsigned long long)timed,
+               (unsigned long long)lookups, fast_timer_source());
+    }
+}
+
+void set_fs_verbose(int verbose) {
+    fs_verbose = verbose;
+}
+
+// Writes the file's path below the root into 'buf'. Caller holds every
+// shard lock, which keeps directory membership still.
+static void entry_path(File* file, char* buf, size_t size) {
+    size_t used = 0;
+    if (file->parent_dir != &fs.root) {
+        entry_path(file->parent_dir, buf, size);
+        used = strlen(buf);
+    }
+    snprintf(buf + used, size - used, used ? "/%s" : "%s", file->filename);
 }
 
 void list_files() {
-    pthread_rwlock_rdlock(&fs.lock);
+    lock_all_shards(0);
     
     printf("\n=== File System Directory ===\n");
     printf("%-20s %-10s %-10s\n", "Filename", "Size", "Access Count");
     printf("----------------------------------------\n");
     
-    int count = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!fs.file_pool[i].is_deleted) {
-            printf("%-20s %-10d %-10d\n", 
-                   fs.file_pool[i].filename, 
-                   fs.file_pool[i].size,
-                   fs.file_pool[i].access_count);
-            count++;
+    char path[FS_MAX_PATH + 1];  // Room for a directory's trailing '/'
+    for (int i = 0; i < fs.file_count; i++) {
+        File* file = live_file(i);
+        entry_path(file, path, sizeof(path));
+        if (file->is_dir) {
+            printf("%-20s %-10s %-10d\n", strcat(path, "/"), "-",
+                   __atomic_load_n(&file->access_count, __ATOMIC_RELAXED));
+            continue;
         }
+        printf("%-20s %-10llu %-10d\n", path, (unsigned long long)file->size,
+               __atomic_load_n(&file->access_count, __ATOMIC_RELAXED));
     }
     
-    if (count == 0) {
+    if (fs.file_count == 0) {
         printf("No files found.\n");
     }
     printf("----------------------------------------\n");
-    printf("Total files: %d\n", count);
-    
-    if (fs.total_lookups > 0) {
-        printf("Average lookup time: %.3f ms\n", 
-               fs.total_lookup_time_ms / fs.total_lookups);
-    }
+    printf("Total files: %d\n", fs.file_count);
+    print_statistics_locked();
     printf("=============================\n\n");
     
-    pthread_rwlock_unlock(&fs.lock);
+    unlock_all_shards();
+}
+
+void print_filesystem_status() {
+    lock_all_shards(0);
+    printf("\n=== File System Status ===\n");
+    printf("Files: %d (created %d, deleted %d)\n",
+           fs.file_count, fs.total_files_created, fs.total_files_deleted);
+    print_statistics_locked();
+    printf("==========================\n\n");
+    unlock_all_shards();
+}
+
+static void teardown_filesystem(int sync_image) {
+    uint8_t* image = fs.image.map;
+    if (image && sync_image) {
+        fs_sync();
+    }
+    for (int i = 0; i < fs.pool_chunk_count; i++) {
+        free(fs.pool_chunks[i]);
+    }
+    free(fs.pool_chunks);
+    free(fs.slot_order);
+    for (int i = 0; i < fs.block_chunk_count && !image; i++) {
+        free(fs.block_chunks[i]);
+    }
+    free(fs.block_chunks);
+    free(fs.free_blocks);
+    for (int i = 0; i < fs.retired_count; i++) {
+        free(fs.retired[i]);
+    }
+    free(fs.retired);
+    for (int i = 0; i < FS_INDEX_SHARDS; i++) {
+        table_free(fs.shards[i].tables[0]);
+        table_free(fs.shards[i].tables[1]);
+        pthread_rwlock_destroy(&fs.shards[i].lock);
+    }
+    while (fs.retired_tables) {
+        HashTable* table = fs.retired_tables;
+        fs.retired_tables = table->retired_next;
+        table_free(table);
+    }
+    pthread_key_delete(fs.reader_key);
+    pthread_mutex_destroy(&fs.alloc_lock);
+    if (image) {
+        munmap(image, fs.image.size);
+        close(fs.image.fd);
+        free(fs.image.dirty);
+        memset(&fs.image, 0, sizeof(fs.image));
+    }
+    FS_LOG("File system cleaned up\n");
 }
 
+// Syncs and unmounts a mounted image first
 void cleanup_filesystem() {
-    pthread_rwlock_destroy(&fs.lock);
-    printf("File system cleaned up\n");
+    teardown_filesystem(1);
+}
+
+#ifndef FILE_SYSTEM_NO_MAIN
+#define GROWTH_DEMO_FILES 20000
+#define LARGE_DEMO_SIZE (8 << 20)
+
+// Writes a patterned file through the block map, reads it back in odd-sized
+// pieces, then extends a second file a gigabyte past its end
+static void large_file_demo(void) {
+    printf("--- Large and Sparse Files ---\n");
+    uint8_t* pattern = malloc(LARGE_DEMO_SIZE);
+    uint8_t* check = malloc(LARGE_DEMO_SIZE);
+    if (!pattern || !check) {
+        free(pattern);
+        free(check);
+        return;
+    }
+    for (int i = 0; i < LARGE_DEMO_SIZE; i++) {
+        pattern[i] = (uint8_t)(i * 31 + (i >> 12));
+    }
+    
+    create_file_with_data("large.bin", pattern, LARGE_DEMO_SIZE);
+    size_t total = 0, got;
+    while (read_file_at("large.bin", total, check + total, 12345, &got) == FS_SUCCESS && got > 0) {
+        total += got;
+    }
+    printf("Read back %zu of %d bytes, %s\n", total, LARGE_DEMO_SIZE,
+           total == LARGE_DEMO_SIZE && memcmp(pattern, check, total) == 0 ? "contents match" : "MISMATCH");
+    
+    create_file("sparse.bin", "head");
+    write_file_at("sparse.bin", 1ULL << 30, "tail", 4);
+    char middle[8] = "xxxxxxx";
+    read_file_at("sparse.bin", 512ULL << 20, middle, 7, &got);
+    printf("Hole in the middle reads as %s\n", memcmp(middle, "\0\0\0\0\0\0\0", 7) == 0 ? "zeros" : "data");
+    print_filesystem_status();
+    
+    delete_file("large.bin");
+    delete_file("sparse.bin");
+    free(pattern);
+    free(check);
+}
+
+// Appends a log through a handle, then reads it back both by copying and
+// through zero-copy views
+static void handle_io_demo(void) {
+    printf("--- Handle I/O ---\n");
+    FsHandle log;
+    create_file("app.log", "");
+    if (fs_open("app.log", &log) != FS_SUCCESS) return;
+    
+    char line[64];
+    uint64_t copy_sum = 0;
+    for (int i = 0; i < 1000; i++) {
+        int n = snprintf(line, sizeof(line), "request %04d served\n", i);
+        fs_append(log, line, (size_t)n, NULL);
+        for (int j = 0; j < n; j++) {
+            copy_sum += (uint8_t)line[j];
+        }
+    }
+    
+    uint64_t size = 0, view_sum = 0, offset = 0;
+    int views = 0;
+    FsReadView view;
+    fs_file_size(log, &size);
+    while (offset < size && fs_read_view(log, offset, (size_t)(size - offset), &view) == FS_SUCCESS) {
+        for (size_t i = 0; i < view.len; i++) {
+            view_sum += ((const uint8_t*)view.data)[i];
+        }
+        offset += view.len;
+        views++;
+        fs_release_view(&view);
+    }
+    printf("app.log: %llu bytes from 1000 appends, %d views, checksum %s\n",
+           (unsigned long long)size, views, view_sum == copy_sum ? "matches" : "MISMATCH");
+    
+    size_t got = 0;
+    fs_pwrite(log, "REQUEST", 7, 20);
+    fs_pread(log, line, 40, 0, &got);
+    line[got] = '\0';
+    printf("After pwrite at offset 20:\n%s", line);
+    
+    delete_file("app.log");
+    printf("Read through the old handle after delete: %s\n\n",
+           fs_pread(log, line, 1, 0, &got) == FS_ERROR_STALE_HANDLE ? "refused" : "allowed");
+}
+
+// Builds a small dataset tree, reads it through paths and takes it down
+// again, leaves first
+static void directory_demo(void) {
+    printf("--- Directories ---\n");
+    fs_mkdir("datasets");
+    fs_mkdir("datasets/train");
+    fs_mkdir("datasets/train/shard_00");
+    create_file("datasets/train/shard_00/sample_0.bin", "first sample");
+    create_file("datasets/train/shard_00/sample_1.bin", "second sample");
+    create_file("datasets/train/labels.csv", "id,label");
+    create_file("datasets/test/sample_0.bin", "no such directory");
+    read_file("/datasets/train/shard_00/sample_1.bin");
+    read_file("datasets/train");
+    
+    FsDirEntry entries[8];
+    size_t count = 0;
+    fs_readdir("datasets/train", entries, 8, &count);
+    printf("datasets/train holds %zu entries:", count);
+    for (size_t i = 0; i < count && i < 8; i++) {
+        printf(" %s%s", entries[i].name, entries[i].is_dir ? "/" : "");
+    }
+    printf("\n");
+    
+    // After the first miss the dentry cache answers these without the index
+    set_fs_verbose(0);
+    int found = 0;
+    for (int i = 0; i < 100; i++) {
+        found += read_file("datasets/train/shard_00/_SUCCESS") == FS_SUCCESS;
+    }
+    set_fs_verbose(1);
+    printf("Probed for a missing marker file 100 times, found it %d times\n", found);
+    printf("Removing a non-empty directory: %s\n",
+           fs_rmdir("datasets/train") == FS_ERROR_NOT_EMPTY ? "refused" : "allowed");
+    list_files();
+    
+    delete_file("datasets/train/shard_00/sample_0.bin");
+    delete_file("datasets/train/shard_00/sample_1.bin");
+    delete_file("datasets/train/labels.csv");
+    fs_rmdir("datasets/train/shard_00");
+    fs_rmdir("datasets/train");
+    fs_rmdir("datasets");
+    print_filesystem_status();
+}
+
+// Points a file's first block at the inode table, as a damaged image might
+static int corrupt_block_map(const char* image, const char* name) {
+    FsSuperblock super;
+    DiskInode disk;
+    int fd = open(image, O_RDWR);
+    if (fd < 0) return 0;
+    
+    int done = 0;
+    if (pread(fd, &super, sizeof(super), 0) == (ssize_t)sizeof(super)) {
+        for (uint64_t slot = 0; slot < super.inode_high && !done; slot++) {
+            off_t offset = (off_t)(super.inode_table * FS_BLOCK_SIZE + slot * sizeof(DiskInode));
+            if (pread(fd, &disk, sizeof(disk), offset) != (ssize_t)sizeof(disk)) break;
+            if (!disk.ino || disk.is_inline || strncmp(disk.name, name, MAX_FILENAME) != 0) continue;
+            BlockMap map;
+            memcpy(&map, disk.contents, sizeof(map));
+            map.direct[0] = (uint32_t)super.inode_table;
+            memcpy(disk.contents, &map, sizeof(map));
+            done = pwrite(fd, &disk, sizeof(disk), offset) == (ssize_t)sizeof(disk);
+        }
+    }
+    close(fd);
+    return done;
+}
+
+// Saves a checkpoint tree to a fresh image, unmounts it, and mounts it
+// again the way a restarted process would
+static void persistence_demo(void) {
+    printf("\n--- Persistent Image ---\n");
+    char image[] = "/tmp/fs_demo_XXXXXX";
+    int fd = mkstemp(image);
+    if (fd < 0) return;
+    close(fd);
+    
+    uint8_t* pattern = malloc(LARGE_DEMO_SIZE / 8);
+    uint8_t* check = malloc(LARGE_DEMO_SIZE / 8);
+    if (!pattern || !check || fs_mkfs(image, 64 << 20, 0) != FS_SUCCESS || fs_mount(image) != FS_SUCCESS) {
+        free(pattern);
+        free(check);
+        unlink(image);
+        return;
+    }
+    for (int i = 0; i < LARGE_DEMO_SIZE / 8; i++) {
+        pattern[i] = (uint8_t)(i * 7 + (i >> 10));
+    }
+    fs_mkdir("checkpoints");
+    create_file_with_data("checkpoints/epoch_01.ckpt", pattern, LARGE_DEMO_SIZE / 8);
+    create_file("checkpoints/latest", "epoch_01");
+    create_file("scratch.tmp", "gone before the sync");
+    delete_file("scratch.tmp");
+    printf("Sync: %s\n", fs_sync() == FS_SUCCESS ? "done" : "failed");
+    cleanup_filesystem();
+    
+    printf("Remounting %s\n", image);
+    if (fs_mount(image) == FS_SUCCESS) {
+        char latest[16] = { 0 };
+        size_t got = 0, total = 0;
+        read_file_at("checkpoints/latest", 0, latest, sizeof(latest) - 1, &got);
+        while (read_file_at("checkpoints/epoch_01.ckpt", total, check + total, 65536, &got) == FS_SUCCESS &&
+               got > 0) {
+            total += got;
+        }
+        printf("latest is '%s'; epoch_01.ckpt read back %zu of %d bytes, %s\n", latest, total,
+               LARGE_DEMO_SIZE / 8,
+               total == LARGE_DEMO_SIZE / 8 && memcmp(pattern, check, total) == 0 ? "contents match" : "MISMATCH");
+        printf("scratch.tmp after remount: %s\n",
+               read_file("scratch.tmp") == FS_ERROR_FILE_NOT_FOUND ? "absent" : "present");
+        list_files();
+        cleanup_filesystem();
+    }
+    
+    if (corrupt_block_map(image, "epoch_01.ckpt")) {
+        FileSystemError result = fs_mount(image);
+        printf("Mount with a block pointer into the inode table: %s\n",
+               result == FS_ERROR_BAD_IMAGE ? "rejected" : "ACCEPTED");
+        if (result == FS_SUCCESS) cleanup_filesystem();
+    }
+    free(pattern);
+    free(check);
+    unlink(image);
 }
 
 int main() {
@@ -295,7 +2825,38 @@ int main() {
     
     list_files();
     
+    large_file_demo();
+    handle_io_demo();
+    directory_demo();
+    
+    printf("--- Growing to %d Files ---\n", GROWTH_DEMO_FILES);
+    set_fs_verbose(0);
+    char name[MAX_FILENAME];
+    for (int i = 0; i < GROWTH_DEMO_FILES; i++) {
+        snprintf(name, sizeof(name), "bulk_%d.dat", i);
+        create_file(name, "bulk");
+    }
+    for (int mode = FS_INDEX_CHAINED; mode <= FS_INDEX_SWISS; mode++) {
+        set_index_mode((IndexMode)mode);
+        int missing = 0;
+        for (int i = 0; i < GROWTH_DEMO_FILES; i++) {
+            snprintf(name, sizeof(name), "bulk_%d.dat", i);
+            missing += read_file(name) != FS_SUCCESS;
+        }
+        printf("Looked up %d files, %d missing\n", GROWTH_DEMO_FILES, missing);
+        print_filesystem_status();
+    }
+    
+    for (int i = 0; i < GROWTH_DEMO_FILES; i++) {
+        snprintf(name, sizeof(name), "bulk_%d.dat", i);
+        delete_file(name);
+    }
+    set_fs_verbose(1);
+    print_filesystem_status();
+    
     cleanup_filesystem();
+    persistence_demo();
     printf("\nEnhanced file system demo completed successfully.\n");
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
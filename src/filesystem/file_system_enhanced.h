@@ -0,0 +1,100 @@
+#ifndef FILE_SYSTEM_ENHANCED_H
+#define FILE_SYSTEM_ENHANCED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_FILENAME 50  // Per path component, with its terminator
+#define FS_MAX_PATH 1024
+#define FS_BLOCK_SIZE 4096
+// 12 direct blocks, then an indirect and a double-indirect block of 4-byte
+// block numbers: about 4 GiB with 4 KiB blocks
+#define FS_BLOCK_PTRS (FS_BLOCK_SIZE / 4ULL)
+#define FS_MAX_FILE_SIZE ((12 + FS_BLOCK_PTRS + FS_BLOCK_PTRS * FS_BLOCK_PTRS) * FS_BLOCK_SIZE)
+
+typedef enum {
+    FS_SUCCESS = 0,
+    FS_ERROR_NULL_POINTER = -1,
+    FS_ERROR_FILE_EXISTS = -2,
+    FS_ERROR_FILE_NOT_FOUND = -3,
+    FS_ERROR_NO_SPACE = -4,
+    FS_ERROR_INVALID_NAME = -5,
+    FS_ERROR_INIT_FAILED = -6,
+    FS_ERROR_TOO_LARGE = -7,
+    FS_ERROR_STALE_HANDLE = -8,
+    FS_ERROR_NOT_DIR = -9,
+    FS_ERROR_IS_DIR = -10,
+    FS_ERROR_NOT_EMPTY = -11,
+    FS_ERROR_IO = -12,         // A system call on the image failed
+    FS_ERROR_BAD_IMAGE = -13   // Not an image fs_mkfs made, or a damaged one
+} FileSystemError;
+
+typedef enum {
+    FS_INDEX_CHAINED = 0,  // Buckets of File chains linked through hash_next
+    FS_INDEX_SWISS = 1     // Open addressing, 7-bit tags probed 16 slots at a time
+} IndexMode;
+
+// Names an open file without a hash lookup: the pool slot plus the slot's
+// generation, so a handle to a deleted file is refused rather than reaching
+// whatever file reuses the slot
+typedef uint64_t FsHandle;
+
+// A pinned, read-only run of file bytes. The file's index shard is read-locked
+// from fs_read_view until fs_release_view; don't create, delete, write or
+// sync from the same thread in between.
+typedef struct {
+    const void* data;
+    size_t len;
+    void* guard;  // The shard lock to release
+} FsReadView;
+
+// One name in a directory, as fs_readdir reports it
+typedef struct {
+    uint64_t ino;
+    int is_dir;
+    char name[MAX_FILENAME];
+} FsDirEntry;
+
+// Setup and teardown
+FileSystemError init_filesystem(void);
+void cleanup_filesystem(void);
+FileSystemError set_index_mode(IndexMode mode);
+void set_fs_verbose(int verbose);
+void set_lookup_timing_interval(uint32_t interval);
+
+// File operations. Names are paths of '/'-separated components below the
+// root directory; a leading '/' is optional.
+FileSystemError create_file(const char* name, const char* data);
+FileSystemError create_file_with_data(const char* name, const void* data, uint64_t size);
+FileSystemError read_file(const char* name);
+FileSystemError read_file_at(const char* name, uint64_t offset, void* buf, size_t len, size_t* bytes_read);
+FileSystemError write_file_at(const char* name, uint64_t offset, const void* data, size_t len);
+FileSystemError delete_file(const char* name);
+
+// Directories
+FileSystemError fs_mkdir(const char* path);
+FileSystemError fs_rmdir(const char* path);
+FileSystemError fs_readdir(const char* path, FsDirEntry* entries, size_t max, size_t* count);
+
+// Handle-based I/O
+FileSystemError fs_open(const char* name, FsHandle* handle);
+FileSystemError fs_pread(FsHandle handle, void* buf, size_t len, uint64_t offset, size_t* bytes_read);
+FileSystemError fs_pwrite(FsHandle handle, const void* buf, size_t len, uint64_t offset);
+FileSystemError fs_append(FsHandle handle, const void* buf, size_t len, uint64_t* offset);
+FileSystemError fs_read_view(FsHandle handle, uint64_t offset, size_t len, FsReadView* view);
+void fs_release_view(FsReadView* view);
+FileSystemError fs_file_size(FsHandle handle, uint64_t* size);
+
+// Persistent images. fs_mkfs writes an empty image of 'size' bytes with
+// inode slots for 'inodes' files and directories, or one per 16 KiB when 0.
+// fs_mount takes the place of init_filesystem: file contents then live in
+// the mapped image, and fs_sync writes out the inodes and block bitmap and
+// flushes everything changed. cleanup_filesystem syncs and unmounts.
+FileSystemError fs_mkfs(const char* path, uint64_t size, uint64_t inodes);
+FileSystemError fs_mount(const char* path);
+FileSystemError fs_sync(void);
+
+void list_files(void);
+void print_filesystem_status(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "file_system_enhanced.h"
+
+// Creates an empty image for fs_mount (linked with FILE_SYSTEM_NO_MAIN).
+// Usage: fs_mkfs <image> <size>[K|M|G] [inodes]
+static int parse_size(const char* text, uint64_t* size) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': value <<= 10;  // Fall through
+    case 'M': case 'm': value <<= 10;  // Fall through
+    case 'K': case 'k': value <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if (*end != '\0' || end == text) return -1;
+    *size = value;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t size = 0, inodes = 0;
+    if (argc < 3 || argc > 4 || parse_size(argv[2], &size) != 0 ||
+        (argc == 4 && parse_size(argv[3], &inodes) != 0)) {
+        fprintf(stderr, "usage: %s <image> <size>[K|M|G] [inodes]\n", argv[0]);
+        fprintf(stderr, "  inodes defaults to one per 16 KiB of image\n");
+        return 1;
+    }
+    
+    FileSystemError result = fs_mkfs(argv[1], size, inodes);
+    if (result != FS_SUCCESS) {
+        fprintf(stderr, "%s: cannot create %s: %s\n", argv[0], argv[1],
+                result == FS_ERROR_IO ? "I/O error" :
+                result == FS_ERROR_TOO_LARGE ? "too large" : "too small");
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
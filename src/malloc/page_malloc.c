@@ -0,0 +1,468 @@
+#define _GNU_SOURCE  // MAP_ANONYMOUS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../memory/memory_manager.h"
+#include "page_malloc.h"
+
+// Build with the page manager configured for real memory, e.g.
+// -DPAGE_SIZE=4096 -DMEMORY_SIZE=1073741824L -DMEM_LEAN
+#if PAGE_SIZE < 4096
+#error "page_malloc needs -DPAGE_SIZE=4096 or larger"
+#endif
+
+#define NUM_CLASSES 24
+#define MAX_SMALL_SIZE 2048
+#define SIZE_CLASS_GRANULE 16
+#define CACHE_MAX 64      // Per thread and class; half is returned when exceeded
+#define CACHE_BATCH 32    // Objects moved from a central list per refill
+#define LARGE_CLASS 0xff
+#define MMAP_HEADER 16    // Mapping base and length in front of mmap'd blocks
+
+typedef enum {
+    PM_SUCCESS = 0,
+    PM_ERROR_INIT_FAILED = -1
+} PageMallocError;
+
+// Four classes per power of two keeps internal fragmentation under 25%
+static const uint16_t class_sizes[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+// Objects of one class shared by all threads; pages are carved on demand
+// and stay with their class
+typedef struct {
+    pthread_mutex_t lock;
+    void* head;
+    int count;
+    int pages;
+} CentralList;
+
+typedef struct {
+    void* head[NUM_CLASSES];
+    int count[NUM_CLASSES];
+    int registered;
+} ThreadCache;
+
+typedef struct {
+    int initialized;
+    pthread_mutex_t init_lock;
+    pthread_key_t cache_key;
+    uint8_t* arena_base;
+    uint8_t size_to_class[MAX_SMALL_SIZE / SIZE_CLASS_GRANULE + 1];
+    CentralList central[NUM_CLASSES];
+    // Page descriptors: class of each small-object page, length of each run
+    uint8_t page_class[NUM_PAGES];
+    uint32_t run_pages[NUM_PAGES];
+    uint64_t cache_refills;
+    uint64_t cache_flushes;
+    uint64_t large_allocations;
+    uint64_t mmap_allocations;
+} PageMalloc;
+
+static PageMalloc pm = {
+    .init_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+// initial-exec keeps TLS access from calling back into malloc when preloaded
+static __thread ThreadCache thread_cache __attribute__((tls_model("initial-exec")));
+
+static void cache_flush(ThreadCache* cache, int cls, int keep);
+
+static void thread_cache_destroy(void* arg) {
+    ThreadCache* cache = arg;
+    for (int cls = 0; cls < NUM_CLASSES; cls++) {
+        cache_flush(cache, cls, 0);
+    }
+    cache->registered = 0;
+}
+
+// A fork while another thread holds one of these would leave it locked forever
+// in the child, so they are all taken around fork()
+static void pm_prefork(void) {
+    for (int cls = 0; cls < NUM_CLASSES; cls++) {
+        pthread_mutex_lock(&pm.central[cls].lock);
+    }
+    memory_prefork();  // Large allocations go straight to the manager
+}
+
+static void pm_postfork(void) {
+    memory_postfork();
+    for (int cls = NUM_CLASSES - 1; cls >= 0; cls--) {
+        pthread_mutex_unlock(&pm.central[cls].lock);
+    }
+}
+
+static PageMallocError pm_init(void) {
+    static int atfork_registered;
+    PageMallocError result = PM_SUCCESS;
+    
+    pthread_mutex_lock(&pm.init_lock);
+    if (!pm.initialized) {
+        set_memory_verbose(0);  // Logging would allocate
+        if (initialize_memory() != MEM_SUCCESS) {
+            result = PM_ERROR_INIT_FAILED;
+        } else {
+            set_watermarks(0, 0, 0);
+            pm.arena_base = page_address(0);
+            
+            int cls = 0;
+            for (int i = 0; i <= MAX_SMALL_SIZE / SIZE_CLASS_GRANULE; i++) {
+                while (class_sizes[cls] < i * SIZE_CLASS_GRANULE) cls++;
+                pm.size_to_class[i] = (uint8_t)cls;
+            }
+            for (int i = 0; i < NUM_CLASSES; i++) {
+                pthread_mutex_init(&pm.central[i].lock, NULL);
+            }
+            pthread_key_create(&pm.cache_key, thread_cache_destroy);
+            __atomic_store_n(&pm.initialized, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&pm.init_lock);
+    
+    // Registration may allocate, so it happens once the allocator can serve it
+    if (result == PM_SUCCESS && !__atomic_exchange_n(&atfork_registered, 1, __ATOMIC_ACQ_REL)) {
+        pthread_atfork(pm_prefork, pm_postfork, pm_postfork);
+    }
+    return result;
+}
+
+static inline int pm_ready(void) {
+    return __atomic_load_n(&pm.initialized, __ATOMIC_ACQUIRE) || pm_init() == PM_SUCCESS;
+}
+
+// Page number of a pointer into the arena, -1 for mmap'd blocks
+static inline int pm_page_of(const void* ptr) {
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)pm.arena_base;
+    return offset < (uintptr_t)MEMORY_SIZE ? (int)(offset / PAGE_SIZE) : -1;
+}
+
+// Fallback when the arena is exhausted or the request can't come from it
+static void* mmap_alloc(size_t size, size_t alignment) {
+    if (alignment < MMAP_HEADER) alignment = MMAP_HEADER;
+    if (size > SIZE_MAX - alignment - MMAP_HEADER) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    size_t length = size + alignment + MMAP_HEADER;
+    uint8_t* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    uintptr_t user = ((uintptr_t)base + MMAP_HEADER + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    size_t* header = (size_t*)(user - MMAP_HEADER);
+    header[0] = (size_t)(uintptr_t)base;
+    header[1] = length;
+    __atomic_fetch_add(&pm.mmap_allocations, 1, __ATOMIC_RELAXED);
+    return (void*)user;
+}
+
+static void* large_alloc(size_t size, size_t alignment) {
+    size_t pages = size / PAGE_SIZE + (size % PAGE_SIZE != 0);
+    if (alignment <= PAGE_SIZE && pages > 0 && pages <= (size_t)NUM_PAGES) {
+        int first = allocate_page_run((int)pages);
+        if (first >= 0) {
+            pm.run_pages[first] = (uint32_t)pages;
+            pm.page_class[first] = LARGE_CLASS;
+            __atomic_fetch_add(&pm.large_allocations, 1, __ATOMIC_RELAXED);
+            return page_address(first);
+        }
+    }
+    return mmap_alloc(size, alignment);
+}
+
+// Caller holds the class lock
+static int central_grow(int cls) {
+    int page = allocate_page_flags(ALLOC_NOWAIT);
+    if (page < 0) return 0;
+    
+    CentralList* list = &pm.central[cls];
+    pm.page_class[page] = (uint8_t)cls;
+    uint8_t* base = page_address(page);
+    int size = class_sizes[cls];
+    int objects = PAGE_SIZE / size;
+    
+    // Thread back to front so objects are handed out in address order
+    for (int i = objects - 1; i >= 0; i--) {
+        void** object = (void**)(base + (size_t)i * size);
+        *object = list->head;
+        list->head = object;
+    }
+    list->count += objects;
+    list->pages++;
+    return objects;
+}
+
+// Hands the cache back to the central lists when the thread exits. Both
+// refills and frees fill a cache, so both call this: a thread that only
+// frees objects other threads allocated would otherwise strand them.
+static inline void cache_register(ThreadCache* cache) {
+    if (!cache->registered) {
+        cache->registered = 1;
+        pthread_setspecific(pm.cache_key, cache);
+    }
+}
+
+static void* cache_refill(ThreadCache* cache, int cls) {
+    CentralList* list = &pm.central[cls];
+    pthread_mutex_lock(&list->lock);
+    
+    if (list->count == 0 && central_grow(cls) == 0) {
+        pthread_mutex_unlock(&list->lock);
+        return NULL;
+    }
+    
+    // First object goes to the caller, up to a batch more into the cache
+    void* result = list->head;
+    list->head = *(void**)result;
+    int moved = 0;
+    while (moved < CACHE_BATCH && list->head) {
+        void* object = list->head;
+        list->head = *(void**)object;
+        *(void**)object = cache->head[cls];
+        cache->head[cls] = object;
+        moved++;
+    }
+    list->count -= moved + 1;
+    pthread_mutex_unlock(&list->lock);
+    
+    cache->count[cls] += moved;
+    __atomic_fetch_add(&pm.cache_refills, 1, __ATOMIC_RELAXED);
+    cache_register(cache);
+    return result;
+}
+
+// Returns all but 'keep' cached objects of a class to the central list
+static void cache_flush(ThreadCache* cache, int cls, int keep) {
+    int count = cache->count[cls] - keep;
+    if (count <= 0) return;
+    
+    void* first = cache->head[cls];
+    void* last = first;
+    for (int i = 1; i < count; i++) {
+        last = *(void**)last;
+    }
+    cache->head[cls] = *(void**)last;
+    cache->count[cls] = keep;
+    
+    CentralList* list = &pm.central[cls];
+    pthread_mutex_lock(&list->lock);
+    *(void**)last = list->head;
+    list->head = first;
+    list->count += count;
+    pthread_mutex_unlock(&list->lock);
+    __atomic_fetch_add(&pm.cache_flushes, 1, __ATOMIC_RELAXED);
+}
+
+void* pm_malloc(size_t size) {
+    if (!pm_ready()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    if (size <= MAX_SMALL_SIZE) {
+        int cls = pm.size_to_class[(size + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE];
+        ThreadCache* cache = &thread_cache;
+        void* object = cache->head[cls];
+        if (object) {
+            cache->head[cls] = *(void**)object;
+            cache->count[cls]--;
+            return object;
+        }
+        object = cache_refill(cache, cls);
+        if (object) return object;
+    }
+    return large_alloc(size, 0);
+}
+
+void pm_free(void* ptr) {
+    if (!ptr || !pm_ready()) return;
+    
+    int page = pm_page_of(ptr);
+    if (page < 0) {
+        size_t* header = (size_t*)((uint8_t*)ptr - MMAP_HEADER);
+        munmap((void*)(uintptr_t)header[0], header[1]);
+        return;
+    }
+    
+    int cls = pm.page_class[page];
+    if (cls == LARGE_CLASS) {
+        free_page_run(page, (int)pm.run_pages[page]);
+        return;
+    }
+    
+    // Objects freed by another thread simply join this thread's cache
+    ThreadCache* cache = &thread_cache;
+    cache_register(cache);
+    *(void**)ptr = cache->head[cls];
+    cache->head[cls] = ptr;
+    if (++cache->count[cls] > CACHE_MAX) {
+        cache_flush(cache, cls, CACHE_MAX / 2);
+    }
+}
+
+size_t pm_usable_size(void* ptr) {
+    if (!ptr || !pm_ready()) return 0;
+    
+    int page = pm_page_of(ptr);
+    if (page < 0) {
+        size_t* header = (size_t*)((uint8_t*)ptr - MMAP_HEADER);
+        return header[1] - (size_t)((uint8_t*)ptr - (uint8_t*)(uintptr_t)header[0]);
+    }
+    if (pm.page_class[page] == LARGE_CLASS) {
+        return (size_t)pm.run_pages[page] * PAGE_SIZE;
+    }
+    return class_sizes[pm.page_class[page]];
+}
+
+void* pm_calloc(size_t count, size_t size) {
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    void* ptr = pm_malloc(count * size);
+    // Fresh mappings are already zero
+    if (ptr && pm_page_of(ptr) >= 0) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void* pm_realloc(void* ptr, size_t size) {
+    if (!ptr) return pm_malloc(size);
+    if (size == 0) {
+        pm_free(ptr);
+        return NULL;
+    }
+    
+    // Stay in place unless the block is too small or mostly wasted
+    size_t old_size = pm_usable_size(ptr);
+    if (size <= old_size && size > old_size / 2) {
+        return ptr;
+    }
+    
+    void* new_ptr = pm_malloc(size);
+    if (!new_ptr) return NULL;
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    pm_free(ptr);
+    return new_ptr;
+}
+
+// Power-of-two classes are naturally aligned within their page, so small
+// aligned requests round up to one; page-aligned and larger go to runs
+void* pm_memalign(size_t alignment, size_t size) {
+    if (alignment <= SIZE_CLASS_GRANULE) {
+        return pm_malloc(size);
+    }
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    size_t rounded = size > alignment ? size : alignment;
+    if (rounded <= MAX_SMALL_SIZE) {
+        size_t class_size = SIZE_CLASS_GRANULE;
+        while (class_size < rounded) class_size <<= 1;
+        if (class_size <= MAX_SMALL_SIZE) {
+            return pm_malloc(class_size);
+        }
+    }
+    if (!pm_ready()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return large_alloc(size, alignment);
+}
+
+void pm_print_stats(void) {
+    if (!pm_ready()) return;
+    
+    printf("\n=== Page Malloc Statistics ===\n");
+    printf("%-8s %-8s %-14s\n", "Class", "Pages", "Central free");
+    for (int cls = 0; cls < NUM_CLASSES; cls++) {
+        CentralList* list = &pm.central[cls];
+        pthread_mutex_lock(&list->lock);
+        if (list->pages > 0) {
+            printf("%-8d %-8d %-14d\n", class_sizes[cls], list->pages, list->count);
+        }
+        pthread_mutex_unlock(&list->lock);
+    }
+    printf("Cache refills: %llu, flushes: %llu\n",
+           (unsigned long long)pm.cache_refills, (unsigned long long)pm.cache_flushes);
+    printf("Large runs: %llu, mmap fallbacks: %llu\n",
+           (unsigned long long)pm.large_allocations, (unsigned long long)pm.mmap_allocations);
+    printf("==============================\n");
+    print_memory_status();
+}
+
+#ifndef PAGE_MALLOC_NO_OVERRIDE
+// The shared library is built with -fvisibility=hidden so the memory manager
+// it carries can't interpose on same-named symbols in the host program; only
+// the malloc family is exported. valloc and pvalloc must be too, or glibc's
+// would hand out memory our free() doesn't know.
+#define PM_EXPORT __attribute__((visibility("default")))
+
+PM_EXPORT void* memalign(size_t alignment, size_t size);
+PM_EXPORT void* valloc(size_t size);
+PM_EXPORT void* pvalloc(size_t size);
+PM_EXPORT size_t malloc_usable_size(void* ptr);
+
+PM_EXPORT void* malloc(size_t size) {
+    return pm_malloc(size);
+}
+
+PM_EXPORT void free(void* ptr) {
+    pm_free(ptr);
+}
+
+PM_EXPORT void* calloc(size_t count, size_t size) {
+    return pm_calloc(count, size);
+}
+
+PM_EXPORT void* realloc(void* ptr, size_t size) {
+    return pm_realloc(ptr, size);
+}
+
+PM_EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = pm_memalign(alignment, size);
+    if (!ptr) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+PM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    return pm_memalign(alignment, size);
+}
+
+PM_EXPORT void* memalign(size_t alignment, size_t size) {
+    return pm_memalign(alignment, size);
+}
+
+PM_EXPORT void* valloc(size_t size) {
+    return pm_memalign(PAGE_SIZE, size);
+}
+
+PM_EXPORT void* pvalloc(size_t size) {
+    return pm_memalign(PAGE_SIZE, (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+}
+
+PM_EXPORT size_t malloc_usable_size(void* ptr) {
+    return pm_usable_size(ptr);
+}
+#endif
\ No newline at end of file
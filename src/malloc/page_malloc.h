@@ -0,0 +1,19 @@
+#ifndef PAGE_MALLOC_H
+#define PAGE_MALLOC_H
+
+#include <stddef.h>
+
+// General-purpose allocator on top of the bitmap page manager. Small requests
+// come from per-size-class pages through per-thread caches; large ones get a
+// contiguous page run. Unless built with -DPAGE_MALLOC_NO_OVERRIDE the
+// standard malloc family is replaced too, so the shared library can be used
+// through LD_PRELOAD.
+void* pm_malloc(size_t size);
+void pm_free(void* ptr);
+void* pm_calloc(size_t count, size_t size);
+void* pm_realloc(void* ptr, size_t size);
+void* pm_memalign(size_t alignment, size_t size);
+size_t pm_usable_size(void* ptr);
+void pm_print_stats(void);
+
+#endif
\ No newline at end of file
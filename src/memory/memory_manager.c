@@ -1,214 +1,2170 @@
+#define _GNU_SOURCE  // SCHED_IDLE for the page zeroing thread
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "memory_manager.h"
+#include "../common/fast_timer.h"
+
+#define BITS_PER_WORD 64
+#define BITMAP_WORDS ((NUM_PAGES + BITS_PER_WORD - 1) / BITS_PER_WORD)  // Ceiling division
+
+// Allocation state is the bitmap alone: a page's number is its bit index and
+// its free/used state is the bit. Per-page debug metadata lives in separate
+// arrays so the hot search never drags it into cache, and building with
+// -DMEM_LEAN compiles it (and allocation timing) out entirely.
+typedef struct {
+    uint64_t bitmap[BITMAP_WORDS];
+#ifndef MEM_LEAN
+    uint64_t alloc_time[NUM_PAGES];  // fast_timer_now() ticks
+    pid_t owner_pid[NUM_PAGES];  // For debugging/tracking
+    uint32_t share_count[NUM_PAGES];  // Owners beyond the first; copy-on-write while nonzero
+    pid_t sharer_pid[NUM_PAGES];  // Latest process to share the page; takes over if the owner dies
+#endif
+    pthread_mutex_t lock;
+    AllocationMode mode;
+    // Counters are plain ints under the lock and relaxed atomics in lock-free mode
+    int free_pages;
+    int total_allocations;
+    int total_deallocations;
+#ifndef MEM_LEAN
+    uint64_t total_alloc_time_ns;  // Over sampled allocations only
+    int timed_allocations;
+    int cow_copies;
+#endif
+    int next_thread_slot;
+    int run_hint;  // No page below this is free; run searches start here
+    struct timespec init_time;
+    int process_shared;
+    uint32_t ready_magic;  // Set last by the creator of a shared segment
+    // Backing store for the pages; kept last so state can be reset or copied
+    // without touching page contents
+    uint8_t arena[MEMORY_SIZE] __attribute__((aligned(PAGE_SIZE < 64 ? 64 : PAGE_SIZE)));
+} MemoryManager;
+
+// Robust mutexes let survivors recover the lock from a process that died holding it
+#if defined(__linux__)
+#define MEM_ROBUST_LOCK 1
+#endif
+
+#define SHARED_READY_MAGIC 0x4d454d53u  // "MEMS"
+#define SHARED_ATTACH_TIMEOUT_MS 1000
+
+// The manager normally lives in this process; initialize_shared_memory()
+// repoints it at a shm_open/mmap segment shared by cooperating processes
+static MemoryManager local_memory_mgr;
+static MemoryManager* memory_mgr = &local_memory_mgr;
+
+#define MAX_RECLAIMERS 8
+#define DEFAULT_RECLAIM_WAIT_MS 10
+
+// kswapd-style background reclaim. Once free pages drop below low_pages the
+// thread runs the registered callbacks until free pages reach high_pages;
+// allocators that find fewer than min_pages free are throttled or refused.
+typedef struct {
+    int min_pages;
+    int low_pages;
+    int high_pages;
+    ReclaimCallback callbacks[MAX_RECLAIMERS];
+    void* contexts[MAX_RECLAIMERS];
+    int num_callbacks;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;       // Reclaim thread sleeps here
+    pthread_cond_t pages_freed;  // Throttled allocators sleep here
+    int running;
+    int stop;
+    int wake_pending;
+    int waiters;
+    int wait_ms;
+    int wakeups;
+    int pages_reclaimed;
+    int throttled_allocations;
+    int throttle_timeouts;
+    int reserve_refusals;  // ALLOC_NOWAIT allocations turned away below min
+} ReclaimDaemon;
+
+static ReclaimDaemon reclaimd = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wait_ms = DEFAULT_RECLAIM_WAIT_MS
+};
+
+// Pages whose owner can follow a migration. Callbacks are only meaningful in
+// the registering process, so this table stays out of the (possibly shared)
+// manager state.
+typedef struct {
+    RelocateCallback callback;
+    IsolateCallback isolate;
+    void* handle;
+} MovablePage;
+
+static MovablePage movable_pages[NUM_PAGES];
+
+#define DEFAULT_COMPACTION_INTERVAL_MS 50
+#define DEFAULT_COMPACTION_STEP 16
+#define COMPACTION_SCAN_PER_MOVE 64  // Pages a step may examine for each move it is allowed
+
+// Background compaction: migrates movable pages toward the low end of the
+// arena a few at a time, dropping the manager lock between steps. The scanner
+// positions persist across steps so each one picks up where the last stopped.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int running;
+    int stop;
+    int interval_ms;
+    int moves_per_step;
+    int passes;
+    int pages_migrated;
+    int free_cursor;         // Guarded by the manager lock, like the bitmap they scan
+    int migrate_cursor;
+    int pass_done;           // Scanners met; wait for a trigger before the next pass
+    int pass_deallocations;  // total_deallocations when the last pass ended
+    int run_failed;          // A contiguous allocation failed since the last check
+} CompactionDaemon;
+
+static CompactionDaemon compactd = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .migrate_cursor = NUM_PAGES - 1
+};
+
+// Per-operation logging; batch callers and benchmarks switch it off
+static int mem_verbose = 1;
+
+#define MEM_LOG(...) do { if (mem_verbose) printf(__VA_ARGS__); } while (0)
+
+// Bitmap word each thread starts searching from in lock-free mode, so that
+// concurrent allocators spread over different words instead of all hammering word 0
+static __thread int alloc_cursor = -1;
+
+static inline void set_bit(uint64_t *bitmap, int bit) {
+    bitmap[bit / BITS_PER_WORD] |= (1ULL << (bit % BITS_PER_WORD));
+}
+
+static inline void clear_bit(uint64_t *bitmap, int bit) {
+    bitmap[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+}
+
+static inline int get_bit(uint64_t *bitmap, int bit) {
+    return (bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+#ifndef MEM_LEAN
+#ifndef ALLOC_TIMING_INTERVAL
+#define ALLOC_TIMING_INTERVAL 64
+#endif
+
+// Only 1 in this many allocations is timed; the rest skip the clock reads
+static uint32_t alloc_timing_interval = ALLOC_TIMING_INTERVAL;
+
+// Caller has exclusive use of the counters (lock held, or lock-free mode)
+static void record_alloc_time(int lockfree, uint64_t start_ticks) {
+    uint64_t alloc_ns = fast_timer_elapsed_ns(start_ticks, fast_timer_now());
+    if (lockfree) {
+        __atomic_fetch_add(&memory_mgr->total_alloc_time_ns, alloc_ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&memory_mgr->timed_allocations, 1, __ATOMIC_RELAXED);
+    } else {
+        memory_mgr->total_alloc_time_ns += alloc_ns;
+        memory_mgr->timed_allocations++;
+    }
+}
+#endif
+
+static inline int counter_load(int *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void counter_add(int *counter, int delta) {
+    if (memory_mgr->mode == MEM_MODE_LOCKFREE) {
+        __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+    } else {
+        *counter += delta;
+    }
+}
+
+// Every path that frees a page calls this after clearing its bit
+static inline void lower_run_hint(int page) {
+    int hint = __atomic_load_n(&memory_mgr->run_hint, __ATOMIC_RELAXED);
+    while (page < hint &&
+           !__atomic_compare_exchange_n(&memory_mgr->run_hint, &hint, page, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static inline void mm_unlock(void) {
+    pthread_mutex_unlock(&memory_mgr->lock);
+}
+
+static void recount_free_pages(void) {
+    int used = 0;
+    for (int word = 0; word < BITMAP_WORDS; word++) {
+        used += __builtin_popcountll(__atomic_load_n(&memory_mgr->bitmap[word], __ATOMIC_RELAXED));
+    }
+    // Tail bits past NUM_PAGES are always set
+    used -= BITMAP_WORDS * BITS_PER_WORD - NUM_PAGES;
+    __atomic_store_n(&memory_mgr->free_pages, NUM_PAGES - used, __ATOMIC_RELAXED);
+}
+
+static int reclaim_dead_owners_locked(void);
+
+static void mm_lock(void) {
+    int rc = pthread_mutex_lock(&memory_mgr->lock);
+#ifdef MEM_ROBUST_LOCK
+    if (rc == EOWNERDEAD) {
+        // The previous holder died mid-update: the bitmap is authoritative,
+        // so rebuild the counter from it and release the dead process's pages
+        recount_free_pages();
+        pthread_mutex_consistent(&memory_mgr->lock);
+        reclaim_dead_owners_locked();
+    }
+#else
+    (void)rc;
+#endif
+}
+
+static MemoryError init_manager_state(int process_shared) {
+    // Page contents are left alone: freed pages are not zeroed anyway, and
+    // clearing a large arena would fault in every page up front
+    memset(memory_mgr, 0, offsetof(MemoryManager, arena));
+    
+    // Initialize bitmap - all pages free (bits = 0)
+    memset(memory_mgr->bitmap, 0, sizeof(memory_mgr->bitmap));
+    
+    // Bits past NUM_PAGES in the last word are permanently marked used so the
+    // word-at-a-time search never hands them out
+    if (NUM_PAGES % BITS_PER_WORD != 0) {
+        memory_mgr->bitmap[BITMAP_WORDS - 1] = ~0ULL << (NUM_PAGES % BITS_PER_WORD);
+    }
+    
+    memory_mgr->mode = MEM_MODE_LOCKED;
+    memory_mgr->free_pages = NUM_PAGES;
+    memory_mgr->total_allocations = 0;
+    memory_mgr->total_deallocations = 0;
+    
+    // Default watermarks scale with the pool; small pools disable them
+    reclaimd.min_pages = NUM_PAGES / 64;
+    reclaimd.low_pages = reclaimd.min_pages * 2;
+    reclaimd.high_pages = reclaimd.min_pages * 3;
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (process_shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef MEM_ROBUST_LOCK
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    }
+    int rc = pthread_mutex_init(&memory_mgr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    memory_mgr->process_shared = process_shared;
+    clock_gettime(CLOCK_MONOTONIC, &memory_mgr->init_time);
+#ifndef MEM_LEAN
+    // Calibration spins for a couple of milliseconds; the lean build never
+    // times anything, and every process under LD_PRELOAD would pay for it
+    fast_timer_init();
+#endif
+    return MEM_SUCCESS;
+}
+
+MemoryError initialize_memory() {
+    memory_mgr = &local_memory_mgr;
+    MemoryError result = init_manager_state(0);
+    if (result != MEM_SUCCESS) {
+        return result;
+    }
+    
+    MEM_LOG("Enhanced Memory Manager initialized:\n");
+    MEM_LOG("  - %d pages of %d bytes each (Total: %lld bytes)\n",
+           NUM_PAGES, PAGE_SIZE, (long long)MEMORY_SIZE);
+    MEM_LOG("  - Using bitmap allocation for O(1) performance\n");
+    MEM_LOG("  - Thread-safe operations enabled\n");
+#ifdef MEM_LEAN
+    MEM_LOG("  - Lean build: one bit of state per page, no timing or owner tracking\n\n");
+#else
+    MEM_LOG("  - Per-page owner and allocation-time tracking enabled\n\n");
+#endif
+    
+    return MEM_SUCCESS;
+}
+
+#ifndef MEM_LEAN
+// Probes a pid with kill(pid, 0). Owners tend to hold runs of pages, so the
+// last live and dead pids seen are remembered to skip repeat probes.
+static int process_exited(pid_t pid, pid_t self, pid_t* last_alive, pid_t* last_dead) {
+    if (pid == self || pid == *last_alive) return 0;
+    if (pid == *last_dead) return 1;
+    if (kill(pid, 0) == 0 || errno != ESRCH) {
+        *last_alive = pid;
+        return 0;
+    }
+    *last_dead = pid;
+    return 1;
+}
+#endif
+
+// Frees every page whose owner process no longer exists. Caller holds the lock.
+// A pid recycled by a new process keeps its predecessor's pages alive until
+// that process exits too.
+static int reclaim_dead_owners_locked(void) {
+#ifdef MEM_LEAN
+    return MEM_ERROR_UNSUPPORTED;
+#else
+    pid_t self = getpid();
+    pid_t last_alive = 0, last_dead = 0;
+    int reclaimed = 0;
+    
+    for (int page = 0; page < NUM_PAGES; page++) {
+        pid_t sharer = memory_mgr->sharer_pid[page];
+        if (sharer != 0 && process_exited(sharer, self, &last_alive, &last_dead)) {
+            // The latest sharer died still holding its reference
+            memory_mgr->sharer_pid[page] = 0;
+            if (memory_mgr->share_count[page] > 0) {
+                memory_mgr->share_count[page]--;
+            }
+        }
+        
+        pid_t owner = memory_mgr->owner_pid[page];
+        if (owner == 0 || !process_exited(owner, self, &last_alive, &last_dead)) continue;
+        
+        if (memory_mgr->share_count[page] > 0) {
+            // Still referenced: drop the dead owner's share and hand the page to
+            // the latest sharer, so it is reclaimed in turn if that one dies too
+            memory_mgr->share_count[page]--;
+            memory_mgr->owner_pid[page] = memory_mgr->sharer_pid[page];
+            memory_mgr->sharer_pid[page] = 0;
+            continue;
+        }
+        
+        uint64_t mask = 1ULL << (page % BITS_PER_WORD);
+        memory_mgr->owner_pid[page] = 0;
+        memory_mgr->sharer_pid[page] = 0;
+        uint64_t old = __atomic_fetch_and(&memory_mgr->bitmap[page / BITS_PER_WORD], ~mask,
+                                          __ATOMIC_RELEASE);
+        if (old & mask) {
+            lower_run_hint(page);
+            reclaimed++;
+        }
+    }
+    
+    if (reclaimed > 0) {
+        __atomic_fetch_add(&memory_mgr->free_pages, reclaimed, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&memory_mgr->total_deallocations, reclaimed, __ATOMIC_RELAXED);
+        MEM_LOG("Reclaimed %d pages from exited processes\n", reclaimed);
+    }
+    return reclaimed;
+#endif
+}
+
+int reclaim_dead_owners(void) {
+    mm_lock();
+    int reclaimed = reclaim_dead_owners_locked();
+    mm_unlock();
+    return reclaimed;
+}
+
+// Creates the named shared segment, or attaches to it if another process
+// already did. Every process sharing it must be built with the same
+// MEMORY_SIZE, PAGE_SIZE and MEM_LEAN settings.
+MemoryError initialize_shared_memory(const char* name) {
+    if (!name) return MEM_ERROR_NULL_POINTER;
+    
+    int creator = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        creator = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    if (creator && ftruncate(fd, sizeof(MemoryManager)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    // An attacher may race the creator's ftruncate
+    struct stat st;
+    for (int waited = 0; ; waited++) {
+        if (fstat(fd, &st) != 0 || waited >= SHARED_ATTACH_TIMEOUT_MS) {
+            close(fd);
+            return MEM_ERROR_INIT_FAILED;
+        }
+        if ((size_t)st.st_size >= sizeof(MemoryManager)) break;
+        usleep(1000);
+    }
+    
+    void* segment = mmap(NULL, sizeof(MemoryManager), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        if (creator) shm_unlink(name);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    memory_mgr = segment;
+    
+    if (creator) {
+        MemoryError result = init_manager_state(1);
+        if (result != MEM_SUCCESS) {
+            munmap(segment, sizeof(MemoryManager));
+            memory_mgr = &local_memory_mgr;
+            shm_unlink(name);
+            return result;
+        }
+        __atomic_store_n(&memory_mgr->ready_magic, SHARED_READY_MAGIC, __ATOMIC_RELEASE);
+    } else {
+        int waited = 0;
+        while (__atomic_load_n(&memory_mgr->ready_magic, __ATOMIC_ACQUIRE) != SHARED_READY_MAGIC) {
+            if (++waited > SHARED_ATTACH_TIMEOUT_MS) {
+                munmap(segment, sizeof(MemoryManager));
+                memory_mgr = &local_memory_mgr;
+                return MEM_ERROR_INIT_FAILED;
+            }
+            usleep(1000);
+        }
+        // Pick up pages orphaned by processes that died while detached
+        reclaim_dead_owners();
+    }
+    
+    reclaimd.min_pages = NUM_PAGES / 64;
+    reclaimd.low_pages = reclaimd.min_pages * 2;
+    reclaimd.high_pages = reclaimd.min_pages * 3;
+    
+    MEM_LOG("%s shared memory manager '%s' (%d pages, pid %d)\n",
+            creator ? "Created" : "Attached to", name, NUM_PAGES, (int)getpid());
+    return MEM_SUCCESS;
+}
+
+// Unmaps the shared segment; pages this process still owns stay allocated
+// until it exits and another process reclaims them
+void detach_shared_memory(void) {
+    if (memory_mgr == &local_memory_mgr) return;
+    munmap(memory_mgr, sizeof(MemoryManager));
+    memory_mgr = &local_memory_mgr;
+}
+
+MemoryError destroy_shared_memory(const char* name) {
+    if (!name) return MEM_ERROR_NULL_POINTER;
+    return shm_unlink(name) == 0 ? MEM_SUCCESS : MEM_ERROR_INIT_FAILED;
+}
+
+// Checkpoint file: two slots written alternately, so a crash while saving
+// leaves the previous checkpoint intact. Each slot holds a header, the
+// manager state (everything before the arena) and optionally the arena.
+// The header is written last and carries the generation that makes it current.
+#define CHECKPOINT_MAGIC 0x54504b434d454dULL  // "MEMCKPT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HAS_CONTENTS 0x1u
+#define CHECKPOINT_ALIGN 4096
+#define CHECKPOINT_ROUND(x) (((x) + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN)
+#define CHECKPOINT_STATE_SIZE offsetof(MemoryManager, arena)
+#define CHECKPOINT_STATE_OFFSET CHECKPOINT_ALIGN
+#define CHECKPOINT_ARENA_OFFSET (CHECKPOINT_STATE_OFFSET + CHECKPOINT_ROUND(CHECKPOINT_STATE_SIZE))
+#define CHECKPOINT_SLOT_SIZE (CHECKPOINT_ARENA_OFFSET + CHECKPOINT_ROUND((size_t)MEMORY_SIZE))
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t generation;
+    // Geometry of the build that wrote it; restore requires an exact match
+    uint64_t state_size;
+    uint64_t memory_size;
+    uint32_t page_size;
+    uint32_t lean;
+    uint64_t state_checksum;
+    uint64_t contents_checksum;
+    uint64_t header_checksum;  // Covers every field above
+} CheckpointHeader;
+
+#ifdef MEM_LEAN
+#define CHECKPOINT_LEAN 1
+#else
+#define CHECKPOINT_LEAN 0
+#endif
+
+// Four independent multiply-xorshift lanes keep the hash close to memory speed
+static uint64_t checkpoint_checksum(const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    uint64_t lanes[4] = { 0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+                          0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * 8, sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * 0xff51afd7ed558ccdULL;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = len;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * 0xc4ceb9fe1a85ec53ULL;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 31);
+}
+
+static int checkpoint_header_valid(const CheckpointHeader* header) {
+    return header->magic == CHECKPOINT_MAGIC &&
+           header->version == CHECKPOINT_VERSION &&
+           header->header_checksum ==
+               checkpoint_checksum(header, offsetof(CheckpointHeader, header_checksum));
+}
+
+// Full validation of a slot against this build, including its checksums
+static int checkpoint_slot_valid(const uint8_t* slot) {
+    const CheckpointHeader* header = (const CheckpointHeader*)slot;
+    if (!checkpoint_header_valid(header) ||
+        header->state_size != CHECKPOINT_STATE_SIZE ||
+        header->memory_size != (uint64_t)MEMORY_SIZE ||
+        header->page_size != PAGE_SIZE ||
+        header->lean != CHECKPOINT_LEAN) {
+        return 0;
+    }
+    if (checkpoint_checksum(slot + CHECKPOINT_STATE_OFFSET, CHECKPOINT_STATE_SIZE) !=
+        header->state_checksum) {
+        return 0;
+    }
+    if ((header->flags & CHECKPOINT_HAS_CONTENTS) &&
+        checkpoint_checksum(slot + CHECKPOINT_ARENA_OFFSET, MEMORY_SIZE) !=
+        header->contents_checksum) {
+        return 0;
+    }
+    return 1;
+}
+
+// Writes the allocation state, and the page contents if asked, to the older
+// of the file's two slots. Lock-free allocators must be quiesced first since
+// they don't take the lock the snapshot is taken under.
+MemoryError save_memory_checkpoint(const char* path, int include_contents) {
+    if (!path) return MEM_ERROR_NULL_POINTER;
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        MEM_LOG("Cannot open checkpoint %s: %s\n", path, strerror(errno));
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    size_t file_size = 2 * CHECKPOINT_SLOT_SIZE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        ((size_t)st.st_size != file_size && ftruncate(fd, (off_t)file_size) != 0)) {
+        close(fd);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    uint8_t* map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    // Overwrite the slot that isn't the latest valid checkpoint
+    const CheckpointHeader* headers[2] = {
+        (const CheckpointHeader*)map, (const CheckpointHeader*)(map + CHECKPOINT_SLOT_SIZE)
+    };
+    uint64_t generations[2] = { 0, 0 };
+    for (int i = 0; i < 2; i++) {
+        if (checkpoint_header_valid(headers[i])) {
+            generations[i] = headers[i]->generation;
+        }
+    }
+    int target = generations[0] <= generations[1] ? 0 : 1;
+    uint8_t* slot = map + (size_t)target * CHECKPOINT_SLOT_SIZE;
+    
+    // Invalidate the slot before rewriting its body
+    memset(slot, 0, sizeof(CheckpointHeader));
+    msync(slot, CHECKPOINT_ALIGN, MS_SYNC);
+    
+    mm_lock();
+    memcpy(slot + CHECKPOINT_STATE_OFFSET, memory_mgr, CHECKPOINT_STATE_SIZE);
+    if (include_contents) {
+        memcpy(slot + CHECKPOINT_ARENA_OFFSET, memory_mgr->arena, MEMORY_SIZE);
+    }
+    mm_unlock();
+    
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.flags = include_contents ? CHECKPOINT_HAS_CONTENTS : 0;
+    header.generation = (generations[0] > generations[1] ? generations[0] : generations[1]) + 1;
+    header.state_size = CHECKPOINT_STATE_SIZE;
+    header.memory_size = MEMORY_SIZE;
+    header.page_size = PAGE_SIZE;
+    header.lean = CHECKPOINT_LEAN;
+    header.state_checksum = checkpoint_checksum(slot + CHECKPOINT_STATE_OFFSET, CHECKPOINT_STATE_SIZE);
+    if (include_contents) {
+        header.contents_checksum = checkpoint_checksum(slot + CHECKPOINT_ARENA_OFFSET, MEMORY_SIZE);
+    }
+    header.header_checksum = checkpoint_checksum(&header, offsetof(CheckpointHeader, header_checksum));
+    
+    // Body reaches the disk before the header that vouches for it
+    MemoryError result = MEM_SUCCESS;
+    if (msync(map, file_size, MS_SYNC) != 0) {
+        result = MEM_ERROR_INIT_FAILED;
+    } else {
+        memcpy(slot, &header, sizeof(header));
+        if (msync(slot, CHECKPOINT_ALIGN, MS_SYNC) != 0) {
+            result = MEM_ERROR_INIT_FAILED;
+        }
+    }
+    munmap(map, file_size);
+    
+    if (result == MEM_SUCCESS) {
+        MEM_LOG("Checkpoint generation %llu written to %s (slot %d%s)\n",
+                (unsigned long long)header.generation, path, target,
+                include_contents ? ", with page contents" : "");
+    }
+    return result;
+}
+
+// Alternative to initialize_memory(): maps a checkpoint written by a build
+// with the same geometry and loads the newest valid slot. Fails with
+// MEM_ERROR_INIT_FAILED if there is none, in which case the caller should
+// initialize from scratch. Pages allocated in the image now belong to this
+// process. Call before starting any background threads.
+MemoryError restore_memory_checkpoint(const char* path) {
+    if (!path) return MEM_ERROR_NULL_POINTER;
+    
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    size_t file_size = 2 * CHECKPOINT_SLOT_SIZE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < file_size) {
+        close(fd);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    const uint8_t* map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    const uint8_t* best = NULL;
+    uint64_t best_generation = 0;
+    for (int i = 0; i < 2; i++) {
+        const uint8_t* slot = map + (size_t)i * CHECKPOINT_SLOT_SIZE;
+        const CheckpointHeader* header = (const CheckpointHeader*)slot;
+        if (checkpoint_header_valid(header) && header->generation > best_generation &&
+            checkpoint_slot_valid(slot)) {
+            best = slot;
+            best_generation = header->generation;
+        }
+    }
+    if (!best) {
+        munmap((void*)map, file_size);
+        MEM_LOG("No valid checkpoint in %s\n", path);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    memory_mgr = &local_memory_mgr;
+    MemoryError result = init_manager_state(0);
+    if (result != MEM_SUCCESS) {
+        munmap((void*)map, file_size);
+        return result;
+    }
+    
+    // Everything but the freshly initialized mutex comes from the image
+    const uint8_t* state = best + CHECKPOINT_STATE_OFFSET;
+    size_t lock_start = offsetof(MemoryManager, lock);
+    size_t lock_end = lock_start + sizeof(pthread_mutex_t);
+    memcpy(memory_mgr, state, lock_start);
+    memcpy((uint8_t*)memory_mgr + lock_end, state + lock_end, CHECKPOINT_STATE_SIZE - lock_end);
+    
+    const CheckpointHeader* header = (const CheckpointHeader*)best;
+    if (header->flags & CHECKPOINT_HAS_CONTENTS) {
+        memcpy(memory_mgr->arena, best + CHECKPOINT_ARENA_OFFSET, MEMORY_SIZE);
+    }
+    munmap((void*)map, file_size);
+    
+    memory_mgr->process_shared = 0;
+    memory_mgr->ready_magic = 0;
+    memory_mgr->next_thread_slot = 0;
+    clock_gettime(CLOCK_MONOTONIC, &memory_mgr->init_time);
+#ifndef MEM_LEAN
+    pid_t self = getpid();
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (memory_mgr->owner_pid[page] != 0) {
+            memory_mgr->owner_pid[page] = self;
+        }
+        if (memory_mgr->sharer_pid[page] != 0) {
+            memory_mgr->sharer_pid[page] = self;
+        }
+    }
+#endif
+    // Relocation callbacks don't survive a restart
+    memset(movable_pages, 0, sizeof(movable_pages));
+    
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double restore_ms = (end_time.tv_sec - start_time.tv_sec) * 1000.0 +
+                        (end_time.tv_nsec - start_time.tv_nsec) / 1000000.0;
+    MEM_LOG("Restored checkpoint generation %llu from %s: %d/%d pages free (%.3f ms)\n",
+            (unsigned long long)best_generation, path, memory_mgr->free_pages, NUM_PAGES,
+            restore_ms);
+    return MEM_SUCCESS;
+}
+
+// Switching modes is only safe while no other thread is inside the allocator;
+// the bitmap layout is the same in both modes so outstanding pages stay valid.
+MemoryError set_allocation_mode(AllocationMode mode) {
+    if (mode != MEM_MODE_LOCKED && mode != MEM_MODE_LOCKFREE) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    
+    mm_lock();
+    memory_mgr->mode = mode;
+    mm_unlock();
+    
+    MEM_LOG("Allocation mode: %s\n",
+           mode == MEM_MODE_LOCKFREE ? "lock-free (atomic bitmap)" : "mutex");
+    return MEM_SUCCESS;
+}
+
+// For pthread_atfork handlers of components that call in from several
+// threads: holding the lock across fork() keeps the child from inheriting it
+// taken by a thread that no longer exists there
+void memory_prefork(void) {
+    mm_lock();
+}
+
+void memory_postfork(void) {
+    mm_unlock();
+}
+
+#if PAGE_COLORS < 1 || (PAGE_COLORS & (PAGE_COLORS - 1))
+#error "PAGE_COLORS must be a power of two"
+#endif
+
+// A color is a view of the one free bitmap rather than a separate free list:
+// with fewer colors than bits per word it is every PAGE_COLORS-th bit of each
+// word, with more it is a single bit of every COLOR_WORD_STRIDE-th word
+#if PAGE_COLORS >= BITS_PER_WORD
+#define COLOR_WORD_STRIDE (PAGE_COLORS / BITS_PER_WORD)
+#else
+#define COLOR_WORD_STRIDE 1
+#endif
+
+static int page_coloring = 0;
+static int next_color_owner = 0;
+static __thread int color_cursor = -1;
+
+static inline uint64_t color_mask(int color) {
+#if PAGE_COLORS >= BITS_PER_WORD
+    return 1ULL << (color % BITS_PER_WORD);
+#else
+    return (~0ULL / ((1ULL << PAGE_COLORS) - 1)) << color;
+#endif
+}
+
+// Each thread walks the colors round-robin from its own starting point, so a
+// thread's consecutive pages, and different threads' pages, land in different sets
+static int next_thread_color(void) {
+    if (color_cursor < 0) {
+        color_cursor = __atomic_fetch_add(&next_color_owner, 1, __ATOMIC_RELAXED) & (PAGE_COLORS - 1);
+    }
+    int color = color_cursor;
+    color_cursor = (color_cursor + 1) & (PAGE_COLORS - 1);
+    return color;
+}
+
+// Caller holds memory_mgr->lock. A negative color takes any free page.
+static int claim_page_locked(int color) {
+    uint64_t mask = color < 0 ? ~0ULL : color_mask(color);
+    int first = color < 0 ? 0 : color / BITS_PER_WORD;
+    int stride = color < 0 ? 1 : COLOR_WORD_STRIDE;
+    
+    for (int word = first; word < BITMAP_WORDS; word += stride) {
+        uint64_t free_bits = ~memory_mgr->bitmap[word] & mask;
+        if (free_bits) {
+            int page = word * BITS_PER_WORD + __builtin_ctzll(free_bits);
+            set_bit(memory_mgr->bitmap, page);
+            return page;
+        }
+    }
+    return -1;
+}
+
+static int thread_start_word(void) {
+    if (alloc_cursor < 0) {
+        // Spread threads evenly; the golden-ratio step keeps neighbours apart
+        int slot = __atomic_fetch_add(&memory_mgr->next_thread_slot, 1, __ATOMIC_RELAXED);
+        alloc_cursor = (int)(((unsigned)slot * 40503u) % BITMAP_WORDS);
+    }
+    return alloc_cursor;
+}
+
+static int claim_page_atomic(int color) {
+    if (counter_load(&memory_mgr->free_pages) <= 0) {
+        return -1;
+    }
+    
+    uint64_t mask = color < 0 ? ~0ULL : color_mask(color);
+    int start = thread_start_word();
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+        int word_idx = (start + i) % BITMAP_WORDS;
+        if (color >= 0 && word_idx % COLOR_WORD_STRIDE != color / BITS_PER_WORD) {
+            continue;
+        }
+        uint64_t *word_ptr = &memory_mgr->bitmap[word_idx];
+        uint64_t word = __atomic_load_n(word_ptr, __ATOMIC_RELAXED);
+        
+        while (~word & mask) {
+            uint64_t bit = 1ULL << __builtin_ctzll(~word & mask);
+            // On failure the CAS reloads 'word', so we retry against fresh contents
+            if (__atomic_compare_exchange_n(word_ptr, &word, word | bit, 1,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                alloc_cursor = word_idx;
+                __atomic_fetch_sub(&memory_mgr->free_pages, 1, __ATOMIC_RELAXED);
+                return word_idx * BITS_PER_WORD + __builtin_ctzll(bit);
+            }
+        }
+    }
+    return -1;
+}
+
+static void wake_reclaim_thread(void) {
+    // Only the first allocator to notice low memory pays for the signal
+    if (__atomic_exchange_n(&reclaimd.wake_pending, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_mutex_lock(&reclaimd.lock);
+    pthread_cond_signal(&reclaimd.wakeup);
+    pthread_mutex_unlock(&reclaimd.lock);
+}
+
+static void notify_page_waiters(void) {
+    if (__atomic_load_n(&reclaimd.waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&reclaimd.lock);
+        pthread_cond_broadcast(&reclaimd.pages_freed);
+        pthread_mutex_unlock(&reclaimd.lock);
+    }
+}
+
+// Watermark check done before every allocation. The common case is a single
+// relaxed load and compare. The pages below min_pages are kept for
+// ALLOC_RESERVE callers: anyone else waits for reclaim to free some, or with
+// ALLOC_NOWAIT fails at once, and gets MEM_ERROR_NO_FREE_PAGES if none come.
+static MemoryError throttle_allocation(AllocFlags flags) {
+    int free_pages = counter_load(&memory_mgr->free_pages);
+    if (free_pages >= reclaimd.low_pages ||
+        !__atomic_load_n(&reclaimd.running, __ATOMIC_ACQUIRE)) {
+        return MEM_SUCCESS;
+    }
+    
+    wake_reclaim_thread();
+    
+    if (free_pages >= reclaimd.min_pages || (flags & ALLOC_RESERVE)) {
+        return MEM_SUCCESS;
+    }
+    if (flags & ALLOC_NOWAIT) {
+        __atomic_fetch_add(&reclaimd.reserve_refusals, 1, __ATOMIC_RELAXED);
+        return MEM_ERROR_NO_FREE_PAGES;
+    }
+    
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)reclaimd.wait_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    
+    MemoryError result = MEM_SUCCESS;
+    pthread_mutex_lock(&reclaimd.lock);
+    reclaimd.waiters++;
+    reclaimd.throttled_allocations++;
+    while (counter_load(&memory_mgr->free_pages) < reclaimd.min_pages) {
+        if (reclaimd.stop ||
+            pthread_cond_timedwait(&reclaimd.pages_freed, &reclaimd.lock, &deadline) == ETIMEDOUT) {
+            // Reclaim couldn't keep up; the reserve isn't ours to take
+            reclaimd.throttle_timeouts++;
+            result = MEM_ERROR_NO_FREE_PAGES;
+            break;
+        }
+    }
+    reclaimd.waiters--;
+    pthread_mutex_unlock(&reclaimd.lock);
+    return result;
+}
+
+static void* reclaim_thread_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&reclaimd.lock);
+    
+    while (!reclaimd.stop) {
+        if (!__atomic_load_n(&reclaimd.wake_pending, __ATOMIC_ACQUIRE) &&
+            counter_load(&memory_mgr->free_pages) >= reclaimd.low_pages) {
+            pthread_cond_wait(&reclaimd.wakeup, &reclaimd.lock);
+            continue;
+        }
+        
+        reclaimd.wakeups++;
+        int progress = 1;
+        while (!reclaimd.stop && progress > 0 &&
+               counter_load(&memory_mgr->free_pages) < reclaimd.high_pages) {
+            progress = 0;
+            for (int i = 0; i < reclaimd.num_callbacks; i++) {
+                int wanted = reclaimd.high_pages - counter_load(&memory_mgr->free_pages);
+                if (wanted <= 0) break;
+                
+                ReclaimCallback callback = reclaimd.callbacks[i];
+                void* ctx = reclaimd.contexts[i];
+                pthread_mutex_unlock(&reclaimd.lock);
+                int freed = callback(wanted, ctx);
+                pthread_mutex_lock(&reclaimd.lock);
+                
+                if (freed > 0) {
+                    progress += freed;
+                    reclaimd.pages_reclaimed += freed;
+                }
+            }
+            pthread_cond_broadcast(&reclaimd.pages_freed);
+        }
+        __atomic_store_n(&reclaimd.wake_pending, 0, __ATOMIC_RELEASE);
+        
+        if (progress == 0 && !reclaimd.stop) {
+            // Nothing reclaimable right now; back off instead of spinning
+            struct timespec retry;
+            clock_gettime(CLOCK_MONOTONIC, &retry);
+            retry.tv_nsec += (long)reclaimd.wait_ms * 1000000L;
+            retry.tv_sec += retry.tv_nsec / 1000000000L;
+            retry.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&reclaimd.wakeup, &reclaimd.lock, &retry);
+        }
+    }
+    
+    pthread_mutex_unlock(&reclaimd.lock);
+    return NULL;
+}
+
+MemoryError set_watermarks(int min_pages, int low_pages, int high_pages) {
+    if (min_pages < 0 || min_pages > low_pages || low_pages > high_pages ||
+        high_pages > NUM_PAGES) {
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    
+    pthread_mutex_lock(&reclaimd.lock);
+    reclaimd.min_pages = min_pages;
+    reclaimd.low_pages = low_pages;
+    reclaimd.high_pages = high_pages;
+    pthread_cond_signal(&reclaimd.wakeup);
+    pthread_mutex_unlock(&reclaimd.lock);
+    
+    MEM_LOG("Watermarks: min=%d low=%d high=%d pages\n", min_pages, low_pages, high_pages);
+    return MEM_SUCCESS;
+}
+
+MemoryError register_reclaim_callback(ReclaimCallback callback, void* ctx) {
+    if (!callback) return MEM_ERROR_NULL_POINTER;
+    
+    pthread_mutex_lock(&reclaimd.lock);
+    if (reclaimd.num_callbacks == MAX_RECLAIMERS) {
+        pthread_mutex_unlock(&reclaimd.lock);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    reclaimd.callbacks[reclaimd.num_callbacks] = callback;
+    reclaimd.contexts[reclaimd.num_callbacks] = ctx;
+    reclaimd.num_callbacks++;
+    pthread_mutex_unlock(&reclaimd.lock);
+    return MEM_SUCCESS;
+}
+
+// How long ALLOC_DEFAULT allocations wait below the min watermark
+void set_reclaim_wait_ms(int wait_ms) {
+    reclaimd.wait_ms = wait_ms > 0 ? wait_ms : 0;
+}
+
+MemoryError start_reclaim_thread(void) {
+    if (reclaimd.running) return MEM_SUCCESS;
+    
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&reclaimd.wakeup, &attr) != 0 ||
+        pthread_cond_init(&reclaimd.pages_freed, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    pthread_condattr_destroy(&attr);
+    
+    reclaimd.stop = 0;
+    reclaimd.wake_pending = 0;
+    if (pthread_create(&reclaimd.thread, NULL, reclaim_thread_main, NULL) != 0) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    __atomic_store_n(&reclaimd.running, 1, __ATOMIC_RELEASE);
+    
+    MEM_LOG("Reclaim thread started (%d callbacks)\n", reclaimd.num_callbacks);
+    return MEM_SUCCESS;
+}
+
+void stop_reclaim_thread(void) {
+    if (!reclaimd.running) return;
+    
+    pthread_mutex_lock(&reclaimd.lock);
+    reclaimd.stop = 1;
+    pthread_cond_broadcast(&reclaimd.wakeup);
+    pthread_cond_broadcast(&reclaimd.pages_freed);
+    pthread_mutex_unlock(&reclaimd.lock);
+    
+    pthread_join(reclaimd.thread, NULL);
+    __atomic_store_n(&reclaimd.running, 0, __ATOMIC_RELEASE);
+    pthread_cond_destroy(&reclaimd.wakeup);
+    pthread_cond_destroy(&reclaimd.pages_freed);
+    MEM_LOG("Reclaim thread stopped\n");
+}
+
+static int allocate_page_once(AllocFlags flags, int color) {
+#ifndef MEM_LEAN
+    int timed = fast_timer_sample(alloc_timing_interval);
+    uint64_t start_ticks = timed ? fast_timer_now() : 0;
+#endif
+    
+    if (throttle_allocation(flags) != MEM_SUCCESS) {
+        MEM_LOG("Free pages below the min watermark.\n");
+        return MEM_ERROR_NO_FREE_PAGES;
+    }
+    
+    int lockfree = (memory_mgr->mode == MEM_MODE_LOCKFREE);
+    if (!lockfree) {
+        mm_lock();
+        
+        if (memory_mgr->free_pages == 0) {
+            mm_unlock();
+            MEM_LOG("No free pages available.\n");
+            return MEM_ERROR_NO_FREE_PAGES;
+        }
+    }
+    
+    // Find first free page one 64-bit word at a time; when the requested
+    // color is exhausted any page is better than failing
+    int page = lockfree ? claim_page_atomic(color) : claim_page_locked(color);
+    if (page == -1 && color >= 0) {
+        page = lockfree ? claim_page_atomic(-1) : claim_page_locked(-1);
+    }
+    
+    if (page == -1) {
+        if (!lockfree) {
+            mm_unlock();
+        }
+        MEM_LOG("No free pages available.\n");
+        return MEM_ERROR_NO_FREE_PAGES;
+    }
+    
+    if (!lockfree) {
+        memory_mgr->free_pages--;
+    }
+    counter_add(&memory_mgr->total_allocations, 1);
+    
+#ifdef MEM_LEAN
+    if (!lockfree) {
+        mm_unlock();
+    }
+    
+    MEM_LOG("Allocated Page: %d\n", page);
+#else
+    // Winning the bit gives this thread exclusive ownership of the metadata
+    memory_mgr->alloc_time[page] = fast_timer_now();
+    memory_mgr->owner_pid[page] = getpid();
+    
+    if (timed) {
+        record_alloc_time(lockfree, start_ticks);
+    }
+    if (!lockfree) {
+        mm_unlock();
+    }
+    
+    MEM_LOG("Allocated Page: %d\n", page);
+#endif
+    return page;
+}
+
+static int allocate_page_with(AllocFlags flags, int color) {
+    int page = allocate_page_once(flags, color);
+    
+    // A shared pool may be exhausted only because a crashed process still
+    // owns pages; reclaim them and retry once before reporting failure
+    if (page == MEM_ERROR_NO_FREE_PAGES && memory_mgr->process_shared &&
+        reclaim_dead_owners() > 0) {
+        page = allocate_page_once(flags, color);
+    }
+    return page;
+}
+
+int allocate_page_flags(AllocFlags flags) {
+    return allocate_page_with(flags, page_coloring ? next_thread_color() : -1);
+}
+
+int allocate_page() {
+    return allocate_page_flags(ALLOC_DEFAULT);
+}
+
+// Colors are a per-process policy; with coloring on, allocate_page() and
+// allocate_page_flags() hand out pages round-robin by color per thread
+void set_page_coloring(int enabled) {
+    page_coloring = enabled;
+    MEM_LOG("Page coloring %s (%d colors)\n", enabled ? "enabled" : "disabled", PAGE_COLORS);
+}
+
+// Prefers a page of the given color (PAGE_COLOR_AUTO for the thread's next
+// one), falling back to any free page; works whether or not coloring is on
+int allocate_page_color(int color) {
+    if (color < 0) {
+        color = next_thread_color();
+    }
+    return allocate_page_with(ALLOC_DEFAULT, color & (PAGE_COLORS - 1));
+}
+
+int page_color(int page_number) {
+    if (page_number < 0 || page_number >= NUM_PAGES) {
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    return page_number & (PAGE_COLORS - 1);
+}
+
+#ifndef MEM_LEAN
+// Releases one extra reference if the page is shared. Returns 1 when the page
+// stays allocated for its remaining owners, 0 when the caller held the last one.
+static int drop_shared_ref(int page_number) {
+    uint32_t* count = &memory_mgr->share_count[page_number];
+    uint32_t old = __atomic_load_n(count, __ATOMIC_RELAXED);
+    while (old > 0) {
+        if (__atomic_compare_exchange_n(count, &old, old - 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            // A departing owner passes the page to the latest sharer
+            pid_t self = getpid();
+            if (memory_mgr->sharer_pid[page_number] == self) {
+                memory_mgr->sharer_pid[page_number] = 0;
+            } else if (memory_mgr->owner_pid[page_number] == self) {
+                memory_mgr->owner_pid[page_number] = memory_mgr->sharer_pid[page_number];
+                memory_mgr->sharer_pid[page_number] = 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+MemoryError free_page(int page_number) {
+    if (page_number < 0 || page_number >= NUM_PAGES) {
+        MEM_LOG("Invalid Page Number: %d\n", page_number);
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    
+    uint64_t mask = 1ULL << (page_number % BITS_PER_WORD);
+    uint64_t *word_ptr = &memory_mgr->bitmap[page_number / BITS_PER_WORD];
+    
+    if (memory_mgr->mode == MEM_MODE_LOCKFREE) {
+        // Metadata must be reset before the bit is released: once it is clear
+        // another thread may claim the page and start writing its own
+        if (!(__atomic_load_n(word_ptr, __ATOMIC_RELAXED) & mask)) {
+            MEM_LOG("Error: Attempting to free already free page %d\n", page_number);
+            return MEM_ERROR_DOUBLE_FREE;
+        }
+#ifndef MEM_LEAN
+        if (drop_shared_ref(page_number)) {
+            MEM_LOG("Dropped shared reference to page %d\n", page_number);
+            return MEM_SUCCESS;
+        }
+        memory_mgr->owner_pid[page_number] = 0;
+        memory_mgr->sharer_pid[page_number] = 0;
+#endif
+        movable_pages[page_number].callback = NULL;
+        
+        uint64_t old = __atomic_fetch_and(word_ptr, ~mask, __ATOMIC_RELEASE);
+        if (!(old & mask)) {
+            // Lost a race with a concurrent free of the same page
+            MEM_LOG("Error: Attempting to free already free page %d\n", page_number);
+            return MEM_ERROR_DOUBLE_FREE;
+        }
+        lower_run_hint(page_number);
+        __atomic_fetch_add(&memory_mgr->free_pages, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&memory_mgr->total_deallocations, 1, __ATOMIC_RELAXED);
+        
+        notify_page_waiters();
+        MEM_LOG("Freed Page: %d\n", page_number);
+        return MEM_SUCCESS;
+    }
+    
+    mm_lock();
+    
+    if (!(*word_ptr & mask)) {
+        mm_unlock();
+        MEM_LOG("Error: Attempting to free already free page %d\n", page_number);
+        return MEM_ERROR_DOUBLE_FREE;
+    }
+    
+#ifndef MEM_LEAN
+    if (drop_shared_ref(page_number)) {
+        mm_unlock();
+        MEM_LOG("Dropped shared reference to page %d\n", page_number);
+        return MEM_SUCCESS;
+    }
+#endif
+    
+    // Free the page
+    clear_bit(memory_mgr->bitmap, page_number);
+    lower_run_hint(page_number);
+    movable_pages[page_number].callback = NULL;
+#ifndef MEM_LEAN
+    memory_mgr->owner_pid[page_number] = 0;
+    memory_mgr->sharer_pid[page_number] = 0;
+#endif
+    memory_mgr->free_pages++;
+    memory_mgr->total_deallocations++;
+    
+    mm_unlock();
+    
+    notify_page_waiters();
+    MEM_LOG("Freed Page: %d\n", page_number);
+    return MEM_SUCCESS;
+}
+
+// Lowest 'count' set bits of 'bits' (all of them if it has fewer)
+static inline uint64_t lowest_bits(uint64_t bits, int count) {
+    if (count >= BITS_PER_WORD || __builtin_popcountll(bits) <= count) {
+        return bits;
+    }
+    uint64_t taken = 0;
+    while (count-- > 0) {
+        taken |= bits & (~bits + 1);  // Isolate lowest set bit
+        bits &= bits - 1;
+    }
+    return taken;
+}
+
+static int emit_pages(int word_idx, uint64_t taken, int* out) {
+    int count = 0;
+    while (taken) {
+        out[count++] = word_idx * BITS_PER_WORD + __builtin_ctzll(taken);
+        taken &= taken - 1;
+    }
+    return count;
+}
+
+// Allocates up to n pages in one pass over the bitmap, harvesting every free
+// bit of a word at once. Returns the number of pages written to out, which
+// is less than n only when the pool runs dry.
+int allocate_pages_bulk(int n, int* out) {
+    if (!out) return MEM_ERROR_NULL_POINTER;
+    if (n <= 0) return 0;
+    
+#ifndef MEM_LEAN
+    int timed = fast_timer_sample(alloc_timing_interval);
+    uint64_t start_ticks = timed ? fast_timer_now() : 0;
+#endif
+    
+    if (throttle_allocation(ALLOC_DEFAULT) != MEM_SUCCESS) {
+        return 0;
+    }
+    
+    int lockfree = (memory_mgr->mode == MEM_MODE_LOCKFREE);
+    int count = 0;
+    
+    if (lockfree) {
+        int start = thread_start_word();
+        for (int i = 0; i < BITMAP_WORDS && count < n; i++) {
+            int word_idx = (start + i) % BITMAP_WORDS;
+            uint64_t *word_ptr = &memory_mgr->bitmap[word_idx];
+            uint64_t word = __atomic_load_n(word_ptr, __ATOMIC_RELAXED);
+            uint64_t taken = 0;
+            
+            while (word != ~0ULL) {
+                taken = lowest_bits(~word, n - count);
+                if (__atomic_compare_exchange_n(word_ptr, &word, word | taken, 1,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                    break;
+                }
+                taken = 0;
+            }
+            if (taken) {
+                alloc_cursor = word_idx;
+                count += emit_pages(word_idx, taken, out + count);
+            }
+        }
+        __atomic_fetch_sub(&memory_mgr->free_pages, count, __ATOMIC_RELAXED);
+    } else {
+        mm_lock();
+        for (int word_idx = 0; word_idx < BITMAP_WORDS && count < n; word_idx++) {
+            uint64_t word = memory_mgr->bitmap[word_idx];
+            if (word == ~0ULL) continue;
+            
+            uint64_t taken = lowest_bits(~word, n - count);
+            memory_mgr->bitmap[word_idx] = word | taken;
+            count += emit_pages(word_idx, taken, out + count);
+        }
+        memory_mgr->free_pages -= count;
+    }
+    
+    if (count == 0) {
+        if (!lockfree) {
+            mm_unlock();
+        }
+        MEM_LOG("No free pages available.\n");
+        return MEM_ERROR_NO_FREE_PAGES;
+    }
+    
+    counter_add(&memory_mgr->total_allocations, count);
+    
+#ifdef MEM_LEAN
+    if (!lockfree) {
+        mm_unlock();
+    }
+    
+    MEM_LOG("Allocated %d pages in bulk\n", count);
+#else
+    // One timestamp and one pid lookup for the whole batch
+    uint64_t now = fast_timer_now();
+    pid_t pid = getpid();
+    for (int i = 0; i < count; i++) {
+        memory_mgr->alloc_time[out[i]] = now;
+        memory_mgr->owner_pid[out[i]] = pid;
+    }
+    
+    if (timed) {
+        record_alloc_time(lockfree, start_ticks);
+    }
+    if (!lockfree) {
+        mm_unlock();
+    }
+    
+    MEM_LOG("Allocated %d pages in bulk\n", count);
+#endif
+    return count;
+}
 
-#define MEMORY_SIZE 1024
-#define PAGE_SIZE 64
-#define NUM_PAGES (MEMORY_SIZE / PAGE_SIZE)
-#define BITMAP_SIZE ((NUM_PAGES + 7) / 8)  // Ceiling division
+// Releases n pages, combining consecutive entries that share a bitmap word
+// into a single update. Every valid entry is freed; MEM_ERROR_DOUBLE_FREE is
+// returned if any of them was already free. Nothing is freed if an entry is
+// out of range.
+MemoryError free_pages_bulk(const int* pages, int n) {
+    if (!pages) return MEM_ERROR_NULL_POINTER;
+    
+    for (int i = 0; i < n; i++) {
+        if (pages[i] < 0 || pages[i] >= NUM_PAGES) {
+            MEM_LOG("Invalid Page Number: %d\n", pages[i]);
+            return MEM_ERROR_INVALID_PAGE;
+        }
+    }
+    
+    int lockfree = (memory_mgr->mode == MEM_MODE_LOCKFREE);
+    int freed = 0;
+    int double_frees = 0;
+    
+    if (!lockfree) {
+        mm_lock();
+    }
+    
+    int i = 0;
+    while (i < n) {
+        int word_idx = pages[i] / BITS_PER_WORD;
+        uint64_t mask = 0;
+        // Metadata is only touched for pages that are allocated: a double-freed
+        // entry may name a page another thread has just claimed
+        uint64_t word = lockfree ? __atomic_load_n(&memory_mgr->bitmap[word_idx], __ATOMIC_ACQUIRE)
+                                 : memory_mgr->bitmap[word_idx];
+        
+        for (; i < n && pages[i] / BITS_PER_WORD == word_idx; i++) {
+            uint64_t bit = 1ULL << (pages[i] % BITS_PER_WORD);
+            if ((mask & bit) || !(word & bit)) {
+                double_frees++;  // Already free, or listed twice in this batch
+                continue;
+            }
+#ifndef MEM_LEAN
+            if (drop_shared_ref(pages[i])) continue;
+            memory_mgr->owner_pid[pages[i]] = 0;
+            memory_mgr->sharer_pid[pages[i]] = 0;
+#endif
+            movable_pages[pages[i]].callback = NULL;
+            mask |= bit;
+        }
+        
+        uint64_t old;
+        if (lockfree) {
+            old = __atomic_fetch_and(&memory_mgr->bitmap[word_idx], ~mask, __ATOMIC_RELEASE);
+        } else {
+            old = memory_mgr->bitmap[word_idx];
+            memory_mgr->bitmap[word_idx] = old & ~mask;
+        }
+        if (old & mask) {
+            lower_run_hint(word_idx * BITS_PER_WORD + __builtin_ctzll(old & mask));
+        }
+        freed += __builtin_popcountll(old & mask);
+        double_frees += __builtin_popcountll(~old & mask);
+    }
+    
+    if (lockfree) {
+        __atomic_fetch_add(&memory_mgr->free_pages, freed, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&memory_mgr->total_deallocations, freed, __ATOMIC_RELAXED);
+    } else {
+        memory_mgr->free_pages += freed;
+        memory_mgr->total_deallocations += freed;
+        mm_unlock();
+    }
+    
+    notify_page_waiters();
+    MEM_LOG("Freed %d pages in bulk\n", freed);
+    if (double_frees > 0) {
+        MEM_LOG("Error: %d pages in bulk free were already free\n", double_frees);
+        return MEM_ERROR_DOUBLE_FREE;
+    }
+    return MEM_SUCCESS;
+}
 
-typedef enum {
-    MEM_SUCCESS = 0,
-    MEM_ERROR_NULL_POINTER = -1,
-    MEM_ERROR_NO_FREE_PAGES = -2,
-    MEM_ERROR_INVALID_PAGE = -3,
-    MEM_ERROR_DOUBLE_FREE = -4,
-    MEM_ERROR_INIT_FAILED = -5
-} MemoryError;
+void* page_address(int page_number) {
+    if (page_number < 0 || page_number >= NUM_PAGES) return NULL;
+    return memory_mgr->arena + (size_t)page_number * PAGE_SIZE;
+}
 
-typedef struct {
-    int page_number;
-    int is_free;
-    struct timespec alloc_time;
-    pid_t owner_pid;  // For debugging/tracking
-} Page;
+#ifndef MEM_LEAN
+static int page_in_use(int page_number) {
+    return __atomic_load_n(&memory_mgr->bitmap[page_number / BITS_PER_WORD], __ATOMIC_ACQUIRE) &
+           (1ULL << (page_number % BITS_PER_WORD)) ? 1 : 0;
+}
+#endif
 
-typedef struct {
-    uint8_t bitmap[BITMAP_SIZE];
-    Page pages[NUM_PAGES];
-    pthread_mutex_t lock;
-    int free_pages;
-    int total_allocations;
-    int total_deallocations;
-    double total_alloc_time_ms;
-    struct timespec init_time;
-} MemoryManager;
+// Adds an owner to an allocated page; each owner releases it with free_page()
+// and must go through cow_write() before modifying it. Returns the new
+// reference count. Reference counts are not kept in lean builds.
+int share_page(int page_number) {
+#ifdef MEM_LEAN
+    (void)page_number;
+    return MEM_ERROR_UNSUPPORTED;
+#else
+    if (page_number < 0 || page_number >= NUM_PAGES || !page_in_use(page_number)) {
+        MEM_LOG("Cannot share unallocated page %d\n", page_number);
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    
+    uint32_t shares = __atomic_add_fetch(&memory_mgr->share_count[page_number], 1, __ATOMIC_ACQ_REL);
+    memory_mgr->sharer_pid[page_number] = getpid();
+    MEM_LOG("Shared Page: %d (%u references)\n", page_number, shares + 1);
+    return (int)shares + 1;
+#endif
+}
 
-static MemoryManager memory_mgr;
+int page_ref_count(int page_number) {
+#ifdef MEM_LEAN
+    (void)page_number;
+    return MEM_ERROR_UNSUPPORTED;
+#else
+    if (page_number < 0 || page_number >= NUM_PAGES) return MEM_ERROR_INVALID_PAGE;
+    if (!page_in_use(page_number)) return 0;
+    return (int)__atomic_load_n(&memory_mgr->share_count[page_number], __ATOMIC_ACQUIRE) + 1;
+#endif
+}
+
+// Prepares the caller's reference to a page for writing. A sole owner gets the
+// same page back; otherwise the contents are copied into a fresh page, the
+// caller's reference to the shared one is dropped and the copy is returned.
+int cow_write(int page_number) {
+#ifdef MEM_LEAN
+    (void)page_number;
+    return MEM_ERROR_UNSUPPORTED;
+#else
+    if (page_number < 0 || page_number >= NUM_PAGES || !page_in_use(page_number)) {
+        MEM_LOG("Cannot write unallocated page %d\n", page_number);
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    
+    if (__atomic_load_n(&memory_mgr->share_count[page_number], __ATOMIC_ACQUIRE) == 0) {
+        return page_number;
+    }
+    
+    int copy = allocate_page();
+    if (copy < 0) return copy;
+    memcpy(page_address(copy), page_address(page_number), PAGE_SIZE);
+    
+    if (!drop_shared_ref(page_number)) {
+        // The other owners let go while we copied; the original is ours alone
+        free_page(copy);
+        return page_number;
+    }
+    
+    // Runs without the manager lock, where counter_add would be a plain increment
+    __atomic_fetch_add(&memory_mgr->cow_copies, 1, __ATOMIC_RELAXED);
+    MEM_LOG("Copy-on-write: page %d -> %d\n", page_number, copy);
+    return copy;
+#endif
+}
 
-static inline void set_bit(uint8_t *bitmap, int bit) {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+// Caller holds the lock. First fit, starting from the lowest page that may be
+// free: long-lived allocations that pile up at the low end of the arena are
+// skipped without a scan. Full bitmap words are skipped whole.
+static int find_free_run_locked(int n) {
+    int first_free = -1;
+    int run_start = 0, run_len = 0;
+    for (int page = memory_mgr->run_hint; page < NUM_PAGES; page++) {
+        if (page % BITS_PER_WORD == 0 && memory_mgr->bitmap[page / BITS_PER_WORD] == ~0ULL) {
+            run_len = 0;
+            page += BITS_PER_WORD - 1;
+            continue;
+        }
+        if (get_bit(memory_mgr->bitmap, page)) {
+            run_len = 0;
+            continue;
+        }
+        if (first_free < 0) first_free = page;
+        if (run_len++ == 0) run_start = page;
+        if (run_len == n) break;
+    }
+    // Everything below the first free page seen is in use; a run taken from
+    // there moves the hint past it
+    if (run_len == n && first_free == run_start) first_free = run_start + n;
+    memory_mgr->run_hint = first_free >= 0 ? first_free : NUM_PAGES;
+    return run_len == n ? run_start : -1;
 }
 
-static inline void clear_bit(uint8_t *bitmap, int bit) {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+static int largest_free_run_locked(void) {
+    int largest = 0, run_len = 0;
+    for (int page = 0; page < NUM_PAGES; page++) {
+        if (get_bit(memory_mgr->bitmap, page)) {
+            run_len = 0;
+        } else if (++run_len > largest) {
+            largest = run_len;
+        }
+    }
+    return largest;
 }
 
-static inline int get_bit(uint8_t *bitmap, int bit) {
-    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+static double fragmentation_index_locked(int* largest_run) {
+    int free_pages = counter_load(&memory_mgr->free_pages);
+    int largest = largest_free_run_locked();
+    if (largest_run) *largest_run = largest;
+    return free_pages > 0 ? 1.0 - (double)largest / free_pages : 0.0;
 }
 
-static double timespec_to_ms(struct timespec *ts) {
-    return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+// 0 when all free pages form one run, approaching 1 as they scatter
+double fragmentation_index(void) {
+    mm_lock();
+    double index = fragmentation_index_locked(NULL);
+    mm_unlock();
+    return index;
 }
 
-MemoryError initialize_memory() {
-    memset(&memory_mgr, 0, sizeof(MemoryManager));
+// Allocates n physically contiguous pages and returns the first. Runs are
+// claimed under the lock, so they are not available in lock-free mode.
+int allocate_page_run(int n) {
+    if (n <= 0 || n > NUM_PAGES) return MEM_ERROR_INVALID_PAGE;
+    if (memory_mgr->mode == MEM_MODE_LOCKFREE) return MEM_ERROR_UNSUPPORTED;
     
-    // Initialize bitmap - all pages free (bits = 0)
-    memset(memory_mgr.bitmap, 0, BITMAP_SIZE);
+    mm_lock();
     
-    // Initialize page metadata
-    for (int i = 0; i < NUM_PAGES; i++) {
-        memory_mgr.pages[i].page_number = i;
-        memory_mgr.pages[i].is_free = 1;
-        memory_mgr.pages[i].owner_pid = 0;
+    int first = find_free_run_locked(n);
+    if (first < 0) {
+        mm_unlock();
+        // Picked up by the compaction thread on its next wake-up
+        __atomic_store_n(&compactd.run_failed, 1, __ATOMIC_RELEASE);
+        MEM_LOG("No free run of %d pages available.\n", n);
+        return MEM_ERROR_NO_FREE_PAGES;
     }
     
-    memory_mgr.free_pages = NUM_PAGES;
-    memory_mgr.total_allocations = 0;
-    memory_mgr.total_deallocations = 0;
-    memory_mgr.total_alloc_time_ms = 0.0;
+#ifndef MEM_LEAN
+    uint64_t now = fast_timer_now();
+    pid_t pid = getpid();
+#endif
+    for (int page = first; page < first + n; page++) {
+        set_bit(memory_mgr->bitmap, page);
+#ifndef MEM_LEAN
+        memory_mgr->alloc_time[page] = now;
+        memory_mgr->owner_pid[page] = pid;
+#endif
+    }
+    memory_mgr->free_pages -= n;
+    memory_mgr->total_allocations += n;
     
-    if (pthread_mutex_init(&memory_mgr.lock, NULL) != 0) {
-        return MEM_ERROR_INIT_FAILED;
+    mm_unlock();
+    
+    MEM_LOG("Allocated Run: pages %d-%d\n", first, first + n - 1);
+    return first;
+}
+
+MemoryError free_page_run(int first_page, int n) {
+    if (n <= 0 || first_page < 0 || first_page > NUM_PAGES - n) {
+        MEM_LOG("Invalid page run: %d+%d\n", first_page, n);
+        return MEM_ERROR_INVALID_PAGE;
     }
     
-    clock_gettime(CLOCK_MONOTONIC, &memory_mgr.init_time);
+    MemoryError status = MEM_SUCCESS;
+    int pages[BITS_PER_WORD];
+    for (int done = 0; done < n; ) {
+        int batch = n - done < BITS_PER_WORD ? n - done : BITS_PER_WORD;
+        for (int i = 0; i < batch; i++) {
+            pages[i] = first_page + done + i;
+        }
+        MemoryError result = free_pages_bulk(pages, batch);
+        if (result != MEM_SUCCESS) status = result;
+        done += batch;
+    }
+    return status;
+}
+
+// Lets compaction move an allocated page. The copy is made under the manager
+// lock only, so an owner that may write the page while compaction runs must
+// pass an isolate callback that stops those writes until relocate is called;
+// it may be NULL when the page is never written concurrently. Both callbacks
+// run with the manager lock held and must not call back into the manager.
+MemoryError register_movable_page(int page_number, IsolateCallback isolate,
+                                  RelocateCallback relocate, void* handle) {
+    if (!relocate) return MEM_ERROR_NULL_POINTER;
+    if (page_number < 0 || page_number >= NUM_PAGES) return MEM_ERROR_INVALID_PAGE;
     
-    printf("Enhanced Memory Manager initialized:\n");
-    printf("  - %d pages of %d bytes each (Total: %d bytes)\n", 
-           NUM_PAGES, PAGE_SIZE, MEMORY_SIZE);
-    printf("  - Using bitmap allocation for O(1) performance\n");
-    printf("  - Thread-safe operations enabled\n\n");
+    mm_lock();
+    if (!get_bit(memory_mgr->bitmap, page_number)) {
+        mm_unlock();
+        return MEM_ERROR_INVALID_PAGE;
+    }
+    movable_pages[page_number].callback = relocate;
+    movable_pages[page_number].isolate = isolate;
+    movable_pages[page_number].handle = handle;
+    mm_unlock();
+    return MEM_SUCCESS;
+}
+
+MemoryError unregister_movable_page(int page_number) {
+    if (page_number < 0 || page_number >= NUM_PAGES) return MEM_ERROR_INVALID_PAGE;
     
+    mm_lock();
+    movable_pages[page_number].callback = NULL;
+    mm_unlock();
     return MEM_SUCCESS;
 }
 
-int allocate_page() {
-    struct timespec start_time, end_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+// Caller holds the lock. Shared pages have several owners and stay put.
+static int page_is_movable_locked(int page_number) {
+    if (!movable_pages[page_number].callback || !get_bit(memory_mgr->bitmap, page_number)) {
+        return 0;
+    }
+#ifndef MEM_LEAN
+    if (memory_mgr->share_count[page_number] > 0) return 0;
+#endif
+    return 1;
+}
+
+// Returns 0 without touching anything if the owner can't isolate the page now
+static int migrate_page_locked(int from, int to) {
+    MovablePage entry = movable_pages[from];
+    if (entry.isolate && !entry.isolate(entry.handle, from)) {
+        return 0;
+    }
     
-    pthread_mutex_lock(&memory_mgr.lock);
+    set_bit(memory_mgr->bitmap, to);
+    memcpy(page_address(to), page_address(from), PAGE_SIZE);
+#ifndef MEM_LEAN
+    memory_mgr->alloc_time[to] = memory_mgr->alloc_time[from];
+    memory_mgr->owner_pid[to] = memory_mgr->owner_pid[from];
+    memory_mgr->owner_pid[from] = 0;
+#endif
     
-    if (memory_mgr.free_pages == 0) {
-        pthread_mutex_unlock(&memory_mgr.lock);
-        printf("No free pages available.\n");
-        return MEM_ERROR_NO_FREE_PAGES;
+    movable_pages[to] = entry;
+    movable_pages[from].callback = NULL;
+    
+    // The owner switches over before the old page can be handed out again
+    entry.callback(entry.handle, from, to);
+    clear_bit(memory_mgr->bitmap, from);
+    lower_run_hint(from);
+    return 1;
+}
+
+// One bounded compaction step: a free scanner walks up from the start of the
+// arena and a migration scanner walks down from the end, moving movable pages
+// into the lowest holes. Each step resumes where the previous one stopped and
+// examines at most COMPACTION_SCAN_PER_MOVE pages per allowed move, so the
+// lock hold time is bounded by max_moves rather than the arena size; the
+// scanners start over once they meet. Returns the number of pages moved.
+int compact_pages(int max_moves) {
+    if (max_moves <= 0) return 0;
+    if (memory_mgr->mode == MEM_MODE_LOCKFREE) return MEM_ERROR_UNSUPPORTED;
+    
+    int moved = 0;
+    long budget = (long)max_moves * COMPACTION_SCAN_PER_MOVE;
+    
+    mm_lock();
+    int free_cursor = compactd.free_cursor;
+    int migrate_cursor = compactd.migrate_cursor;
+    while (moved < max_moves && budget > 0) {
+        while (free_cursor < migrate_cursor && budget > 0 &&
+               get_bit(memory_mgr->bitmap, free_cursor)) {
+            free_cursor++;
+            budget--;
+        }
+        while (migrate_cursor > free_cursor && budget > 0 &&
+               !page_is_movable_locked(migrate_cursor)) {
+            migrate_cursor--;
+            budget--;
+        }
+        if (free_cursor >= migrate_cursor) {
+            free_cursor = 0;
+            migrate_cursor = NUM_PAGES - 1;
+            __atomic_store_n(&compactd.pass_deallocations,
+                             counter_load(&memory_mgr->total_deallocations), __ATOMIC_RELAXED);
+            __atomic_store_n(&compactd.pass_done, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        if (budget <= 0) break;
+        
+        if (!migrate_page_locked(migrate_cursor, free_cursor)) {
+            migrate_cursor--;  // Owner is busy with it; leave it for a later pass
+            continue;
+        }
+        moved++;
     }
+    compactd.free_cursor = free_cursor;
+    compactd.migrate_cursor = migrate_cursor;
+    mm_unlock();
     
-    // Find first free page using bitmap (much faster than linear search)
-    int page = -1;
-    for (int byte = 0; byte < BITMAP_SIZE; byte++) {
-        if (memory_mgr.bitmap[byte] != 0xFF) { // Not all bits set
-            for (int bit = 0; bit < 8; bit++) {
-                int page_idx = byte * 8 + bit;
-                if (page_idx >= NUM_PAGES) break;
-                
-                if (!get_bit(memory_mgr.bitmap, page_idx)) {
-                    page = page_idx;
-                    break;
-                }
+    if (moved > 0) {
+        __atomic_fetch_add(&compactd.pages_migrated, moved, __ATOMIC_RELAXED);
+        MEM_LOG("Compaction moved %d pages\n", moved);
+    }
+    return moved;
+}
+
+static void* compaction_thread_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&compactd.lock);
+    
+    while (!compactd.stop) {
+        int idle = 0;
+        if (__atomic_load_n(&compactd.pass_done, __ATOMIC_ACQUIRE)) {
+            // Another pass is worth it only once a run allocation failed or enough
+            // pages were freed since the last one to have opened new holes
+            int freed = counter_load(&memory_mgr->total_deallocations) -
+                        __atomic_load_n(&compactd.pass_deallocations, __ATOMIC_RELAXED);
+            if (__atomic_exchange_n(&compactd.run_failed, 0, __ATOMIC_ACQ_REL) ||
+                freed >= compactd.moves_per_step) {
+                __atomic_store_n(&compactd.pass_done, 0, __ATOMIC_RELAXED);
+            } else {
+                idle = 1;
             }
-            if (page != -1) break;
         }
+        
+        if (!idle) {
+            int step = compactd.moves_per_step;
+            pthread_mutex_unlock(&compactd.lock);
+            
+            int moved = compact_pages(step);
+            
+            pthread_mutex_lock(&compactd.lock);
+            if (moved > 0) compactd.passes++;
+            if (moved >= 0) continue;  // Finish the pass, one bounded step at a time
+        }
+        
+        struct timespec next_pass;
+        clock_gettime(CLOCK_MONOTONIC, &next_pass);
+        next_pass.tv_nsec += (long)compactd.interval_ms * 1000000L;
+        next_pass.tv_sec += next_pass.tv_nsec / 1000000000L;
+        next_pass.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&compactd.wakeup, &compactd.lock, &next_pass);
     }
     
-    if (page == -1) {
-        pthread_mutex_unlock(&memory_mgr.lock);
-        return MEM_ERROR_NO_FREE_PAGES;
+    pthread_mutex_unlock(&compactd.lock);
+    return NULL;
+}
+
+MemoryError start_compaction_thread(int interval_ms, int moves_per_step) {
+    pthread_mutex_lock(&compactd.lock);
+    compactd.interval_ms = interval_ms > 0 ? interval_ms : DEFAULT_COMPACTION_INTERVAL_MS;
+    compactd.moves_per_step = moves_per_step > 0 ? moves_per_step : DEFAULT_COMPACTION_STEP;
+    if (compactd.running) {
+        pthread_cond_signal(&compactd.wakeup);
+        pthread_mutex_unlock(&compactd.lock);
+        return MEM_SUCCESS;
     }
+    compactd.stop = 0;
+    __atomic_store_n(&compactd.pass_done, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&compactd.lock);
     
-    // Allocate the page
-    set_bit(memory_mgr.bitmap, page);
-    memory_mgr.pages[page].is_free = 0;
-    clock_gettime(CLOCK_MONOTONIC, &memory_mgr.pages[page].alloc_time);
-    memory_mgr.pages[page].owner_pid = getpid();
-    memory_mgr.free_pages--;
-    memory_mgr.total_allocations++;
-    
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&compactd.wakeup, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        return MEM_ERROR_INIT_FAILED;
+    }
+    pthread_condattr_destroy(&attr);
     
-    struct timespec diff;
-    if (end_time.tv_nsec < start_time.tv_nsec) {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec - 1;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec + 1000000000;
-    } else {
-        diff.tv_sec = end_time.tv_sec - start_time.tv_sec;
-        diff.tv_nsec = end_time.tv_nsec - start_time.tv_nsec;
+    if (pthread_create(&compactd.thread, NULL, compaction_thread_main, NULL) != 0) {
+        pthread_cond_destroy(&compactd.wakeup);
+        return MEM_ERROR_INIT_FAILED;
     }
+    compactd.running = 1;
     
-    double alloc_time = timespec_to_ms(&diff);
-    memory_mgr.total_alloc_time_ms += alloc_time;
+    MEM_LOG("Compaction thread started (every %d ms, %d pages per step)\n",
+            compactd.interval_ms, compactd.moves_per_step);
+    return MEM_SUCCESS;
+}
+
+void stop_compaction_thread(void) {
+    if (!compactd.running) return;
     
-    pthread_mutex_unlock(&memory_mgr.lock);
+    pthread_mutex_lock(&compactd.lock);
+    compactd.stop = 1;
+    pthread_cond_signal(&compactd.wakeup);
+    pthread_mutex_unlock(&compactd.lock);
     
-    printf("Allocated Page: %d (%.3f ms)\n", page, alloc_time);
-    return page;
+    pthread_join(compactd.thread, NULL);
+    compactd.running = 0;
+    pthread_cond_destroy(&compactd.wakeup);
+    MEM_LOG("Compaction thread stopped\n");
 }
 
-MemoryError free_page(int page_number) {
-    if (page_number < 0 || page_number >= NUM_PAGES) {
-        printf("Invalid Page Number: %d\n", page_number);
-        return MEM_ERROR_INVALID_PAGE;
+#define ZERO_POOL_MAX 256
+
+// Pages zeroed ahead of time by a low-priority thread, so allocate_zeroed_page
+// callers don't pay for clearing memory on their latency-critical path
+typedef struct {
+    int pages[ZERO_POOL_MAX];
+    int count;
+    int target;
+    pthread_mutex_t lock;
+    pthread_cond_t refill;
+    pthread_t thread;
+    int running;
+    int stop;
+    int shrinker_registered;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t pages_zeroed;
+} ZeroPagePool;
+
+static ZeroPagePool zero_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .refill = PTHREAD_COND_INITIALIZER
+};
+
+// Streaming stores bypass the cache so background zeroing doesn't evict the
+// working set of the threads doing real work
+static void zero_page_nontemporal(void* addr) {
+#if defined(__SSE2__) && PAGE_SIZE % 64 == 0
+    __m128i zero = _mm_setzero_si128();
+    __m128i* dst = (__m128i*)addr;
+    for (int i = 0; i < PAGE_SIZE / 16; i += 4) {
+        _mm_stream_si128(dst + i, zero);
+        _mm_stream_si128(dst + i + 1, zero);
+        _mm_stream_si128(dst + i + 2, zero);
+        _mm_stream_si128(dst + i + 3, zero);
+    }
+    _mm_sfence();
+#else
+    memset(addr, 0, PAGE_SIZE);
+#endif
+}
+
+// Reclaim callback: under memory pressure pooled pages go back to the allocator
+static int zero_pool_shrink(int nr_pages, void* ctx) {
+    ZeroPagePool* pool = ctx;
+    pthread_mutex_lock(&pool->lock);
+    int count = nr_pages < pool->count ? nr_pages : pool->count;
+    if (count > 0) {
+        pool->count -= count;
+        free_pages_bulk(&pool->pages[pool->count], count);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return count;
+}
+
+static void* zero_pool_thread_main(void* arg) {
+    (void)arg;
+#ifdef SCHED_IDLE
+    struct sched_param param = { 0 };
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
     
-    pthread_mutex_lock(&memory_mgr.lock);
+    pthread_mutex_lock(&zero_pool.lock);
+    while (!zero_pool.stop) {
+        // Only take pages the rest of the system can spare
+        if (zero_pool.count >= zero_pool.target ||
+            counter_load(&memory_mgr->free_pages) <= reclaimd.high_pages) {
+            pthread_cond_wait(&zero_pool.refill, &zero_pool.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&zero_pool.lock);
+        
+        int page = allocate_page_flags(ALLOC_NOWAIT);
+        if (page >= 0) {
+            zero_page_nontemporal(page_address(page));
+        }
+        
+        pthread_mutex_lock(&zero_pool.lock);
+        if (page < 0) {
+            pthread_cond_wait(&zero_pool.refill, &zero_pool.lock);
+            continue;
+        }
+        zero_pool.pages[zero_pool.count++] = page;
+        zero_pool.pages_zeroed++;
+    }
+    pthread_mutex_unlock(&zero_pool.lock);
+    return NULL;
+}
+
+MemoryError start_zero_pool_thread(int target_depth) {
+    if (target_depth <= 0) {
+        target_depth = NUM_PAGES / 8 > 0 ? NUM_PAGES / 8 : 1;
+    }
+    if (target_depth > ZERO_POOL_MAX) target_depth = ZERO_POOL_MAX;
     
-    if (memory_mgr.pages[page_number].is_free) {
-        pthread_mutex_unlock(&memory_mgr.lock);
-        printf("Error: Attempting to free already free page %d\n", page_number);
-        return MEM_ERROR_DOUBLE_FREE;
+    pthread_mutex_lock(&zero_pool.lock);
+    zero_pool.target = target_depth;
+    if (zero_pool.running) {
+        pthread_cond_signal(&zero_pool.refill);
+        pthread_mutex_unlock(&zero_pool.lock);
+        return MEM_SUCCESS;
     }
+    zero_pool.stop = 0;
+    pthread_mutex_unlock(&zero_pool.lock);
     
-    // Free the page
-    clear_bit(memory_mgr.bitmap, page_number);
-    memory_mgr.pages[page_number].is_free = 1;
-    memory_mgr.pages[page_number].owner_pid = 0;
-    memory_mgr.free_pages++;
-    memory_mgr.total_deallocations++;
+    if (!zero_pool.shrinker_registered &&
+        register_reclaim_callback(zero_pool_shrink, &zero_pool) == MEM_SUCCESS) {
+        zero_pool.shrinker_registered = 1;
+    }
     
-    pthread_mutex_unlock(&memory_mgr.lock);
+    if (pthread_create(&zero_pool.thread, NULL, zero_pool_thread_main, NULL) != 0) {
+        return MEM_ERROR_INIT_FAILED;
+    }
+    zero_pool.running = 1;
     
-    printf("Freed Page: %d\n", page_number);
+    MEM_LOG("Zero page pool started (target depth %d)\n", target_depth);
     return MEM_SUCCESS;
 }
 
+// Stops the zeroing thread and returns every pooled page to the allocator
+void stop_zero_pool_thread(void) {
+    if (zero_pool.running) {
+        pthread_mutex_lock(&zero_pool.lock);
+        zero_pool.stop = 1;
+        pthread_cond_signal(&zero_pool.refill);
+        pthread_mutex_unlock(&zero_pool.lock);
+        pthread_join(zero_pool.thread, NULL);
+        zero_pool.running = 0;
+    }
+    zero_pool_shrink(ZERO_POOL_MAX, &zero_pool);
+}
+
+// Returns a page whose contents are all zero, from the pre-zeroed pool when
+// possible and by clearing a fresh page synchronously otherwise
+int allocate_zeroed_page(void) {
+    pthread_mutex_lock(&zero_pool.lock);
+    if (zero_pool.count > 0) {
+        int page = zero_pool.pages[--zero_pool.count];
+        zero_pool.hits++;
+        if (zero_pool.running && zero_pool.count < zero_pool.target / 2 + 1) {
+            pthread_cond_signal(&zero_pool.refill);
+        }
+        pthread_mutex_unlock(&zero_pool.lock);
+        MEM_LOG("Allocated Zeroed Page: %d (pool)\n", page);
+        return page;
+    }
+    zero_pool.misses++;
+    if (zero_pool.running) {
+        pthread_cond_signal(&zero_pool.refill);
+    }
+    pthread_mutex_unlock(&zero_pool.lock);
+    
+    int page = allocate_page();
+    if (page >= 0) {
+        memset(page_address(page), 0, PAGE_SIZE);
+    }
+    return page;
+}
+
+void set_memory_verbose(int verbose) {
+    mem_verbose = verbose;
+}
+
+// Times 1 in 'interval' allocations; 1 times all of them, 0 none. Timing is
+// compiled out of lean builds.
+void set_alloc_timing_interval(uint32_t interval) {
+#ifdef MEM_LEAN
+    (void)interval;
+#else
+    alloc_timing_interval = interval;
+#endif
+}
+
 void print_memory_status() {
-    pthread_mutex_lock(&memory_mgr.lock);
+    mm_lock();
+    
+    int free_pages = counter_load(&memory_mgr->free_pages);
+    int total_allocations = counter_load(&memory_mgr->total_allocations);
     
     printf("\n=== Memory Manager Status ===\n");
-    printf("Free pages: %d/%d (%.1f%%)\n", 
-           memory_mgr.free_pages, NUM_PAGES, 
-           (memory_mgr.free_pages * 100.0) / NUM_PAGES);
-    printf("Free memory: %d bytes\n", memory_mgr.free_pages * PAGE_SIZE);
-    printf("Total allocations: %d\n", memory_mgr.total_allocations);
-    printf("Total deallocations: %d\n", memory_mgr.total_deallocations);
+    printf("Mode: %s%s\n", memory_mgr->mode == MEM_MODE_LOCKFREE ? "lock-free" : "mutex",
+           memory_mgr->process_shared ? " (process-shared)" : "");
+    printf("Free pages: %d/%d (%.1f%%)\n",
+           free_pages, NUM_PAGES,
+           (free_pages * 100.0) / NUM_PAGES);
+    printf("Free memory: %lld bytes\n", (long long)free_pages * PAGE_SIZE);
+    printf("Total allocations: %d\n", total_allocations);
+    printf("Total deallocations: %d\n", counter_load(&memory_mgr->total_deallocations));
+    
+#ifdef MEM_LEAN
+    printf("Page metadata: %zu bytes (bitmap only)\n", sizeof(memory_mgr->bitmap));
+#else
+    int timed_allocations = counter_load(&memory_mgr->timed_allocations);
+    if (timed_allocations > 0) {
+        printf("Average allocation time: %.1f ns (%d sampled, 1 in %u, %s)\n",
+               (double)__atomic_load_n(&memory_mgr->total_alloc_time_ns, __ATOMIC_RELAXED) /
+               timed_allocations, timed_allocations, alloc_timing_interval, fast_timer_source());
+    }
+    size_t tracking = sizeof(memory_mgr->alloc_time) + sizeof(memory_mgr->owner_pid) +
+                      sizeof(memory_mgr->share_count) + sizeof(memory_mgr->sharer_pid);
+    printf("Page metadata: %zu bytes (bitmap %zu + tracking %zu)\n",
+           sizeof(memory_mgr->bitmap) + tracking, sizeof(memory_mgr->bitmap), tracking);
+    
+    int shared_pages = 0;
+    long extra_refs = 0;
+    for (int i = 0; i < NUM_PAGES; i++) {
+        uint32_t shares = __atomic_load_n(&memory_mgr->share_count[i], __ATOMIC_RELAXED);
+        shared_pages += shares > 0;
+        extra_refs += shares;
+    }
+    int cow_copies = counter_load(&memory_mgr->cow_copies);
+    if (shared_pages > 0 || cow_copies > 0) {
+        printf("Shared pages: %d (%ld extra references), %d copy-on-write copies\n",
+               shared_pages, extra_refs, cow_copies);
+    }
+#endif
     
-    if (memory_mgr.total_allocations > 0) {
-        printf("Average allocation time: %.3f ms\n", 
-               memory_mgr.total_alloc_time_ms / memory_mgr.total_allocations);
+    int largest_run;
+    double fragmentation = fragmentation_index_locked(&largest_run);
+    printf("Fragmentation index: %.2f (largest free run %d of %d free pages)\n",
+           fragmentation, largest_run, free_pages);
+    int migrated = __atomic_load_n(&compactd.pages_migrated, __ATOMIC_RELAXED);
+    if (compactd.running || migrated > 0) {
+        printf("Compaction: %d pages migrated, %d background steps\n",
+               migrated, compactd.passes);
+    }
+    
+    printf("Watermarks: min=%d low=%d high=%d\n",
+           reclaimd.min_pages, reclaimd.low_pages, reclaimd.high_pages);
+    uint64_t zero_requests = zero_pool.hits + zero_pool.misses;
+    if (zero_pool.running || zero_requests > 0) {
+        printf("Zeroed pool: %d/%d pages, %llu hits / %llu requests (%.1f%% hit rate)\n",
+               zero_pool.count, zero_pool.target,
+               (unsigned long long)zero_pool.hits, (unsigned long long)zero_requests,
+               zero_requests > 0 ? (zero_pool.hits * 100.0) / zero_requests : 0.0);
+    }
+    if (reclaimd.running) {
+        printf("Reclaim: %d wakeups, %d pages reclaimed, %d throttled allocations (%d timed out), "
+               "%d refused without waiting\n",
+               reclaimd.wakeups, reclaimd.pages_reclaimed,
+               reclaimd.throttled_allocations, reclaimd.throttle_timeouts,
+               __atomic_load_n(&reclaimd.reserve_refusals, __ATOMIC_RELAXED));
     }
     
     struct timespec current_time;
     clock_gettime(CLOCK_MONOTONIC, &current_time);
-    double uptime = (current_time.tv_sec - memory_mgr.init_time.tv_sec) + 
-                   (current_time.tv_nsec - memory_mgr.init_time.tv_nsec) / 1000000000.0;
+    double uptime = (current_time.tv_sec - memory_mgr->init_time.tv_sec) +
+                   (current_time.tv_nsec - memory_mgr->init_time.tv_nsec) / 1000000000.0;
     printf("Uptime: %.2f seconds\n", uptime);
     printf("=============================\n\n");
     
-    pthread_mutex_unlock(&memory_mgr.lock);
+    mm_unlock();
 }
 
 void cleanup_memory_manager() {
-    pthread_mutex_destroy(&memory_mgr.lock);
-    printf("Memory manager cleaned up\n");
+    stop_compaction_thread();
+    stop_zero_pool_thread();
+    stop_reclaim_thread();
+    if (memory_mgr->process_shared) {
+        // Other processes may still be using the lock
+        detach_shared_memory();
+    } else {
+        pthread_mutex_destroy(&memory_mgr->lock);
+    }
+    MEM_LOG("Memory manager cleaned up\n");
+}
+
+#ifndef MEMORY_MANAGER_NO_MAIN
+#define DEMO_THREADS 4
+
+// Stand-in for a cache that holds on to pages until asked to shrink
+typedef struct {
+    int pages[NUM_PAGES];
+    int count;
+    pthread_mutex_t lock;
+} DemoPageCache;
+
+static DemoPageCache demo_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int demo_cache_shrink(int nr_pages, void* ctx) {
+    DemoPageCache* cache = ctx;
+    pthread_mutex_lock(&cache->lock);
+    int count = nr_pages < cache->count ? nr_pages : cache->count;
+    cache->count -= count;
+    free_pages_bulk(&cache->pages[cache->count], count);
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+// Owner-side handle for a movable page; compaction updates it in place.
+// Writers hold the lock, and compaction holds it from isolate to relocate.
+typedef struct {
+    int page;
+    int id;
+    pthread_mutex_t lock;
+} DemoObject;
+
+static int demo_isolate(void* handle, int page) {
+    (void)page;
+    return pthread_mutex_trylock(&((DemoObject*)handle)->lock) == 0;
+}
+
+static void demo_relocate(void* handle, int old_page, int new_page) {
+    DemoObject* object = handle;
+    (void)old_page;
+    object->page = new_page;
+    pthread_mutex_unlock(&object->lock);
+}
+
+static void* lockfree_worker(void* arg) {
+    int pages[NUM_PAGES / DEMO_THREADS];
+    int count = 0;
+    (void)arg;
+    
+    for (int i = 0; i < NUM_PAGES / DEMO_THREADS; i++) {
+        int page = allocate_page();
+        if (page >= 0) {
+            pages[count++] = page;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free_page(pages[i]);
+    }
+    return NULL;
 }
 
 int main() {
@@ -264,9 +2220,271 @@ int main() {
     
     print_memory_status();
     
+    printf("\n--- Bulk Free and Allocation ---\n");
+    int all_pages[NUM_PAGES];
+    for (int i = 0; i < NUM_PAGES; i++) {
+        all_pages[i] = i;
+    }
+    free_pages_bulk(all_pages, NUM_PAGES);
+    int bulk_count = allocate_pages_bulk(NUM_PAGES / 2, all_pages);
+    if (bulk_count > 0) {
+        free_pages_bulk(all_pages, bulk_count);
+        free_pages_bulk(all_pages, 1);  // Double free through the bulk path
+    }
+    
+    print_memory_status();
+    
+    printf("\n--- Copy-on-Write Sharing ---\n");
+    int page = allocate_page();
+    if (page >= 0 && share_page(page) > 0) {
+        // A snapshot shares the page; the writer gets a private copy
+        strcpy(page_address(page), "original");
+        int snapshot = page;
+        int writable = cow_write(page);
+        strcpy(page_address(writable), "modified");
+        printf("Writer sees \"%s\" in page %d, snapshot still sees \"%s\" in page %d (refs %d)\n",
+               (char*)page_address(writable), writable,
+               (char*)page_address(snapshot), snapshot, page_ref_count(snapshot));
+        print_memory_status();
+        free_page(writable);
+        free_page(snapshot);
+    } else {
+        printf("Page sharing needs reference counts (not in lean builds)\n");
+        free_page(page);
+    }
+    
+    printf("\n--- Page Coloring ---\n");
+    set_page_coloring(1);
+    int colored[4];
+    for (int i = 0; i < 4; i++) {
+        colored[i] = allocate_page();
+        printf("Round-robin page %d has color %d\n", colored[i], page_color(colored[i]));
+    }
+    page = allocate_page_color(PAGE_COLORS - 1);
+    printf("Hint for color %d got page %d (color %d)\n", PAGE_COLORS - 1, page, page_color(page));
+    set_page_coloring(0);
+    free_page(page);
+    free_pages_bulk(colored, 4);
+    
+    printf("\n--- Compaction ---\n");
+    set_memory_verbose(0);
+    // Keep every other page so the free space is scattered in single holes
+    DemoObject objects[NUM_PAGES / 2];
+    int object_count = 0;
+    int held_count = allocate_pages_bulk(NUM_PAGES, all_pages);
+    for (int i = 0; i < held_count; i++) {
+        char* data = page_address(all_pages[i]);
+        if (i % 2 == 0 || !data) {
+            free_page(all_pages[i]);
+            continue;
+        }
+        objects[object_count].page = all_pages[i];
+        objects[object_count].id = object_count;
+        pthread_mutex_init(&objects[object_count].lock, NULL);
+        snprintf(data, PAGE_SIZE, "object %d pass 0", object_count);
+        register_movable_page(all_pages[i], demo_isolate, demo_relocate, &objects[object_count]);
+        object_count++;
+    }
+    set_memory_verbose(1);
+    
+    int run = allocate_page_run(NUM_PAGES / 4);
+    printf("Run of %d pages before compaction: %s\n", NUM_PAGES / 4, run >= 0 ? "ok" : "failed");
+    if (run >= 0) free_page_run(run, NUM_PAGES / 4);
+    print_memory_status();
+    
+    start_compaction_thread(5, 2);
+    // Keep writing while pages move: an update can't land mid-copy and be lost
+    struct timespec compact_wait = { 0, 1000000L };
+    for (int pass = 1; pass <= 20; pass++) {
+        for (int i = 0; i < object_count; i++) {
+            pthread_mutex_lock(&objects[i].lock);
+            snprintf(page_address(objects[i].page), PAGE_SIZE, "object %d pass %d", objects[i].id, pass);
+            pthread_mutex_unlock(&objects[i].lock);
+        }
+        nanosleep(&compact_wait, NULL);
+    }
+    stop_compaction_thread();
+    
+    int intact = 0;
+    char expected[32];
+    for (int i = 0; i < object_count; i++) {
+        snprintf(expected, sizeof(expected), "object %d pass 20", objects[i].id);
+        intact += strcmp(page_address(objects[i].page), expected) == 0;
+    }
+    printf("%d/%d objects intact after migration\n", intact, object_count);
+    
+    run = allocate_page_run(NUM_PAGES / 4);
+    printf("Run of %d pages after compaction: %s\n", NUM_PAGES / 4, run >= 0 ? "ok" : "failed");
+    print_memory_status();
+    if (run >= 0) free_page_run(run, NUM_PAGES / 4);
+    for (int i = 0; i < object_count; i++) {
+        free_page(objects[i].page);
+        pthread_mutex_destroy(&objects[i].lock);
+    }
+    
+    printf("\n--- Checkpoint and Restart ---\n");
+    char checkpoint_path[64];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "/tmp/os_memory_demo_%d.ckpt", (int)getpid());
+    page = allocate_page();
+    char* saved_data = page_address(page);
+    if (saved_data) {
+        snprintf(saved_data, PAGE_SIZE, "survives restart");
+        save_memory_checkpoint(checkpoint_path, 0);
+        save_memory_checkpoint(checkpoint_path, 1);  // Second save goes to the other slot
+        free_page(page);
+        
+        if (restore_memory_checkpoint(checkpoint_path) == MEM_SUCCESS) {
+            printf("Page %d after restore: \"%s\"\n", page, (char*)page_address(page));
+            print_memory_status();
+        }
+        free_page(page);  // Allocated again in the restored state
+        unlink(checkpoint_path);
+    }
+    
+    printf("\n--- Lock-Free Mode: Concurrent Allocation ---\n");
+    set_allocation_mode(MEM_MODE_LOCKFREE);
+    
+    pthread_t workers[DEMO_THREADS];
+    for (int i = 0; i < DEMO_THREADS; i++) {
+        pthread_create(&workers[i], NULL, lockfree_worker, NULL);
+    }
+    for (int i = 0; i < DEMO_THREADS; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    
+    page = allocate_page();
+    free_page(page);
+    free_page(page);  // Double free is still detected without the lock
+    
+    print_memory_status();
+    
+    printf("\n--- Background Reclaim ---\n");
+    set_allocation_mode(MEM_MODE_LOCKED);
+    set_watermarks(NUM_PAGES / 8, NUM_PAGES / 4, NUM_PAGES / 2);
+    register_reclaim_callback(demo_cache_shrink, &demo_cache);
+    start_reclaim_thread();
+    
+    // Fill the cache until the pool is exhausted; reclaim keeps pages flowing
+    for (int i = 0; i < NUM_PAGES * 2; i++) {
+        page = allocate_page_flags(i % 2 ? ALLOC_NOWAIT : ALLOC_DEFAULT);
+        if (page < 0) continue;
+        pthread_mutex_lock(&demo_cache.lock);
+        demo_cache.pages[demo_cache.count++] = page;
+        pthread_mutex_unlock(&demo_cache.lock);
+    }
+    
+    // Give the reclaim thread a moment to restore the high watermark
+    struct timespec settle = { 0, 20 * 1000000L };
+    nanosleep(&settle, NULL);
+    print_memory_status();
+    
+    stop_reclaim_thread();
+    free_pages_bulk(demo_cache.pages, demo_cache.count);
+    demo_cache.count = 0;
+    
+    printf("\n--- Pre-Zeroed Page Pool ---\n");
+    set_watermarks(0, 0, 0);
+    start_zero_pool_thread(NUM_PAGES / 4);
+    nanosleep(&settle, NULL);
+    
+    int zeroed[NUM_PAGES / 2];
+    for (int i = 0; i < NUM_PAGES / 2; i++) {
+        zeroed[i] = allocate_zeroed_page();
+        if (zeroed[i] >= 0) {
+            memset(page_address(zeroed[i]), 0xAB, PAGE_SIZE);  // Dirty it for the next user
+        }
+    }
+    for (int i = 0; i < NUM_PAGES / 2; i++) {
+        if (zeroed[i] >= 0) free_page(zeroed[i]);
+    }
+    
+    page = allocate_zeroed_page();
+    const uint8_t* bytes = page_address(page);
+    int clean = 1;
+    for (int i = 0; bytes && i < PAGE_SIZE; i++) {
+        clean &= bytes[i] == 0;
+    }
+    printf("Page %d is %s after reuse\n", page, clean ? "zeroed" : "DIRTY");
+    free_page(page);
+    
+    print_memory_status();
+    
+    printf("\n--- Process-Shared Pool ---\n");
+    stop_zero_pool_thread();
+    char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), "/os_memory_demo_%d", (int)getpid());
+    if (initialize_shared_memory(shm_name) == MEM_SUCCESS) {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            // Worker takes pages from the shared pool and exits without freeing them
+            int held[NUM_PAGES / 4];
+            allocate_pages_bulk(NUM_PAGES / 4, held);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(child, NULL, 0);
+        print_memory_status();
+        
+        int reclaimed = reclaim_dead_owners();
+        if (reclaimed >= 0) {
+            printf("Reclaimed %d pages left behind by worker %d\n", reclaimed, (int)child);
+        } else {
+            printf("Dead-owner reclaim needs owner tracking (not in lean builds)\n");
+        }
+        print_memory_status();
+        
+        // A page shared with a second worker must outlive its owner and be
+        // reclaimed once the sharer exits as well
+        int to_parent[2], to_sharer[2];
+        if (reclaimed >= 0 && pipe(to_parent) == 0 && pipe(to_sharer) == 0) {
+            int shared = -1;
+            fflush(stdout);
+            pid_t owner = fork();
+            if (owner == 0) {
+                shared = allocate_page();
+                _exit(write(to_parent[1], &shared, sizeof(shared)) == sizeof(shared) ? 0 : 1);
+            }
+            if (read(to_parent[0], &shared, sizeof(shared)) != sizeof(shared)) shared = -1;
+            waitpid(owner, NULL, 0);
+            
+            pid_t sharer = fork();
+            if (sharer == 0) {
+                char go;
+                close(to_sharer[1]);
+                int refs = share_page(shared);
+                if (write(to_parent[1], &refs, sizeof(refs)) != sizeof(refs)) _exit(1);
+                _exit(read(to_sharer[0], &go, 1) < 0);  // Hold the reference until released
+            }
+            close(to_sharer[0]);
+            int refs = 0;
+            if (read(to_parent[0], &refs, sizeof(refs)) != sizeof(refs)) refs = 0;
+            printf("Page %d owned by worker %d, shared by worker %d (%d references)\n",
+                   shared, (int)owner, (int)sharer, refs);
+            
+            reclaimed = reclaim_dead_owners();
+            printf("Owner exited: reclaimed %d pages, page %d has %d references\n",
+                   reclaimed, shared, page_ref_count(shared));
+            
+            close(to_sharer[1]);
+            waitpid(sharer, NULL, 0);
+            reclaimed = reclaim_dead_owners();
+            printf("Sharer exited: reclaimed %d pages, page %d has %d references\n",
+                   reclaimed, shared, page_ref_count(shared));
+            close(to_parent[0]);
+            close(to_parent[1]);
+        }
+        
+        detach_shared_memory();
+        destroy_shared_memory(shm_name);
+    } else {
+        printf("Shared memory unavailable on this system\n");
+    }
+    
     printf("\n--- Cleanup ---\n");
     cleanup_memory_manager();
     
     printf("\nEnhanced memory manager demo completed successfully.\n");
     return 0;
-} 
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#ifndef MEMORY_MANAGER_H
+#define MEMORY_MANAGER_H
+
+#include <stdint.h>
+
+// Pool geometry can be overridden at build time, e.g. -DMEMORY_SIZE=(1L<<30).
+// Every translation unit linked against the manager must agree on it.
+#ifndef MEMORY_SIZE
+#define MEMORY_SIZE 1024
+#endif
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 64
+#endif
+#define NUM_PAGES ((int)(MEMORY_SIZE / PAGE_SIZE))
+
+// Cache colors: page p has color p % PAGE_COLORS, so pages of different
+// colors map to disjoint groups of cache sets. Must be a power of two; size it
+// as (cache size / associativity) / PAGE_SIZE for the cache being targeted.
+#ifndef PAGE_COLORS
+#define PAGE_COLORS 16
+#endif
+#define PAGE_COLOR_AUTO (-1)  // Next color in the calling thread's round-robin
+
+typedef enum {
+    MEM_SUCCESS = 0,
+    MEM_ERROR_NULL_POINTER = -1,
+    MEM_ERROR_NO_FREE_PAGES = -2,
+    MEM_ERROR_INVALID_PAGE = -3,
+    MEM_ERROR_DOUBLE_FREE = -4,
+    MEM_ERROR_INIT_FAILED = -5,
+    MEM_ERROR_UNSUPPORTED = -6
+} MemoryError;
+
+typedef enum {
+    MEM_MODE_LOCKED = 0,    // Bitmap guarded by the manager mutex
+    MEM_MODE_LOCKFREE = 1   // Bitmap words claimed with CAS, released with atomic AND
+} AllocationMode;
+
+// Watermarks apply while the reclaim thread runs; the pages below min are a
+// reserve that only ALLOC_RESERVE may take
+typedef enum {
+    ALLOC_DEFAULT = 0,  // Below the min watermark, wait briefly for reclaim, then fail
+    ALLOC_NOWAIT = 1,   // Never block; fails below the min watermark
+    ALLOC_RESERVE = 2   // Ignore the min watermark, for callers that must make progress
+} AllocFlags;
+
+// Asked to release up to nr_pages (via free_page/free_pages_bulk); returns
+// how many it actually freed. Called from the reclaim thread without any
+// memory manager lock held.
+typedef int (*ReclaimCallback)(int nr_pages, void* ctx);
+
+// Asked before compaction copies a registered page. Returning nonzero lets the
+// page move, and the owner must then not write to it until the relocate
+// callback; returning 0 leaves it in place for now. Runs with the manager
+// lock held; must not call back into it or block.
+typedef int (*IsolateCallback)(void* handle, int page);
+
+// Told that compaction moved a registered page's contents from old_page to
+// new_page. Runs with the manager lock held; must not call back into it.
+typedef void (*RelocateCallback)(void* handle, int old_page, int new_page);
+
+// Setup and teardown
+MemoryError initialize_memory(void);
+MemoryError initialize_shared_memory(const char* name);
+void detach_shared_memory(void);
+MemoryError destroy_shared_memory(const char* name);
+void cleanup_memory_manager(void);
+MemoryError set_allocation_mode(AllocationMode mode);
+void memory_prefork(void);
+void memory_postfork(void);
+void set_memory_verbose(int verbose);
+void set_alloc_timing_interval(uint32_t interval);
+MemoryError save_memory_checkpoint(const char* path, int include_contents);
+MemoryError restore_memory_checkpoint(const char* path);
+
+// Page allocation
+int allocate_page(void);
+int allocate_page_flags(AllocFlags flags);
+MemoryError free_page(int page_number);
+int allocate_pages_bulk(int n, int* out);
+MemoryError free_pages_bulk(const int* pages, int n);
+int allocate_zeroed_page(void);
+void* page_address(int page_number);
+
+// Cache coloring
+void set_page_coloring(int enabled);
+int allocate_page_color(int color);
+int page_color(int page_number);
+
+// Copy-on-write sharing
+int share_page(int page_number);
+int cow_write(int page_number);
+int page_ref_count(int page_number);
+
+// Contiguous runs and compaction (mutex mode only)
+int allocate_page_run(int n);
+MemoryError free_page_run(int first_page, int n);
+MemoryError register_movable_page(int page_number, IsolateCallback isolate,
+                                  RelocateCallback relocate, void* handle);
+MemoryError unregister_movable_page(int page_number);
+int compact_pages(int max_moves);
+double fragmentation_index(void);
+MemoryError start_compaction_thread(int interval_ms, int moves_per_step);
+void stop_compaction_thread(void);
+
+// Reclaim and background services
+MemoryError set_watermarks(int min_pages, int low_pages, int high_pages);
+MemoryError register_reclaim_callback(ReclaimCallback callback, void* ctx);
+void set_reclaim_wait_ms(int wait_ms);
+MemoryError start_reclaim_thread(void);
+void stop_reclaim_thread(void);
+MemoryError start_zero_pool_thread(int target_depth);
+void stop_zero_pool_thread(void);
+// Frees pages held by exited processes. A shared page passes from a dead
+// owner to the latest process that shared it; earlier sharers are not
+// recorded, so a page shared by three or more processes can be left
+// ownerless and stays allocated until a survivor frees it.
+int reclaim_dead_owners(void);
+
+void print_memory_status(void);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,863 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../memory/memory_manager.h"
+#include "../common/fast_timer.h"
+
+// Three-level page tables of 512 entries each cover 2^27 virtual pages
+#define VM_LEVELS 3
+#define VM_LEVEL_BITS 9
+#define VM_LEVEL_ENTRIES (1 << VM_LEVEL_BITS)
+#define VM_MAX_VPN (1ULL << (VM_LEVELS * VM_LEVEL_BITS))
+#define DEFAULT_SWAP_SLOTS 1024
+
+// Compressed tier: each pool page is split into ZSWAP_CHUNKS chunks and an
+// object takes a run of them inside one page. Pages that don't shrink to
+// ZSWAP_MAX_CHUNKS go straight to swap.
+#define ZSWAP_CHUNKS 16
+#define ZSWAP_CHUNK_SIZE (PAGE_SIZE / ZSWAP_CHUNKS)
+#define ZSWAP_MAX_CHUNKS (ZSWAP_CHUNKS * 3 / 4)
+#define ZSWAP_HEADER 2  // Compressed length, little-endian
+
+#if PAGE_SIZE % ZSWAP_CHUNKS != 0 || PAGE_SIZE > 65535
+#error "The compressed tier needs PAGE_SIZE divisible by 16 and below 64 KiB"
+#endif
+
+#define PTE_PRESENT 0x1u
+#define PTE_DIRTY   0x2u  // Modified since it was last written to swap
+
+typedef enum {
+    VM_SUCCESS = 0,
+    VM_ERROR_NULL_POINTER = -1,
+    VM_ERROR_INVALID_ADDRESS = -2,
+    VM_ERROR_OUT_OF_MEMORY = -3,
+    VM_ERROR_SWAP_FULL = -4,
+    VM_ERROR_IO = -5,
+    VM_ERROR_INIT_FAILED = -6
+} VmError;
+
+typedef struct {
+    uint32_t frame;      // Physical page from the memory manager while present
+    uint32_t swap_slot;  // Slot + 1 of the copy in the swap file, 0 if none
+    uint32_t zhandle;    // Handle + 1 of the copy in the compressed tier, 0 if none
+    uint32_t flags;
+} PageTableEntry;
+
+typedef struct VmSpace {
+    int id;
+    void** root;         // Interior levels hold table pointers, the last level PTEs
+    int resident_pages;
+    int table_pages;
+    uint64_t faults;
+} VmSpace;
+
+// Reverse map from a physical frame to the mapping using it, threaded on an
+// LRU list by frame number
+typedef struct {
+    VmSpace* owner;      // NULL when the frame isn't mapped by the VM
+    uint64_t vpn;
+    int prev;
+    int next;
+    uint16_t zchunks;    // Chunks in use while the frame backs the compressed pool
+} FrameInfo;
+
+typedef struct {
+    FrameInfo frames[NUM_PAGES];
+    int lru_head;        // Most recently used
+    int lru_tail;        // Least recently used, next eviction victim
+    int resident;
+    pthread_mutex_t lock;
+    FILE* swap_file;
+    int swap_fd;
+    uint64_t* swap_bitmap;
+    int swap_slots;
+    int swap_used;
+    uint64_t accesses;
+    uint64_t minor_faults;  // First touch, zero-filled
+    uint64_t major_faults;  // Read back from swap
+    uint64_t evictions;
+    uint64_t swap_outs;
+    uint64_t fault_ns_total;
+    uint64_t fault_ns_max;
+    // Compressed tier between resident frames and the swap file
+    int zpool_frames[NUM_PAGES];
+    int zpool_pages;
+    int zpool_max_pages;     // 0 disables the tier
+    int zswap_objects;
+    uint64_t zswap_bytes;    // Compressed bytes currently stored
+    uint64_t zswap_stores;
+    uint64_t zswap_rejects;  // Didn't compress below ZSWAP_MAX_CHUNKS
+    uint64_t zswap_pool_full;
+    uint64_t zswap_loads;    // Faults served from the tier
+    uint64_t decompress_ns_total;
+    uint64_t decompress_ns_max;
+} VirtualMemory;
+
+static VirtualMemory vm;
+
+static uint64_t elapsed_ns(const struct timespec* start, const struct timespec* end) {
+    return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL +
+           (uint64_t)(end->tv_nsec - start->tv_nsec);
+}
+
+static void lru_remove(int frame) {
+    FrameInfo* info = &vm.frames[frame];
+    if (info->prev >= 0) {
+        vm.frames[info->prev].next = info->next;
+    } else {
+        vm.lru_head = info->next;
+    }
+    if (info->next >= 0) {
+        vm.frames[info->next].prev = info->prev;
+    } else {
+        vm.lru_tail = info->prev;
+    }
+    info->prev = info->next = -1;
+}
+
+static void lru_add_head(int frame) {
+    FrameInfo* info = &vm.frames[frame];
+    info->prev = -1;
+    info->next = vm.lru_head;
+    if (vm.lru_head >= 0) {
+        vm.frames[vm.lru_head].prev = frame;
+    }
+    vm.lru_head = frame;
+    if (vm.lru_tail < 0) {
+        vm.lru_tail = frame;
+    }
+}
+
+static void lru_touch(int frame) {
+    if (vm.lru_head != frame) {
+        lru_remove(frame);
+        lru_add_head(frame);
+    }
+}
+
+static int swap_slot_alloc(void) {
+    for (int word = 0; word < (vm.swap_slots + 63) / 64; word++) {
+        if (vm.swap_bitmap[word] != ~0ULL) {
+            int slot = word * 64 + __builtin_ctzll(~vm.swap_bitmap[word]);
+            if (slot >= vm.swap_slots) break;
+            vm.swap_bitmap[word] |= 1ULL << (slot % 64);
+            vm.swap_used++;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static void swap_slot_free(int slot) {
+    vm.swap_bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+    vm.swap_used--;
+}
+
+// Byte-oriented LZ77 in the LZ4 sequence layout: a token with 4-bit literal
+// and match lengths (15 means more length bytes follow), the literals, then a
+// 16-bit offset. The last sequence carries literals only. Small and fast
+// enough to sit on the eviction path with no external dependency.
+#define LZ_MIN_MATCH 4
+#if PAGE_SIZE <= 256
+#define LZ_HASH_BITS 8
+#else
+#define LZ_HASH_BITS 12
+#endif
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int lz_hash(uint32_t v) {
+    return (int)((v * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+static int lz_put_length(uint8_t** op, const uint8_t* end, int len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= end) return -1;
+        *(*op)++ = 255;
+    }
+    if (*op >= end) return -1;
+    *(*op)++ = (uint8_t)len;
+    return 0;
+}
+
+static int lz_emit(uint8_t** op, const uint8_t* end, const uint8_t* literals, int literal_len,
+                   int offset, int match_len) {
+    int match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (*op >= end) return -1;
+    *(*op)++ = (uint8_t)((literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literal_len >= 15 && lz_put_length(op, end, literal_len - 15) < 0) return -1;
+    if (end - *op < literal_len) return -1;
+    memcpy(*op, literals, (size_t)literal_len);
+    *op += literal_len;
+    
+    if (match_len) {
+        if (end - *op < 2) return -1;
+        *(*op)++ = (uint8_t)(offset & 0xff);
+        *(*op)++ = (uint8_t)(offset >> 8);
+        if (match_code >= 15 && lz_put_length(op, end, match_code - 15) < 0) return -1;
+    }
+    return 0;
+}
+
+// Returns the compressed size, or -1 if it doesn't fit in cap bytes
+static int lz_compress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+    uint16_t table[1 << LZ_HASH_BITS];  // Position + 1 of the last 4-byte sequence per hash
+    memset(table, 0, sizeof(table));
+    
+    uint8_t* op = dst;
+    const uint8_t* end = dst + cap;
+    int anchor = 0;
+    int i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t v = lz_read32(src + i);
+        int h = lz_hash(v);
+        int candidate = table[h] - 1;
+        table[h] = (uint16_t)(i + 1);
+        
+        if (candidate >= 0 && lz_read32(src + candidate) == v) {
+            int len = LZ_MIN_MATCH;
+            while (i + len < n && src[candidate + len] == src[i + len]) {
+                len++;
+            }
+            if (lz_emit(&op, end, src + anchor, i - anchor, i - candidate, len) < 0) return -1;
+            i += len;
+            anchor = i;
+        } else {
+            i++;
+        }
+    }
+    if (lz_emit(&op, end, src + anchor, n - anchor, 0, 0) < 0) return -1;
+    return (int)(op - dst);
+}
+
+static int lz_get_length(const uint8_t** ip, const uint8_t* end, int* len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Returns the decompressed size, or -1 on malformed input
+static int lz_decompress(const uint8_t* src, int n, uint8_t* dst, int cap) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + n;
+    int out = 0;
+    
+    while (ip < end) {
+        uint8_t token = *ip++;
+        int literal_len = token >> 4;
+        if (literal_len == 15 && lz_get_length(&ip, end, &literal_len) < 0) return -1;
+        if (end - ip < literal_len || cap - out < literal_len) return -1;
+        memcpy(dst + out, ip, (size_t)literal_len);
+        ip += literal_len;
+        out += literal_len;
+        if (ip == end) break;  // Final, literal-only sequence
+        
+        if (end - ip < 2) return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && lz_get_length(&ip, end, &match_len) < 0) return -1;
+        if (offset == 0 || offset > out || cap - out < match_len) return -1;
+        uint8_t* op = dst + out;
+        const uint8_t* from = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, from, (size_t)match_len);
+        } else {
+            // The match overlaps its own output, i.e. repeats a period of
+            // 'offset' bytes; copy whole periods, doubling what is available
+            int copied = 0;
+            while (copied < match_len) {
+                int chunk = copied + offset < match_len - copied ? copied + offset : match_len - copied;
+                memcpy(op + copied, from, (size_t)chunk);
+                copied += chunk;
+            }
+        }
+        out += match_len;
+    }
+    return out;
+}
+
+static inline uint8_t* zpool_object(uint32_t handle) {
+    return (uint8_t*)page_address((int)(handle / ZSWAP_CHUNKS)) + (handle % ZSWAP_CHUNKS) * ZSWAP_CHUNK_SIZE;
+}
+
+static inline int zpool_object_chunks(int bytes) {
+    return (bytes + ZSWAP_CHUNK_SIZE - 1) / ZSWAP_CHUNK_SIZE;
+}
+
+// Finds a run of free chunks in an existing pool page; failing that the
+// eviction victim itself becomes a new pool page while under the limit.
+// Caller holds vm.lock.
+static int zpool_alloc(int chunks, int victim, int* absorbed) {
+    uint32_t run = (1u << chunks) - 1;
+    for (int i = 0; i < vm.zpool_pages; i++) {
+        int frame = vm.zpool_frames[i];
+        for (int first = 0; first + chunks <= ZSWAP_CHUNKS; first++) {
+            if (!(vm.frames[frame].zchunks & (run << first))) {
+                vm.frames[frame].zchunks |= (uint16_t)(run << first);
+                return frame * ZSWAP_CHUNKS + first;
+            }
+        }
+    }
+    
+    if (vm.zpool_pages >= vm.zpool_max_pages) {
+        return -1;
+    }
+    vm.zpool_frames[vm.zpool_pages++] = victim;
+    vm.frames[victim].zchunks = (uint16_t)run;
+    *absorbed = 1;
+    return victim * ZSWAP_CHUNKS;
+}
+
+// Releases an object; an emptied pool page goes back to the page allocator
+static void zpool_free(uint32_t handle) {
+    int frame = (int)(handle / ZSWAP_CHUNKS);
+    uint8_t* object = zpool_object(handle);
+    int bytes = object[0] | object[1] << 8;
+    int chunks = zpool_object_chunks(ZSWAP_HEADER + bytes);
+    
+    vm.frames[frame].zchunks &= (uint16_t)~(((1u << chunks) - 1) << (handle % ZSWAP_CHUNKS));
+    vm.zswap_objects--;
+    vm.zswap_bytes -= (uint64_t)bytes;
+    
+    if (vm.frames[frame].zchunks == 0) {
+        for (int i = 0; i < vm.zpool_pages; i++) {
+            if (vm.zpool_frames[i] == frame) {
+                vm.zpool_frames[i] = vm.zpool_frames[--vm.zpool_pages];
+                break;
+            }
+        }
+        free_page(frame);
+    }
+}
+
+// Compresses a dirty victim into the tier. Returns 1 if stored; *absorbed is
+// set when the victim frame itself was turned into a pool page.
+static int zswap_store(int frame, PageTableEntry* pte, int* absorbed) {
+    if (vm.zpool_max_pages == 0) {
+        return 0;
+    }
+    
+    uint8_t buf[ZSWAP_MAX_CHUNKS * ZSWAP_CHUNK_SIZE];
+    int bytes = lz_compress(page_address(frame), PAGE_SIZE, buf + ZSWAP_HEADER,
+                            (int)sizeof(buf) - ZSWAP_HEADER);
+    if (bytes < 0) {
+        vm.zswap_rejects++;
+        return 0;
+    }
+    buf[0] = (uint8_t)(bytes & 0xff);
+    buf[1] = (uint8_t)(bytes >> 8);
+    
+    int handle = zpool_alloc(zpool_object_chunks(ZSWAP_HEADER + bytes), frame, absorbed);
+    if (handle < 0) {
+        vm.zswap_pool_full++;
+        return 0;
+    }
+    memcpy(zpool_object((uint32_t)handle), buf, (size_t)(ZSWAP_HEADER + bytes));
+    
+    pte->zhandle = (uint32_t)handle + 1;
+    vm.zswap_objects++;
+    vm.zswap_bytes += (uint64_t)bytes;
+    vm.zswap_stores++;
+    return 1;
+}
+
+// Decompresses into frame and drops the compressed copy, so a page never
+// occupies both a frame and the pool
+static VmError zswap_load(int frame, PageTableEntry* pte) {
+    uint64_t start_ticks = fast_timer_now();
+    uint32_t handle = pte->zhandle - 1;
+    uint8_t* object = zpool_object(handle);
+    int bytes = object[0] | object[1] << 8;
+    
+    if (lz_decompress(object + ZSWAP_HEADER, bytes, page_address(frame), PAGE_SIZE) != PAGE_SIZE) {
+        return VM_ERROR_IO;
+    }
+    zpool_free(handle);
+    pte->zhandle = 0;
+    
+    uint64_t decompress_ns = fast_timer_elapsed_ns(start_ticks, fast_timer_now());
+    vm.decompress_ns_total += decompress_ns;
+    if (decompress_ns > vm.decompress_ns_max) {
+        vm.decompress_ns_max = decompress_ns;
+    }
+    vm.zswap_loads++;
+    return VM_SUCCESS;
+}
+
+// Returns the PTE for vpn, building missing intermediate tables when asked to
+static PageTableEntry* walk_page_table(VmSpace* space, uint64_t vpn, int create) {
+    void** table = space->root;
+    for (int level = VM_LEVELS - 1; level > 0; level--) {
+        int idx = (vpn >> (level * VM_LEVEL_BITS)) & (VM_LEVEL_ENTRIES - 1);
+        if (!table[idx]) {
+            if (!create) return NULL;
+            size_t entry_size = level == 1 ? sizeof(PageTableEntry) : sizeof(void*);
+            table[idx] = calloc(VM_LEVEL_ENTRIES, entry_size);
+            if (!table[idx]) return NULL;
+            space->table_pages++;
+        }
+        table = table[idx];
+    }
+    return &((PageTableEntry*)table)[vpn & (VM_LEVEL_ENTRIES - 1)];
+}
+
+// Writes a dirty page to its swap slot, allocating one on first write-out
+static VmError swap_out(int frame, PageTableEntry* pte) {
+    if (pte->swap_slot == 0) {
+        int slot = swap_slot_alloc();
+        if (slot < 0) {
+            return VM_ERROR_SWAP_FULL;
+        }
+        pte->swap_slot = (uint32_t)slot + 1;
+    }
+    off_t offset = (off_t)(pte->swap_slot - 1) * PAGE_SIZE;
+    if (pwrite(vm.swap_fd, page_address(frame), PAGE_SIZE, offset) != PAGE_SIZE) {
+        return VM_ERROR_IO;
+    }
+    vm.swap_outs++;
+    return VM_SUCCESS;
+}
+
+// Unmaps the least recently used frame, saving it to the compressed tier or
+// to swap if it holds data neither already has, and returns it for reuse.
+// Caller holds vm.lock.
+static int evict_lru_frame(VmError* err) {
+    int victim;
+    int absorbed;
+    do {
+        victim = vm.lru_tail;
+        if (victim < 0) {
+            *err = VM_ERROR_OUT_OF_MEMORY;
+            return -1;
+        }
+        absorbed = 0;
+        
+        FrameInfo* info = &vm.frames[victim];
+        PageTableEntry* pte = walk_page_table(info->owner, info->vpn, 0);
+        if ((pte->flags & PTE_DIRTY) && !zswap_store(victim, pte, &absorbed)) {
+            *err = swap_out(victim, pte);
+            if (*err != VM_SUCCESS) return -1;
+        }
+        // A clean page without a swap slot was never written and faults back in as zeros
+        
+        pte->flags &= ~(PTE_PRESENT | PTE_DIRTY);
+        lru_remove(victim);
+        info->owner->resident_pages--;
+        info->owner = NULL;
+        vm.resident--;
+        vm.evictions++;
+        // A victim that became a pool page can't be reused; evict another
+    } while (absorbed);
+    return victim;
+}
+
+static int handle_page_fault(VmSpace* space, uint64_t vpn, PageTableEntry* pte, VmError* err) {
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    
+    // Never block in the allocator while holding vm.lock; evict instead
+    int frame = allocate_page_flags(ALLOC_NOWAIT);
+    if (frame < 0) {
+        frame = evict_lru_frame(err);
+        if (frame < 0 && *err == VM_ERROR_OUT_OF_MEMORY) {
+            // Nothing resident to evict: this fault is what the reserve is for
+            frame = allocate_page_flags(ALLOC_NOWAIT | ALLOC_RESERVE);
+        }
+        if (frame < 0) return -1;
+    }
+    
+    void* addr = page_address(frame);
+    uint32_t flags = PTE_PRESENT;
+    if (pte->zhandle != 0) {
+        *err = zswap_load(frame, pte);
+        if (*err != VM_SUCCESS) {
+            free_page(frame);
+            return -1;
+        }
+        flags |= PTE_DIRTY;  // The compressed copy is gone and swap's may be stale
+    } else if (pte->swap_slot != 0) {
+        off_t offset = (off_t)(pte->swap_slot - 1) * PAGE_SIZE;
+        if (pread(vm.swap_fd, addr, PAGE_SIZE, offset) != PAGE_SIZE) {
+            free_page(frame);
+            *err = VM_ERROR_IO;
+            return -1;
+        }
+        vm.major_faults++;  // The swap copy stays valid until the page is dirtied
+    } else {
+        memset(addr, 0, PAGE_SIZE);
+        vm.minor_faults++;
+    }
+    
+    pte->frame = (uint32_t)frame;
+    pte->flags = flags;
+    vm.frames[frame].owner = space;
+    vm.frames[frame].vpn = vpn;
+    lru_add_head(frame);
+    space->resident_pages++;
+    space->faults++;
+    vm.resident++;
+    
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    uint64_t fault_ns = elapsed_ns(&start_time, &end_time);
+    vm.fault_ns_total += fault_ns;
+    if (fault_ns > vm.fault_ns_max) {
+        vm.fault_ns_max = fault_ns;
+    }
+    return frame;
+}
+
+// Caller holds vm.lock. Returns the frame backing vpn, faulting it in on first
+// touch or after eviction.
+static int translate(VmSpace* space, uint64_t vpn, int write, VmError* err) {
+    PageTableEntry* pte = walk_page_table(space, vpn, 1);
+    if (!pte) {
+        *err = VM_ERROR_OUT_OF_MEMORY;
+        return -1;
+    }
+    
+    vm.accesses++;
+    int frame;
+    if (pte->flags & PTE_PRESENT) {
+        frame = (int)pte->frame;
+        lru_touch(frame);
+    } else {
+        frame = handle_page_fault(space, vpn, pte, err);
+        if (frame < 0) return -1;
+    }
+    
+    if (write) {
+        pte->flags |= PTE_DIRTY;
+    }
+    return frame;
+}
+
+static VmError vm_access(VmSpace* space, uint64_t vaddr, void* buf, size_t len, int write) {
+    if (!space || !buf) return VM_ERROR_NULL_POINTER;
+    if (len == 0) return VM_SUCCESS;
+    if ((vaddr + len - 1) / PAGE_SIZE >= VM_MAX_VPN || vaddr + len < vaddr) {
+        return VM_ERROR_INVALID_ADDRESS;
+    }
+    
+    pthread_mutex_lock(&vm.lock);
+    
+    uint8_t* bytes = buf;
+    while (len > 0) {
+        uint64_t vpn = vaddr / PAGE_SIZE;
+        size_t offset = vaddr % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - offset < len ? PAGE_SIZE - offset : len;
+        
+        VmError err = VM_SUCCESS;
+        int frame = translate(space, vpn, write, &err);
+        if (frame < 0) {
+            pthread_mutex_unlock(&vm.lock);
+            return err;
+        }
+        
+        uint8_t* page = page_address(frame);
+        if (write) {
+            memcpy(page + offset, bytes, chunk);
+        } else {
+            memcpy(bytes, page + offset, chunk);
+        }
+        
+        bytes += chunk;
+        vaddr += chunk;
+        len -= chunk;
+    }
+    
+    pthread_mutex_unlock(&vm.lock);
+    return VM_SUCCESS;
+}
+
+VmError vm_read(VmSpace* space, uint64_t vaddr, void* buf, size_t len) {
+    return vm_access(space, vaddr, buf, len, 0);
+}
+
+VmError vm_write(VmSpace* space, uint64_t vaddr, const void* buf, size_t len) {
+    return vm_access(space, vaddr, (void*)buf, len, 1);
+}
+
+// Reclaim callback for the memory manager's background thread: evicts cold
+// frames and hands them back to the page allocator
+static int vm_shrink(int nr_pages, void* ctx) {
+    (void)ctx;
+    int freed = 0;
+    
+    pthread_mutex_lock(&vm.lock);
+    while (freed < nr_pages && vm.lru_tail >= 0) {
+        VmError err = VM_SUCCESS;
+        int frame = evict_lru_frame(&err);
+        if (frame < 0) break;
+        free_page(frame);
+        freed++;
+    }
+    pthread_mutex_unlock(&vm.lock);
+    return freed;
+}
+
+// swap_path NULL uses an anonymous temporary file
+VmError vm_init(const char* swap_path, int swap_slots) {
+    memset(&vm, 0, sizeof(VirtualMemory));
+    vm.lru_head = vm.lru_tail = -1;
+    for (int i = 0; i < NUM_PAGES; i++) {
+        vm.frames[i].prev = vm.frames[i].next = -1;
+    }
+    
+    if (pthread_mutex_init(&vm.lock, NULL) != 0) {
+        return VM_ERROR_INIT_FAILED;
+    }
+    
+    vm.swap_slots = swap_slots > 0 ? swap_slots : DEFAULT_SWAP_SLOTS;
+    vm.swap_bitmap = calloc((vm.swap_slots + 63) / 64, sizeof(uint64_t));
+    vm.swap_file = swap_path ? fopen(swap_path, "w+b") : tmpfile();
+    if (!vm.swap_bitmap || !vm.swap_file) {
+        free(vm.swap_bitmap);
+        if (vm.swap_file) fclose(vm.swap_file);
+        return VM_ERROR_INIT_FAILED;
+    }
+    vm.swap_fd = fileno(vm.swap_file);
+    
+    register_reclaim_callback(vm_shrink, NULL);
+    fast_timer_init();
+    
+    printf("Virtual Memory Layer initialized:\n");
+    printf("  - %d-level page tables, %d entries per level\n", VM_LEVELS, VM_LEVEL_ENTRIES);
+    printf("  - %d physical frames of %d bytes from the page allocator\n", NUM_PAGES, PAGE_SIZE);
+    printf("  - %d swap slots, LRU eviction\n\n", vm.swap_slots);
+    return VM_SUCCESS;
+}
+
+// Lets the compressed tier grow to max_pool_percent of the frames; 0 turns
+// it off for new evictions while pages already in it stay readable
+void vm_enable_zswap(int max_pool_percent) {
+    if (max_pool_percent < 0) max_pool_percent = 0;
+    if (max_pool_percent > 100) max_pool_percent = 100;
+    
+    pthread_mutex_lock(&vm.lock);
+    vm.zpool_max_pages = NUM_PAGES * max_pool_percent / 100;
+    if (max_pool_percent > 0 && vm.zpool_max_pages == 0) {
+        vm.zpool_max_pages = 1;
+    }
+    pthread_mutex_unlock(&vm.lock);
+    
+    printf("Compressed tier: up to %d pool frames, %d chunks of %d bytes each\n\n",
+           vm.zpool_max_pages, ZSWAP_CHUNKS, ZSWAP_CHUNK_SIZE);
+}
+
+VmSpace* vm_create_space(int id) {
+    VmSpace* space = calloc(1, sizeof(VmSpace));
+    if (!space) return NULL;
+    
+    space->root = calloc(VM_LEVEL_ENTRIES, sizeof(void*));
+    if (!space->root) {
+        free(space);
+        return NULL;
+    }
+    space->id = id;
+    space->table_pages = 1;
+    return space;
+}
+
+static void release_table(VmSpace* space, void** table, int level, uint64_t base_vpn) {
+    for (int i = 0; i < VM_LEVEL_ENTRIES; i++) {
+        if (!table[i]) continue;
+        uint64_t vpn = base_vpn | ((uint64_t)i << (level * VM_LEVEL_BITS));
+        
+        if (level > 1) {
+            release_table(space, table[i], level - 1, vpn);
+            continue;
+        }
+        
+        PageTableEntry* leaf = table[i];
+        for (int j = 0; j < VM_LEVEL_ENTRIES; j++) {
+            if (leaf[j].flags & PTE_PRESENT) {
+                lru_remove((int)leaf[j].frame);
+                vm.frames[leaf[j].frame].owner = NULL;
+                vm.resident--;
+                free_page((int)leaf[j].frame);
+            }
+            if (leaf[j].swap_slot != 0) {
+                swap_slot_free((int)leaf[j].swap_slot - 1);
+            }
+            if (leaf[j].zhandle != 0) {
+                zpool_free(leaf[j].zhandle - 1);
+            }
+        }
+        free(leaf);
+    }
+    free(table);
+}
+
+void vm_destroy_space(VmSpace* space) {
+    if (!space) return;
+    
+    pthread_mutex_lock(&vm.lock);
+    release_table(space, space->root, VM_LEVELS - 1, 0);
+    pthread_mutex_unlock(&vm.lock);
+    free(space);
+}
+
+void vm_print_stats(void) {
+    pthread_mutex_lock(&vm.lock);
+    
+    uint64_t faults = vm.minor_faults + vm.major_faults + vm.zswap_loads;
+    printf("\n=== Virtual Memory Statistics ===\n");
+    printf("Accesses: %llu\n", (unsigned long long)vm.accesses);
+    printf("Page faults: %llu (%.2f%% of accesses)\n", (unsigned long long)faults,
+           vm.accesses > 0 ? (faults * 100.0) / vm.accesses : 0.0);
+    printf("  Minor (zero-fill): %llu\n", (unsigned long long)vm.minor_faults);
+    printf("  Major (swap-in):   %llu\n", (unsigned long long)vm.major_faults);
+    printf("  Compressed tier:   %llu\n", (unsigned long long)vm.zswap_loads);
+    printf("Evictions: %llu (%llu written to swap)\n",
+           (unsigned long long)vm.evictions, (unsigned long long)vm.swap_outs);
+    if (faults > 0) {
+        printf("Fault service time: avg %.3f us, max %.3f us\n",
+               vm.fault_ns_total / 1000.0 / faults, vm.fault_ns_max / 1000.0);
+    }
+    printf("Resident frames: %d/%d\n", vm.resident, NUM_PAGES);
+    printf("Swap slots used: %d/%d\n", vm.swap_used, vm.swap_slots);
+    if (vm.zpool_max_pages > 0 || vm.zswap_stores > 0) {
+        uint64_t refaults = vm.zswap_loads + vm.major_faults;
+        printf("Compressed tier: %d pages in %d/%d pool frames (%llu bytes compressed)\n",
+               vm.zswap_objects, vm.zpool_pages, vm.zpool_max_pages,
+               (unsigned long long)vm.zswap_bytes);
+        if (vm.zswap_objects > 0) {
+            printf("  Compression ratio: %.2fx (%.2fx after chunk and pool overhead)\n",
+                   (double)vm.zswap_objects * PAGE_SIZE / vm.zswap_bytes,
+                   (double)vm.zswap_objects / vm.zpool_pages);
+        }
+        printf("  Stores: %llu, rejected as incompressible: %llu, pool full: %llu\n",
+               (unsigned long long)vm.zswap_stores, (unsigned long long)vm.zswap_rejects,
+               (unsigned long long)vm.zswap_pool_full);
+        if (refaults > 0) {
+            printf("  Tier hit rate: %.1f%% of refaults\n", vm.zswap_loads * 100.0 / refaults);
+        }
+        if (vm.zswap_loads > 0) {
+            printf("  Decompression: avg %.0f ns, max %llu ns\n",
+                   (double)vm.decompress_ns_total / vm.zswap_loads,
+                   (unsigned long long)vm.decompress_ns_max);
+        }
+    }
+    printf("=================================\n\n");
+    
+    pthread_mutex_unlock(&vm.lock);
+}
+
+void vm_print_space(const VmSpace* space) {
+    printf("Space %d: %d resident pages, %llu faults, %d page-table pages\n",
+           space->id, space->resident_pages, (unsigned long long)space->faults,
+           space->table_pages);
+}
+
+void vm_shutdown(void) {
+    if (vm.swap_file) {
+        fclose(vm.swap_file);
+        vm.swap_file = NULL;
+    }
+    free(vm.swap_bitmap);
+    vm.swap_bitmap = NULL;
+    pthread_mutex_destroy(&vm.lock);
+    printf("Virtual memory layer shut down\n");
+}
+
+int main() {
+    printf("Virtual Memory with Demand Paging\n");
+    printf("=================================\n\n");
+    
+    set_memory_verbose(0);
+    if (initialize_memory() != MEM_SUCCESS || vm_init(NULL, 256) != VM_SUCCESS) {
+        fprintf(stderr, "Failed to initialize virtual memory\n");
+        return 1;
+    }
+    
+    // A quarter of the frames may hold compressed pages before anything hits swap
+    vm_enable_zswap(25);
+    
+    VmSpace* dense = vm_create_space(1);
+    VmSpace* sparse = vm_create_space(2);
+    if (!dense || !sparse) {
+        fprintf(stderr, "Failed to create address spaces\n");
+        return 1;
+    }
+    
+    // Working set larger than physical memory forces eviction to swap
+    int dense_pages = NUM_PAGES + NUM_PAGES / 2;
+    int sparse_pages = NUM_PAGES / 2;
+    char record[32];
+    
+    printf("--- Writing %d pages (dense) and %d pages 1 MiB apart (sparse) ---\n",
+           dense_pages, sparse_pages);
+    for (int i = 0; i < dense_pages; i++) {
+        snprintf(record, sizeof(record), "dense page %d", i);
+        vm_write(dense, (uint64_t)i * PAGE_SIZE, record, strlen(record) + 1);
+    }
+    for (int i = 0; i < sparse_pages; i++) {
+        snprintf(record, sizeof(record), "sparse page %d", i);
+        vm_write(sparse, (uint64_t)i << 20, record, strlen(record) + 1);
+    }
+    
+    vm_print_space(dense);
+    vm_print_space(sparse);
+    vm_print_stats();
+    
+    printf("--- Reading everything back ---\n");
+    int mismatches = 0;
+    char expected[32];
+    for (int i = 0; i < dense_pages; i++) {
+        snprintf(expected, sizeof(expected), "dense page %d", i);
+        vm_read(dense, (uint64_t)i * PAGE_SIZE, record, strlen(expected) + 1);
+        mismatches += strcmp(record, expected) != 0;
+    }
+    for (int i = 0; i < sparse_pages; i++) {
+        snprintf(expected, sizeof(expected), "sparse page %d", i);
+        vm_read(sparse, (uint64_t)i << 20, record, strlen(expected) + 1);
+        mismatches += strcmp(record, expected) != 0;
+    }
+    printf("Verified %d pages, %d mismatches\n", dense_pages + sparse_pages, mismatches);
+    vm_print_stats();
+    
+    printf("--- Skewed access pattern with background reclaim ---\n");
+    set_watermarks(1, 2, 4);
+    start_reclaim_thread();
+    
+    // 90% of accesses go to a hot set that fits in memory
+    unsigned int seed = 42;
+    int hot_pages = NUM_PAGES / 2;
+    for (int i = 0; i < 2000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int cold = (seed >> 16) % 10 == 0;
+        int page = cold ? (int)((seed >> 8) % dense_pages) : (int)((seed >> 8) % hot_pages);
+        vm_read(dense, (uint64_t)page * PAGE_SIZE, record, 1);
+    }
+    
+    stop_reclaim_thread();
+    vm_print_space(dense);
+    vm_print_stats();
+    
+    vm_destroy_space(dense);
+    vm_destroy_space(sparse);
+    vm_shutdown();
+    print_memory_status();
+    cleanup_memory_manager();
+    
+    printf("\nVirtual memory demo completed successfully.\n");
+    return 0;
+}
\ No newline at end of file